@@ -71,6 +71,62 @@ void AssembleInst::setMux(mux val)
 	}
 }
 
+void AssembleInst::useVReg(unsigned vreg, bool write, RegAlloc::regClass allowed)
+{	for (auto& a : Usage.Access)
+		if (a.VReg == vreg && a.Write == write)
+		{	a.Allowed &= allowed;
+			return;
+		}
+	Usage.Access.push_back({ vreg, write, write && (InstCtx & IC_MUL), false, allowed });
+}
+
+void AssembleInst::useRead(reg_t reg, mux mux)
+{	if (reg.Virt)
+		// Unpack is only available for register file A.
+		useVReg(reg.Virt - 1, false, reg.Pack ? RegAlloc::RC_A : RegAlloc::RC_ALL);
+	else if (mux <= X_R3)
+		useVReg(RegAlloc::ACC + mux, false, RegAlloc::RC_ALL);
+	else if (mux >= X_RA)
+		switch (reg.Type & R_AB)
+		{case R_A:
+			Usage.Read |= RegAlloc::RC_A;
+			if (reg.Num < 32)
+				Usage.UsedA |= 1U << reg.Num;
+			break;
+		 case R_B:
+			Usage.Read |= RegAlloc::RC_B;
+			if (reg.Num < 32)
+				Usage.UsedB |= 1U << reg.Num;
+			break;
+		 default:
+			// peripheral register that is available in both register files
+			Usage.ReadAB |= 1U << (reg.Num & 31);
+		}
+}
+
+void AssembleInst::finishUsage(unsigned pc)
+{	if (Sig == S_BRANCH)
+	{	Usage.Branch = true;
+		Usage.CondBr = CondBr != B_AL;
+		Usage.Link = WAddrA != R_NOP || WAddrM != R_NOP;
+		Usage.Indirect = Reg;
+		Usage.Target = Rel ? pc + 4 + (Immd.iValue >> 3) : Immd.uValue >> 3;
+		return;
+	}
+	Usage.Thrsw = Sig == S_THRSW || Sig == S_LTHRSW;
+	if (Sig == S_SMI)
+		Usage.Read |= RegAlloc::RC_B;
+	for (auto& a : Usage.Access)
+		if (a.Write)
+		{	a.Cond = (a.Mul ? CondM : CondA) != C_AL;
+			// Register file A pack mode
+			if (Pack != P_32 && !PM)
+				a.Allowed &= RegAlloc::RC_A;
+		} else if (Sig < S_LDI && Unpack != U_32 && !PM)
+			// Register file A unpack
+			a.Allowed &= RegAlloc::RC_A;
+}
+
 Inst::mux AssembleInst::muxReg(reg_t reg)
 {	if (reg.Type & R_SEMA)
 		Fail("Cannot use semaphore source in ALU or read instruction.");
@@ -91,6 +147,7 @@ Inst::mux AssembleInst::muxReg(reg_t reg)
 		{RA:
 			if (!(reg.Type & R_B))
 				Flags |= IF_NORSWAP;
+			VirtRead = (VirtRead & ~1) | !!reg.Virt;
 			RAddrA = reg.Num;
 			ret = X_RA;
 			goto OK;
@@ -106,6 +163,7 @@ Inst::mux AssembleInst::muxReg(reg_t reg)
 		{RB:
 			if (!(reg.Type & R_A))
 				Flags |= IF_NORSWAP;
+			VirtRead = (VirtRead & ~2) | !!reg.Virt << 1;
 			RAddrB = reg.Num;
 			ret = X_RB;
 			goto OK;
@@ -130,6 +188,8 @@ Inst::mux AssembleInst::muxReg(reg_t reg)
 	Fail("Read access to register conflicts with another access to the same register file.");
 
  OK: // Assign result if one of IC_SRCAB is set
+	if (RecordUsage)
+		useRead(reg, ret);
 	setMux(ret);
 	return ret;
 }
@@ -640,8 +700,28 @@ int AssembleInst::applyMUL(opmul mul_op)
 void AssembleInst::applyTarget(reg_t reg)
 {
 	bool mul = (InstCtx & IC_MUL) != 0;
+	if (reg.Virt)
+	{	// Placeholder of a virtual register, the register file is not yet known.
+		VirtTarget |= 1 << mul;
+		if (RecordUsage)
+			useVReg(reg.Virt - 1, true, RegAlloc::RC_ALL);
+	} else if (RecordUsage)
+	{	if ((reg.Num ^ 32U) < 4U)
+			useVReg(RegAlloc::ACC + (reg.Num ^ 32), true, RegAlloc::RC_ALL);
+		else if (reg.Num < 32)
+			switch (reg.Type & R_AB)
+			{case R_A:
+				(mul ? Usage.WriteMul : Usage.WriteAdd) = RegAlloc::RC_A;
+				Usage.UsedA |= 1U << reg.Num;
+				break;
+			 case R_B:
+				(mul ? Usage.WriteMul : Usage.WriteAdd) = RegAlloc::RC_B;
+				Usage.UsedB |= 1U << reg.Num;
+			}
+	}
 	if ((reg.Type & R_AB) != R_AB)
-	{	bool wsfreeze = !isWRegAB(mul ? WAddrA : WAddrM); // Can't swap the other target register.
+	{	// Can't swap the other target register unless it is a virtual register.
+		bool wsfreeze = !isWRegAB(mul ? WAddrA : WAddrM) && !(VirtTarget & (mul ? 1 : 2));
 		if ((reg.Type & R_A) && (!wsfreeze || WS == mul))
 			WS = mul;
 		else if ((reg.Type & R_B) && (!wsfreeze || WS != mul))
@@ -871,6 +951,8 @@ void AssembleInst::applyREADsrc(exprValue src)
 			Fail("Vector rotations cannot be used at read.");
 		if (muxReg(src.rValue) <= X_R5)
 			Fail("Accumulators cannot be used at read.");
+		if (RecordUsage && src.rValue.Virt)
+			useVReg(src.rValue.Virt - 1, false, RegAlloc::RC_AB);
 		applyPackUnpack(src.rValue.Pack);
 		break;
 	 case V_INT:
@@ -921,6 +1003,13 @@ bool AssembleInst::applyBranchSource(exprValue val, unsigned pc)
 			Msg(WARNING, "A branch target without 32 bit alignment probably does not hit the nail on the head.");
 		break;
 	 case V_REG:
+		if (val.rValue.Virt)
+		{	// Placeholder of a virtual register, branch targets are read from register file A.
+			if (RecordUsage)
+				useVReg(val.rValue.Virt - 1, false, RegAlloc::RC_A);
+			Reg = true;
+			break;
+		}
 		if (val.rValue.Num == R_NOP && !val.rValue.Rotate && (val.rValue.Type & R_AB))
 			break;
 		if (!(val.rValue.Type & R_A) || val.rValue.Num >= 32)
@@ -939,6 +1028,10 @@ bool AssembleInst::applyBranchSource(exprValue val, unsigned pc)
 		}
 		Reg = true;
 		RAddrA = val.rValue.Num;
+		if (RecordUsage)
+		{	Usage.Read |= RegAlloc::RC_A;
+			Usage.UsedA |= 1U << RAddrA;
+		}
 		break;
 	}
 
@@ -962,13 +1055,14 @@ void AssembleInst::applySignal(sig signal)
 bool AssembleInst::tryRABSwap()
 {	if ( !isALU()          // can't swap ldi and branch
 		|| (Unpack && !PM)   // can't swap with regfile A unpack
-		|| !isRRegAB(RAddrA) // regfile A read not invariant
-		|| !isRRegAB(RAddrB) // regfile B read not invariant
+		|| !(isRRegAB(RAddrA) || (VirtRead & 1)) // regfile A read not invariant
+		|| !(isRRegAB(RAddrB) || (VirtRead & 2)) // regfile B read not invariant
 		|| ( Sig == S_LDI    // can't swap small immediate, but vector rotation is OK
 			&& (MuxAA == X_RB || MuxAB == X_RB || MuxMA == X_RB || MuxMB == X_RB) ))
 		return false;
 	// execute swap
 	swap(RAddrA, RAddrB);
+	VirtRead = (VirtRead >> 1 | VirtRead << 1) & 3;
 	if (MuxAA >= X_RA) (uint8_t&)MuxAA ^= X_RA^X_RB;
 	if (MuxAB >= X_RA) (uint8_t&)MuxAB ^= X_RA^X_RB;
 	if (MuxMA >= X_RA) (uint8_t&)MuxMA ^= X_RA^X_RB;
@@ -977,69 +1071,9 @@ bool AssembleInst::tryRABSwap()
 }
 
 bool AssembleInst::tryALUSwap()
-{	if (Flags & IF_NOASWAP)
+{	if ((Flags & IF_NOASWAP) || !swapALU())
 		return false;
 
-	if ( !isALU()      // can't swap ldi and branch
-		|| SF            // can't swap with set flags
-		|| (Pack && PM)  // can't swap with MUL ALU pack
-		|| (Sig == S_SMI && SImmd >= 48) ) // can't swap with vector rotation
-		return false;
-	opadd opa;
-	switch (OpM)
-	{default:
-		return false;
-	 case M_V8ADDS:
-		opa = A_V8ADDS;
-		break;
-	 case M_V8SUBS:
-		opa = A_V8SUBS;
-		break;
-	 case M_V8MIN:
-	 case M_V8MAX:
-		if (MuxMA != MuxMB)
-			return false;
-		opa = A_OR;
-		break;
-	 case M_NOP:
-		opa = A_NOP;
-		break;
-	}
-	opmul opm;
-	switch (OpA)
-	{default:
-		return false;
-	 case A_V8ADDS:
-		opm = M_V8ADDS;
-		break;
-	 case A_XOR:
-	 case A_SUB:
-		if (MuxAA != MuxAB)
-			return false;
-	 case A_V8SUBS:
-		opm = M_V8SUBS;
-		break;
-	 case A_OR:
-	 case A_AND:
-	 case A_MIN:
-	 case A_MAX:
-		if (MuxAA != MuxAB)
-			return false;
-		opm = M_V8MIN;
-		break;
-	 case A_NOP:
-		opm = M_NOP;
-		break;
-	}
-	// execute swap
-	OpA = opa;
-	OpM = opm;
-	swap(MuxAA, MuxMA);
-	swap(MuxAB, MuxMB);
-	swap(CondA, CondM);
-	swap(WAddrA, WAddrM);
-	WS = !WS;
-
 	InstCtx ^= IC_BOTH;
 	if (UsePack)
 		UsePack ^= IC_BOTH;
@@ -1050,18 +1084,6 @@ bool AssembleInst::tryALUSwap()
 	return true;
 }
 
-bool AssembleInst::isTMUconflict() const
-{	return isALU()
-		&& ( ((0xfff09e0000000000ULL & (1ULL << WAddrA)) != 0)
-		+ ((0xfff09e0000000000ULL & (1ULL << WAddrM)) != 0)
-		+ ((0x0008060000000000ULL & (1ULL << RAddrA)) != 0)
-		+ (Sig != S_SMI && (0x0008060000000000ULL & (1ULL << RAddrB)) != 0)
-		+ ( Sig == S_LDTMU0 || Sig == S_LDTMU1
-			|| Sig == S_LOADCV || Sig == S_LOADAM
-			|| (Sig == S_LDI && (LdMode & L_SEMA)) )
-		+ (WAddrA == 45 || WAddrA == 46 || WAddrM == 45 || WAddrM == 46 || Sig == S_LOADC || Sig == S_LDCEND) ) > 1;
-}
-
 void AssembleInst::optimize()
 {	qpuValue val;
 	switch (Sig)
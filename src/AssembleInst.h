@@ -12,6 +12,7 @@
 #include "Message.h"
 #include "expr.h"
 #include "Inst.h"
+#include "RegAlloc.h"
 
 #include <assert.h>
 
@@ -43,6 +44,7 @@ class AssembleInst : private Inst
 	,	IF_DATA          = 8    ///< Result of .data directive, do not optimize
 	,	IF_NORSWAP       = 16   ///< Do not swap regfile A and regfile B peripheral register
 	,	IF_NOASWAP       = 32   ///< Do not swap ADD and MUL ALU
+	,	IF_PIPELINE      = 64   ///< Start of a loop marked by .pipeline
 	};
 	CLASSFLAGSENUM(instFlags, unsigned char);
 
@@ -78,7 +80,11 @@ class AssembleInst : private Inst
  public:
 	/// Current expression context.
 	instContext      InstCtx;
-	instFlags        Flags;
+	instFlags        Flags = IF_NONE;
+	/// Record the register usage of each instruction in \ref Usage for the virtual register allocator.
+	bool             RecordUsage = false;
+	/// Register usage of the current instruction, only maintained if \ref RecordUsage is set.
+	RegAlloc::inst   Usage;
 
  private: // items valid per opcode...
 	/// Pack mode used by the current instruction in this contexts.
@@ -88,12 +94,17 @@ class AssembleInst : private Inst
 	instContext      UseUnpack;
 	/// Vector rotation used by the current instruction in this contexts.
 	instContext      UseRot;
+	/// ALU targets of the current instruction that are placeholders of virtual registers, bit 0: ADD ALU, bit 1: MUL ALU.
+	uint8_t          VirtTarget;
+	/// Register file reads of the current instruction that are placeholders of virtual registers, bit 0: regfile A, bit 1: regfile B.
+	/// @details Placeholders can be swapped to the other register file like I/O registers.
+	uint8_t          VirtRead;
 
  public:
 	AssembleInst() {}
 	~AssembleInst() {}
 
-	void             reset() { Inst::reset(); UseUnpack = UsePack = IC_NONE; }
+	void             reset() { Inst::reset(); UseUnpack = UsePack = IC_NONE; VirtTarget = VirtRead = 0; if (RecordUsage) Usage.clear(); }
 
 	/// Apply \c .if opcode extension
 	/// @param cond Requested condition code.
@@ -171,9 +182,12 @@ class AssembleInst : private Inst
 	bool             applyBranchSource(exprValue val, unsigned pc);
 
 	void             applySignal(sig signal);
+	/// @brief Complete \ref Usage after the instruction has been parsed.
+	/// @details Adds conditions, implicit register file access and the branch target.
+	/// @param pc Location of the current instruction.
+	void             finishUsage(unsigned pc);
 
-	/// Check whether the current instruction has concurrent access to TMU resources.
-	bool             isTMUconflict() const;
+	using            Inst::isTMUconflict;
 
 	/// Some optimizations to save ALU power
 	void             optimize();
@@ -239,6 +253,15 @@ class AssembleInst : private Inst
 	/// @exception std::string Error, i.e. no valid register or the current instruction cannot read this register because of conflicts
 	/// with other parts of the same instruction word.
 	Inst::mux        muxReg(reg_t reg);
+	/// Record access to a virtual register or accumulator in \ref Usage.
+	/// @param vreg Virtual register ID or RegAlloc::ACC + n.
+	/// @param write Write access.
+	/// @param allowed Register classes that can handle this access.
+	void             useVReg(unsigned vreg, bool write, RegAlloc::regClass allowed);
+	/// Record read access of the current instruction in \ref Usage.
+	/// @param reg Source register.
+	/// @param mux Multiplexer that reads the register.
+	void             useRead(reg_t reg, mux mux);
 	/// Set small immediate value. Fail if impossible.
 	/// @param si desired value.
 	/// @exception std::string Failed because of conflicts with other components of the current instruction word.
@@ -0,0 +1,71 @@
+/*
+ * DebugInfo.cpp
+ *
+ *  Created on: 19.10.2026
+ *      Author: mueller
+ */
+
+#include "DebugInfo.h"
+
+#include <algorithm>
+
+
+size_t DebugInfo::locations::find(unsigned pc) const
+{	return upper_bound(Runs.begin(), Runs.end(), pc,
+		[](unsigned pc, const run& r) { return pc < r.Start; } ) - Runs.begin() - 1;
+}
+
+void DebugInfo::locations::push_back(const location& loc)
+{	if (!Runs.size() || Runs.back().Loc != loc)
+		Runs.emplace_back(Count, loc);
+	++Count;
+}
+
+void DebugInfo::locations::append(const location& loc, unsigned count)
+{	if (!count)
+		return;
+	push_back(loc);
+	Count += count - 1;
+}
+
+void DebugInfo::locations::insert(unsigned pc, const location& loc)
+{	if (pc >= Count)
+		return push_back(loc);
+
+	auto rp = Runs.begin() + find(pc);
+	if (rp->Loc == loc)
+		// Same location as the covering run => just extend it.
+		++rp;
+	else if (rp->Start == pc && rp != Runs.begin() && rp[-1].Loc == loc)
+		// Same location as the previous run => extend the previous one.
+		;
+	else if (rp->Start == pc)
+		// New run in front of rp.
+		rp = Runs.emplace(rp, pc, loc) + 1;
+	else
+	{	// Split rp.
+		location split = rp->Loc;
+		rp = Runs.emplace(rp + 1, pc, loc);
+		rp = Runs.emplace(rp + 1, pc, split) + 1;
+		// the latter run moves with the other entries below
+		rp[-1].Start = pc + 1;
+	}
+	// Move the following runs one slot towards the end.
+	for (; rp != Runs.end(); ++rp)
+		++rp->Start;
+	++Count;
+}
+
+void DebugInfo::locations::discard(unsigned pc)
+{	if (!Runs.size() || pc <= Runs.front().Start)
+		return;
+	auto rp = Runs.begin() + find(min(pc, Count - 1));
+	rp->Start = max(rp->Start, min(pc, Count));
+	Runs.erase(Runs.begin(), rp);
+}
+
+DebugInfo::location DebugInfo::locations::operator[](unsigned pc) const
+{	if (pc >= Count || pc < Runs.front().Start)
+		return location();
+	return Runs[find(pc)].Loc;
+}
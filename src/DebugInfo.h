@@ -1,7 +1,10 @@
 #ifndef DEBUGINFO_H_
 #define DEBUGINFO_H_
 
+#include "expr.h"
+
 #include <string>
+#include <vector>
 #include <unordered_map>
 #include <cinttypes>
 
@@ -17,9 +20,54 @@ struct DebugInfo
 	/// Reference to a line of assembler code (for messages).
 	struct location
 	{	uint16_t       File; ///< Source file containing the line. This is only an index into SourceFiles.
-		uint16_t       Line; ///< Line number in the source file
+		uint32_t       Line; ///< Line number in the source file
 		location()     : File(0), Line(0) {}///< create uninitialized instance, assign File and Line by yourself
 		bool operator !() const { return !Line; }///< Is this instance not initialized, i.e. Line == 0
+		bool operator==(const location& r) const { return File == r.File && Line == r.Line; }
+		bool operator!=(const location& r) const { return !(*this == r); }
+	};
+
+	/// @brief Run length compressed table of locations per instruction.
+	/// @details Consecutive instructions that origin from the same source line,
+	/// e.g. data directives, \c .clone or repeated code, share a single entry.
+	/// The index of the table is the PC in GPU words, exactly like the index of Instructions.
+	class locations
+	{	/// Entry of the table. It covers all instructions from Start up to the Start of the next entry.
+		struct run
+		{	unsigned   Start;///< First instruction with this location.
+			location   Loc;  ///< Location of the instructions.
+			run(unsigned start, const location& loc) : Start(start), Loc(loc) {}
+		};
+		/// Runs ordered by Start. The first entry, if any, starts at 0 unless discard has been called.
+		vector<run>  Runs;
+		/// Number of instructions covered by Runs.
+		unsigned     Count = 0;
+		/// Find the run that covers \a pc.
+		/// @return Index into Runs.
+		/// @pre pc < Count, pc is not discarded
+		size_t       find(unsigned pc) const;
+	 public:
+		/// Number of instructions, not the number of table entries.
+		unsigned     size() const { return Count; }
+		/// Number of table entries.
+		size_t       runs() const { return Runs.size(); }
+		/// Discard all entries.
+		void         clear() { Runs.clear(); Count = 0; }
+		/// Append the location of the next instruction.
+		void         push_back(const location& loc);
+		/// Append the location of \a count instructions at once.
+		void         append(const location& loc, unsigned count);
+		/// @brief Insert the location of an instruction at \a pc.
+		/// @details All following instructions move one slot towards the end,
+		/// i.e. this is the equivalent to a \c .back block.
+		/// @pre pc <= size()
+		void         insert(unsigned pc, const location& loc);
+		/// @brief Drop the locations of all instructions before \a pc to save memory.
+		/// @details The indices of the remaining instructions do not change.
+		void         discard(unsigned pc);
+		/// @brief Location of the instruction \a pc.
+		/// @return Location of the instruction or an uninitialized location if \a pc is out of range or discarded.
+		location     operator[](unsigned pc) const;
 	};
 
 	/// Source file entry
@@ -56,7 +104,7 @@ struct DebugInfo
 	/// @brief Debug Info: locations per instruction in Instructions.
 	/// @details The index of each entry corresponds to the indices in Instruction.
 	/// This is only valid after EnsurePass2 has been called.
-	vector<location> LineNumbers;
+	locations        LineNumbers;
 	/// Segment properties ordered by Start address.
 	vector<segment>  Segments;
 };
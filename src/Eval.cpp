@@ -13,9 +13,10 @@
 #include <cstdlib>
 #include <cstdarg>
 #include <climits>
+#include <algorithm>
 
 
-Eval::operate::operate(vector<exprEntry>& stack)
+Eval::operate::operate(stack& stack)
 :	rhs(stack.back())
 ,	lhs(stack[stack.size()-2])
 ,	types((1 << rhs.Type) | !isUnary(lhs.Op) * (1 << lhs.Type))
@@ -104,6 +105,10 @@ int Eval::operate::Compare()
 			goto less;
 		if (lhs.rValue.Pack.Mode > rhs.rValue.Pack.Mode)
 			goto less;
+		if (lhs.rValue.Virt < rhs.rValue.Virt)
+			goto less;
+		if (lhs.rValue.Virt > rhs.rValue.Virt)
+			goto greater;
 		goto equal;
 	 default:
 		if (lhs.Type > rhs.Type)
@@ -299,6 +304,8 @@ bool Eval::operate::Apply(bool unary)
 		 case 1<<V_REG | 1<<V_INT:
 			if (rhs.Type == V_REG)
 				swap((exprValue&)lhs, (exprValue&)rhs);
+			if (lhs.rValue.Virt)
+				throw Message("Cannot calculate with the number of a virtual register.");
 			if ( rhs.iValue < -64 || rhs.iValue > 64
 				|| (lhs.rValue.Num += (uint8_t)rhs.iValue) > 63
 				|| ((lhs.rValue.Type & R_SEMA) && lhs.rValue.Num > 15) )
@@ -325,6 +332,8 @@ bool Eval::operate::Apply(bool unary)
 		 case 1<<V_REG | 1<<V_INT:
 			if (rhs.Type == V_REG)
 				TypesFail();
+			if (lhs.rValue.Virt)
+				throw Message("Cannot calculate with the number of a virtual register.");
 			if ( rhs.iValue < -64 || rhs.iValue > 64
 				|| (lhs.rValue.Num -= (uint8_t)rhs.iValue) > 63
 				|| ((lhs.rValue.Type & R_SEMA) && lhs.rValue.Num > 15) )
@@ -481,6 +490,41 @@ bool Eval::operate::Apply(bool unary)
 }
 
 
+Eval::exprEntry* Eval::arena::get(size_t& capacity)
+{	for (auto fp = Free.begin(); fp != Free.end(); ++fp)
+		if (fp->first >= capacity)
+		{	capacity = fp->first;
+			exprEntry* block = fp->second;
+			*fp = Free.back();
+			Free.pop_back();
+			return block;
+		}
+	return new exprEntry[capacity];
+}
+
+Eval::arena::~arena()
+{	for (auto& block : Free)
+		delete[] block.second;
+}
+
+void Eval::stack::grow()
+{	size_t capacity = Capacity * 2;
+	exprEntry* data = Arena ? Arena->get(capacity) : new exprEntry[capacity];
+	copy(Data, Data + Size, data);
+	release();
+	Data = data;
+	Capacity = capacity;
+}
+
+void Eval::stack::release()
+{	if (Data == Inline)
+		return;
+	if (Arena)
+		Arena->put(Data, Capacity);
+	else
+		delete[] Data;
+}
+
 bool Eval::partialEvaluate(bool unary)
 {	while (true)
 	{	if (Stack.size() <= 1)
@@ -546,6 +590,7 @@ exprValue Eval::Evaluate()
 			current.rValue.Rotate = 0;
 			current.rValue.Type = R_RWAB;
 			current.rValue.Pack.reset();
+			current.rValue.Virt = 0;
 			return current;
 		}
 		throw Message("Incomplete expression: expected value.");
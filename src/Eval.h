@@ -103,16 +103,65 @@ class Eval
 	{	mathOp    Op;    ///< Operator, NOP by default
 		exprEntry() : Op(NOP) {}
 	};
+ public:
+	/// @brief Reusable storage for evaluation stacks that exceed the inline capacity of Eval.
+	/// @details Blocks are returned to the arena when the Eval instance is destroyed
+	/// and reused by later instances. So deeply nested expressions allocate only once.
+	/// Any number of Eval instances may share one arena, e.g. for nested function arguments.
+	class arena
+	{	friend class Eval;
+		/// Unused blocks: capacity and storage.
+		vector<pair<size_t,exprEntry*>> Free;
+		/// @brief Fetch a block.
+		/// @param capacity [in] minimum number of entries, [out] capacity of the returned block.
+		exprEntry*  get(size_t& capacity);
+		/// Return a block for reuse.
+		void        put(exprEntry* block, size_t capacity) { Free.emplace_back(capacity, block); }
+	 public:
+		            arena() {}
+		            arena(const arena&) = delete;
+		void        operator=(const arena&) = delete;
+		            ~arena();
+	};
+ private:
+	/// @brief Evaluation stack with inline storage for typical expression depths.
+	/// @details Deeper expressions take their storage from \ref arena if any or from the heap otherwise.
+	/// The interface is a subset of vector.
+	class stack
+	{	/// Number of entries available without dynamic allocation.
+		enum { INLINE = 16 };
+		exprEntry   Inline[INLINE];
+		exprEntry*  Data;     ///< Current storage, either Inline or a dynamic block.
+		size_t      Size;     ///< Number of used entries.
+		size_t      Capacity; ///< Number of entries available at Data.
+		arena*      Arena;    ///< Source of dynamic blocks or NULL.
+		/// Double the capacity.
+		void        grow();
+		/// Discard a dynamic block if any.
+		void        release();
+	 public:
+		/// Create a stack with one initial entry.
+		            stack(arena* a) : Data(Inline), Size(1), Capacity(INLINE), Arena(a) {}
+		            stack(const stack&) = delete;
+		void        operator=(const stack&) = delete;
+		            ~stack() { release(); }
+		size_t      size() const { return Size; }
+		exprEntry&  front() { return *Data; }
+		exprEntry&  back() { return Data[Size - 1]; }
+		exprEntry&  operator[](size_t i) { return Data[i]; }
+		void        emplace_back() { if (Size == Capacity) grow(); Data[Size++] = exprEntry(); }
+		void        pop_back() { --Size; }
+	};
 	/// @brief Evaluation stack
-	/// @details This vector contains at least one element which is initially { V_NONE, NOP }.
+	/// @details This stack contains at least one element which is initially { V_NONE, NOP }.
 	/// When Operators or values are added the fields are filled. After each operator added
-	/// a new initial entry is added at the end of the vector.
+	/// a new initial entry is added at the end of the stack.
 	/// @par Except for intermediate states the evaluation stack will always contain
 	/// the operators strictly monotonic ordered by precedence.
 	/// If an operator with lower precedence is added the stack is evaluated immediately
 	/// until the condition is met again. I.e. all operators with higher or same precedence
 	/// than the one to be added are evaluated back to front.
-	vector<exprEntry> Stack;
+	stack       Stack;
 
 	/// Helper class to evaluate an operator on the stack.
 	class operate
@@ -185,7 +234,7 @@ class Eval
 		/// @details Evaluate the operator of the last but one stack entry
 		/// with last but one value as left hand side (unless the operator is unary)
 		/// and the last value as right hand side.
-		operate(vector<exprEntry>& stack);
+		operate(stack& stack);
 		/// @brief Perform the evaluation if the last operator has lower precedence
 		/// than the last but one operator.
 		/// @param unary Evaluate unary operators only.
@@ -205,8 +254,9 @@ class Eval
 	/// This happens when parsing the last argument to a function.
 	bool        partialEvaluate(bool unary);
  public:
-	/// Create an empty evaluation stack.
-	            Eval() { Stack.emplace_back(); }
+	/// @brief Create an empty evaluation stack.
+	/// @param arena Storage for deep expressions, optional.
+	            Eval(arena* arena = NULL) : Stack(arena) {}
 	/// @brief Push an operator on the evaluation stack.
 	/// @param op Operator to push.
 	/// If this is a binary operator the last object pushed on the stack must be a value or a closing brace.
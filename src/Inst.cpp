@@ -45,7 +45,7 @@ bool Inst::evalADD(qpuValue& l, qpuValue r)
 		else if (!isfinite(l.fValue))
 			l.uValue = (l.uValue & 0x80000000) | 0x7f800000;
 		else
-		l.fValue += r.fValue;
+			l.fValue -= r.fValue;
 		break;
 	 case A_FMINABS:
 		l.uValue &= 0x7fffffff;
@@ -369,6 +369,81 @@ void Inst::decode(uint64_t code)
 		(uint8_t&)Unpack |= PM || isFloatRA() ? U_FLT : U_INT;
 }
 
+bool Inst::isTMUconflict() const
+{	return isALU()
+		&& ( ((0xfff09e0000000000ULL & (1ULL << WAddrA)) != 0)
+		+ ((0xfff09e0000000000ULL & (1ULL << WAddrM)) != 0)
+		+ ((0x0008060000000000ULL & (1ULL << RAddrA)) != 0)
+		+ (Sig != S_SMI && (0x0008060000000000ULL & (1ULL << RAddrB)) != 0)
+		+ ( Sig == S_LDTMU0 || Sig == S_LDTMU1
+			|| Sig == S_LOADCV || Sig == S_LOADAM
+			|| (Sig == S_LDI && (LdMode & L_SEMA)) )
+		+ (WAddrA == 45 || WAddrA == 46 || WAddrM == 45 || WAddrM == 46 || Sig == S_LOADC || Sig == S_LDCEND) ) > 1;
+}
+
+bool Inst::swapALU()
+{	if ( !isALU()      // can't swap ldi and branch
+		|| SF            // can't swap with set flags
+		|| (Pack && PM)  // can't swap with MUL ALU pack
+		|| (Sig == S_SMI && SImmd >= 48) ) // can't swap with vector rotation
+		return false;
+	opadd opa;
+	switch (OpM)
+	{default:
+		return false;
+	 case M_V8ADDS:
+		opa = A_V8ADDS;
+		break;
+	 case M_V8SUBS:
+		opa = A_V8SUBS;
+		break;
+	 case M_V8MIN:
+	 case M_V8MAX:
+		if (MuxMA != MuxMB)
+			return false;
+		opa = A_OR;
+		break;
+	 case M_NOP:
+		opa = A_NOP;
+		break;
+	}
+	opmul opm;
+	switch (OpA)
+	{default:
+		return false;
+	 case A_V8ADDS:
+		opm = M_V8ADDS;
+		break;
+	 case A_XOR:
+	 case A_SUB:
+		if (MuxAA != MuxAB)
+			return false;
+	 case A_V8SUBS:
+		opm = M_V8SUBS;
+		break;
+	 case A_OR:
+	 case A_AND:
+	 case A_MIN:
+	 case A_MAX:
+		if (MuxAA != MuxAB)
+			return false;
+		opm = M_V8MIN;
+		break;
+	 case A_NOP:
+		opm = M_NOP;
+		break;
+	}
+	// execute swap
+	OpA = opa;
+	OpM = opm;
+	swap(MuxAA, MuxMA);
+	swap(MuxAB, MuxMB);
+	swap(CondA, CondM);
+	swap(WAddrA, WAddrM);
+	WS = !WS;
+	return true;
+}
+
 qpuValue Inst::SMIValue() const
 { qpuValue ret;
 	ret.uValue = 0;
@@ -325,6 +325,17 @@ struct Inst
 	/// @pre Sig < S_LDI
 	bool       isFloatRA() const { return ((MuxAA == X_RA || MuxAB == X_RA) && OpA - 1U <= 6U) || ((MuxMA == X_RA || MuxMB == X_RA) && OpM == M_FMUL); }
 
+	/// @brief Check whether the instruction has concurrent access to TMU, TLB, SFU or mutex resources.
+	/// @details At most one of these resources can be accessed by an instruction word.
+	/// @return true: the instruction is invalid.
+	bool       isTMUconflict() const;
+	/// @brief Swap ADD and MUL ALU.
+	/// @details This works only for operators that are available in both ALUs
+	/// and for \c mov emulated by \c or or \c v8min.
+	/// WS is inverted to keep the targets in the same register file.
+	/// @return true: swap succeeded, false: instruction unchanged
+	bool       swapALU();
+
 	/// Encode instruction to QPU binary format
 	uint64_t   encode() const;
 	/// Decode instruction from QPU binary format into this instance.
@@ -0,0 +1,3209 @@
+/*
+ * Optimizer.cpp
+ *
+ *  Created on: 19.10.2026
+ *      Author: mueller
+ */
+
+#include "Optimizer.h"
+
+#include <algorithm>
+#include <cstring>
+#include <cstdarg>
+#include <cmath>
+
+
+const Optimizer::passEntry Optimizer::passMap[] =
+{	{"bank",       O_BANK }
+,	{"const",      O_CONST }
+,	{"dead",       O_DEAD }
+,	{"delay",      O_DELAY }
+,	{"flags",      O_FLAGS }
+,	{"hoist",      O_HOIST }
+,	{"ifconv",     O_IFCONV }
+,	{"jump",       O_JUMP }
+,	{"layout",     O_LAYOUT }
+,	{"pair",       O_PAIR }
+,	{"peephole",   O_PEEPHOLE }
+,	{"pipeline",   O_PIPELINE }
+,	{"schedule",   O_SCHEDULE }
+,	{"sfu",        O_SFU }
+,	{"tmu",        O_TMU }
+};
+
+const Optimizer::rule Optimizer::rules[] =
+{	{"selfmov",  "Removed move of a register to itself.",                  true,  &Optimizer::ruleSelfMove }
+,	{"dupmov",   "Removed move of a value that the register already has.", true,  &Optimizer::ruleDupMove }
+,	{"forward",  "Read from accumulator instead of register file.",        false, &Optimizer::ruleForward }
+,	{"ldimov",   "Replaced move of a constant by ldi.",                    false, &Optimizer::ruleLdiMove }
+,	{"deadwrite","Removed write to a register that is overwritten before use.", true, &Optimizer::ruleDeadWrite }
+};
+
+Optimizer::Optimizer()
+:	Ops(2)
+{	// pseudo instruction in front of each block
+	Ops[TAIL].Wr = usage(~0ULL, U_ALL);
+	// pseudo instruction after each block
+	Ops[HEAD].Rd = usage(~0ULL, U_ALL);
+	Ops[HEAD].Wr = usage(~0ULL, U_ALL);
+	for (op& o : Ops)
+	{	o.I.reset();
+		o.Raw = 0;
+		o.Origin = o.Target = NONE;
+		o.Skip = 0;
+		o.Data = false;
+		o.Pinned = o.NoSwap = true;
+	}
+}
+
+Optimizer::passes Optimizer::ParsePasses(const char* list)
+{	passes ret = O_NONE;
+	while (*list)
+	{	const char* end = strchr(list, ',');
+		if (!end)
+			end = list + strlen(list);
+		bool remove = *list == '-';
+		string name(list + remove, end);
+		passes pass = O_ALL;
+		if (name != "all")
+		{	const passEntry* ep = binary_search(passMap, name.c_str());
+			if (!ep)
+				throw stringf("Unknown optimization pass '%s'.", name.c_str());
+			pass = ep->Pass;
+		}
+		ret = remove ? (passes)(ret & ~pass) : ret | pass;
+		list = *end ? end + 1 : end;
+	}
+	return ret;
+}
+
+void Optimizer::Note(unsigned op, const char* pass, const char* fmt, ...)
+{	va_list va;
+	va_start(va, fmt);
+	Notes.push_back(note{op, op < Ops.size() ? Ops[op].Loc : DebugInfo::location(), pass, vstringf(fmt, va)});
+	va_end(va);
+}
+
+void Optimizer::analyze(op& o)
+{	o.Rd = o.Wr = usage();
+	if (o.Data)
+		return;
+	const Inst& i = o.I;
+
+	// Side effects of a read port, even if no input mux uses the value.
+	auto readPort = [&o](uint8_t reg)
+	{	switch (reg)
+		{case 32: // unif
+			o.Rd.Misc |= U_UNIF|U_IO;
+			o.Wr.Misc |= U_IO;
+		 case 38: // elem_num, qpu_num
+		 case 39: // nop
+		 case 40:
+		 case 41: // x_pixel_coord, y_pixel_coord
+			return;
+		 case 42: // ms_flags, rev_flag
+			o.Rd.Misc |= U_MSFLAGS|U_IO;
+			return;
+		 case 48: // vpm
+		 case 49: // vr_busy, vw_busy
+		 case 50: // vr_wait, vw_wait
+			o.Rd.Misc |= U_VPM;
+		 default:
+			if (reg >= 32)
+			{	o.Rd.Misc |= U_IO;
+				o.Wr.Misc |= U_IO;
+			}
+		}
+	};
+	auto readMux = [&o, &i](Inst::mux m)
+	{	if (m <= Inst::X_R5)
+			o.Rd.Misc |= U_R0 << m;
+		else if (m == Inst::X_RA)
+		{	if (i.RAddrA < 32)
+				o.Rd.Regs |= 1ULL << i.RAddrA;
+		} else if (i.Sig != Inst::S_SMI && i.RAddrB < 32)
+			o.Rd.Regs |= 1ULL << 32 << i.RAddrB;
+	};
+	auto write = [&o](uint8_t reg, bool regfileB, Inst::conda cond)
+	{	if (cond == Inst::C_NEVER || reg == Inst::R_NOP)
+			return;
+		usage u;
+		if (reg < 32)
+			u.Regs = 1ULL << (reg + 32 * regfileB);
+		else switch (reg)
+		{case 32: // r0
+		 case 33: // r1
+		 case 34: // r2
+		 case 35: // r3
+			u.Misc = U_R0 << (reg - 32); break;
+		 case 36: // tmu_noswap
+			u.Misc = U_NOSWAP|U_IO; break;
+		 case 37: // r5quad, r5rep
+			u.Misc = U_R5; break;
+		 case 40: // unif_addr, unif_addr_rel
+			u.Misc = U_UNIFADDR|U_IO; break;
+		 case 44: // tlbz
+			u.Misc = U_TLBZ|U_IO; break;
+		 case 48: // vpm
+			u.Misc = U_VPM|U_IO; break;
+		 case 49: // vr_setup, vw_setup
+		 case 50: // vr_addr, vw_addr
+			u.Misc = U_VPMSETUP|U_IO; break;
+		 case 52: // sfu_recip
+		 case 53: // sfu_recipsqrt
+		 case 54: // sfu_exp
+		 case 55: // sfu_log
+			u.Misc = U_SFU|U_R4; break;
+		 default:
+			if (reg >= 56) // TMU
+				u.Misc = U_TMU|U_IO;
+			else
+				u.Misc = U_IO;
+		}
+		o.Wr |= u;
+		// conditional write keeps the old value
+		if (cond != Inst::C_AL)
+		{	o.Rd |= u;
+			o.Rd.Misc |= U_FLAGS;
+		}
+	};
+
+	switch (i.Sig)
+	{case Inst::S_BRANCH:
+		if (i.CondBr != Inst::B_AL)
+			o.Rd.Misc |= U_FLAGS;
+		if (i.Reg && i.RAddrA < 32)
+			o.Rd.Regs |= 1ULL << i.RAddrA;
+		// link register
+		write(i.WAddrA, i.WS, Inst::C_AL);
+		write(i.WAddrM, !i.WS, Inst::C_AL);
+		return;
+	 case Inst::S_LDI:
+		if (i.LdMode & Inst::L_SEMA)
+		{	o.Rd.Misc |= U_IO;
+			o.Wr.Misc |= U_IO;
+		}
+		write(i.WAddrA, i.WS, i.CondA);
+		write(i.WAddrM, !i.WS, i.CondM);
+		return;
+	 case Inst::S_SMI:
+		if (i.SImmd >= 48)
+		{	// vector rotation
+			if (Inst::isAccu(i.MuxMA))
+				o.Rd.Misc |= U_ROT0 << i.MuxMA;
+			if (Inst::isAccu(i.MuxMB))
+				o.Rd.Misc |= U_ROT0 << i.MuxMB;
+			if (i.SImmd == 48) // rotate by r5
+				o.Rd.Misc |= U_ROT0 << 5 | U_R5;
+		}
+		break;
+	 case Inst::S_LDTMU0:
+	 case Inst::S_LDTMU1:
+	 case Inst::S_LOADCV:
+	 case Inst::S_LOADC:
+	 case Inst::S_LDCEND:
+	 case Inst::S_LOADAM:
+		o.Wr.Misc |= U_R4|U_LDR4;
+	 case Inst::S_BREAK:
+	 case Inst::S_THRSW:
+	 case Inst::S_THREND:
+	 case Inst::S_SBWAIT:
+	 case Inst::S_SBDONE:
+	 case Inst::S_LTHRSW:
+		o.Rd.Misc |= U_IO;
+		o.Wr.Misc |= U_IO;
+	 default:;
+	}
+
+	readPort(i.RAddrA);
+	if (i.Sig != Inst::S_SMI)
+		readPort(i.RAddrB);
+	if (i.isADD())
+	{	readMux(i.MuxAA);
+		readMux(i.MuxAB);
+	}
+	if (i.isMUL())
+	{	readMux(i.MuxMA);
+		readMux(i.MuxMB);
+	}
+	if (i.SF)
+		o.Wr.Misc |= U_FLAGS;
+	write(i.WAddrA, i.WS, i.isADD() ? i.CondA : Inst::C_NEVER);
+	write(i.WAddrM, !i.WS, i.isMUL() ? i.CondM : Inst::C_NEVER);
+	// partial writes of pack modes keep the remaining bits
+	if (i.Pack & (15 >> i.PM))
+		o.Rd |= usage(o.Wr.Regs, o.Wr.Misc & (U_ACCU|U_IO));
+}
+
+unsigned Optimizer::hazards(const op& e, const op& l, unsigned dist)
+{	unsigned ret = 0;
+	if (dist == 1 && (e.Wr.Regs & l.Rd.Regs))
+		ret |= H_REGFILE;
+	if (dist <= 2 && (e.Wr.Misc & U_SFU) && ((l.Rd.Misc & U_R4) || (l.Wr.Misc & (U_SFU|U_LDR4))))
+		ret |= H_SFU;
+	if (dist <= 2 && (e.Wr.Misc & U_UNIFADDR) && (l.Rd.Misc & U_UNIF))
+		ret |= H_UNIF;
+	if (dist <= 3 && (e.Wr.Misc & U_NOSWAP) && (l.Wr.Misc & U_TMU))
+		ret |= H_NOSWAP;
+	if (dist <= 2 && (e.Wr.Misc & U_TLBZ) && (l.Rd.Misc & U_MSFLAGS))
+		ret |= H_TLBZ;
+	if (dist == 1 && (e.Wr.Misc & (l.Rd.Misc / U_ROT0) & U_ACCU))
+		ret |= H_ROT;
+	if (dist <= 3 && (e.Wr.Misc & U_VPMSETUP) && ((l.Rd.Misc | l.Wr.Misc) & U_VPM))
+		ret |= H_VPM;
+	return ret;
+}
+
+unsigned Optimizer::latency(const op& e, const op& l)
+{	unsigned dist = 1;
+	while (dist <= MAX_DEPEND && hazards(e, l, dist))
+		++dist;
+	if ((e.Wr.Misc & U_TMU) && (l.Wr.Misc & U_LDR4))
+		dist = max(dist, (unsigned)TMU_LATENCY);
+	return dist;
+}
+
+bool Optimizer::readsMux(const Inst& i, Inst::mux m)
+{	return (i.isADD() && (i.MuxAA == m || i.MuxAB == m))
+		|| (i.isMUL() && (i.MuxMA == m || i.MuxMB == m));
+}
+
+bool Optimizer::isMove(const Inst& i, Inst::mux& src, usage& dst)
+{	if ((i.Sig != Inst::S_NONE && i.Sig != Inst::S_SMI) || i.SF || (i.Unpack & 7) || (i.Pack & (15 >> i.PM)))
+		return false;
+	uint8_t reg;
+	bool regB;
+	if (i.isADD() && !i.isMUL())
+	{	if (i.OpA != Inst::A_OR || i.MuxAA != i.MuxAB || i.CondA != Inst::C_AL)
+			return false;
+		src = i.MuxAA;
+		reg = i.WAddrA;
+		regB = i.WS;
+	} else if (i.isMUL() && !i.isADD())
+	{	if (i.OpM != Inst::M_V8MIN || i.MuxMA != i.MuxMB || i.CondM != Inst::C_AL)
+			return false;
+		src = i.MuxMA;
+		reg = i.WAddrM;
+		regB = !i.WS;
+	} else
+		return false;
+	if (i.Sig == Inst::S_SMI && i.SImmd >= 48)
+		return false; // vector rotation
+	if (reg < 32)
+		dst = usage(1ULL << (reg + 32 * regB), 0);
+	else if (reg <= 35) // r0..r3
+		dst = usage(0, U_R0 << (reg - 32));
+	else
+		return false;
+	return true;
+}
+
+Optimizer::usage Optimizer::muxUsage(const Inst& i, Inst::mux m)
+{	switch (m)
+	{default:
+		return usage(0, U_R0 << m);
+	 case Inst::X_RA:
+		return usage(i.RAddrA < 32 ? 1ULL << i.RAddrA : 0, 0);
+	 case Inst::X_RB:
+		return usage(i.Sig != Inst::S_SMI && i.RAddrB < 32 ? 1ULL << 32 << i.RAddrB : 0, 0);
+	}
+}
+
+bool Optimizer::sameSource(const Inst& a, const Inst& b, Inst::mux m)
+{	switch (m)
+	{default:
+		return true;
+	 case Inst::X_RA:
+		return a.RAddrA == b.RAddrA && a.RAddrA < 32;
+	 case Inst::X_RB:
+		if ((a.Sig == Inst::S_SMI) != (b.Sig == Inst::S_SMI))
+			return false;
+		return a.Sig == Inst::S_SMI ? a.SImmd == b.SImmd : a.RAddrB == b.RAddrB && a.RAddrB < 32;
+	}
+}
+
+bool Optimizer::merge(const Inst& a, const Inst& b, Inst& r)
+{	if ((a.isADD() && b.isADD()) || (a.isMUL() && b.isMUL()))
+		return false;
+	r = a;
+	if (b.isADD())
+	{	r.OpA = b.OpA;
+		r.MuxAA = b.MuxAA;
+		r.MuxAB = b.MuxAB;
+		r.WAddrA = b.WAddrA;
+		r.CondA = b.CondA;
+	}
+	if (b.isMUL())
+	{	r.OpM = b.OpM;
+		r.MuxMA = b.MuxMA;
+		r.MuxMB = b.MuxMB;
+		r.WAddrM = b.WAddrM;
+		r.CondM = b.CondM;
+	}
+
+	// signals
+	if (b.Sig != Inst::S_NONE)
+	{	if (a.Sig == Inst::S_NONE)
+			r.Sig = b.Sig;
+		else if (a.Sig != Inst::S_SMI || b.Sig != Inst::S_SMI || a.SImmd != b.SImmd)
+			return false;
+	}
+
+	// read ports
+	auto usesRA = [](const Inst& i) { return i.RAddrA != Inst::R_NOP || readsMux(i, Inst::X_RA); };
+	auto usesRB = [](const Inst& i) { return i.Sig != Inst::S_SMI && (i.RAddrB != Inst::R_NOP || readsMux(i, Inst::X_RB)); };
+	if (usesRA(b))
+	{	if (usesRA(a) && a.RAddrA != b.RAddrA)
+			return false;
+		r.RAddrA = b.RAddrA;
+	}
+	if (b.Sig == Inst::S_SMI)
+	{	if (usesRB(a))
+			return false;
+		r.SImmd = b.SImmd;
+	} else if (a.Sig == Inst::S_SMI)
+	{	if (usesRB(b))
+			return false;
+	} else if (usesRB(b))
+	{	if (usesRB(a) && a.RAddrB != b.RAddrB)
+			return false;
+		r.RAddrB = b.RAddrB;
+	}
+	// vector rotation applies to the MUL ALU only
+	if (r.Sig == Inst::S_SMI && r.SImmd >= 48 && (a.isMUL() ? a : b).Sig != Inst::S_SMI)
+		return false;
+
+	// set flags
+	if (a.SF || b.SF)
+	{	if (a.SF && b.SF)
+			return false;
+		const Inst& s = a.SF ? a : b;
+		if (s.isSFADD() != s.isADD() || r.isSFADD() != s.isSFADD())
+			return false;
+	}
+
+	// write swap
+	int ws = -1;
+	auto requireWS = [&ws](const Inst& i, uint8_t reg) -> bool
+	{	if (Inst::isWRegAB(reg))
+			return true;
+		if (ws >= 0 && ws != i.WS)
+			return false;
+		ws = i.WS;
+		return true;
+	};
+	if ( (a.isADD() && !requireWS(a, a.WAddrA)) || (a.isMUL() && !requireWS(a, a.WAddrM))
+		|| (b.isADD() && !requireWS(b, b.WAddrA)) || (b.isMUL() && !requireWS(b, b.WAddrM)) )
+		return false;
+	if (ws >= 0)
+		r.WS = ws;
+
+	// pack and unpack
+	auto hasPack = [](const Inst& i) { return (i.Pack & (15 >> i.PM)) != 0; };
+	auto hasUnpack = [](const Inst& i) { return (i.Unpack & 7) != 0; };
+	bool pa = hasPack(a) || hasUnpack(a);
+	bool pb = hasPack(b) || hasUnpack(b);
+	if (pa && pb)
+		return false;
+	if (pa || pb)
+	{	const Inst& x = pa ? a : b;
+		const Inst& o = pa ? b : a;
+		r.PM = x.PM;
+		r.Pack = x.Pack;
+		r.Unpack = x.Unpack;
+		if (hasUnpack(x) && readsMux(o, x.PM ? Inst::X_R4 : Inst::X_RA))
+			return false;
+		if (hasPack(x) && (x.PM ? o.isMUL() : writesA(o, r.WS)))
+			return false;
+	}
+
+	return !r.isTMUconflict();
+}
+
+bool Optimizer::combine(Inst& a, Inst& b, Inst& result, unsigned noswap)
+{	if (!isPairable(a) || !isPairable(b))
+		return false;
+	if (merge(a, b, result))
+		return true;
+	Inst s;
+	if (!(noswap & 2))
+	{	s = b;
+		if (s.swapALU() && merge(a, s, result))
+		{	b = s;
+			return true;
+		}
+	}
+	if (!(noswap & 1))
+	{	s = a;
+		if (s.swapALU() && merge(s, b, result))
+		{	a = s;
+			return true;
+		}
+	}
+	return false;
+}
+
+Inst Optimizer::encode(const word& w) const
+{	const op& o = Ops[w.Op[0]];
+	Inst r = o.I;
+	if (w.Op[1] != NONE)
+	{	Inst a = o.I;
+		Inst b = Ops[w.Op[1]].I;
+		combine(a, b, r, 3);
+	}
+	if (o.Target != NONE)
+		r.Immd.iValue = ((int)(Relocate(o.Target) + o.Skip) - (int)FinalPC[w.Op[0]] - 4) * (int)sizeof(uint64_t);
+	return r;
+}
+
+template <typename F>
+bool Optimizer::forEachViolation(const vector<word>& words, int from, int to, F func) const
+{	static const word tail(TAIL), head(HEAD);
+	int n = words.size();
+	for (int j = max(from, 0); j <= min(to, n); ++j)
+	{	const word& wl = j < n ? words[j] : head;
+		for (int k = max(j - (int)MAX_DEPEND, -1); k < j; ++k)
+		{	const word& we = k >= 0 ? words[k] : tail;
+			for (unsigned e : we.Op)
+				if (e != NONE)
+					for (unsigned l : wl.Op)
+						if (l != NONE)
+							for (unsigned h = hazards(Ops[e], Ops[l], j - k); h; h &= h - 1)
+								if (!func(makeKey(original(e), original(l), h & -h), j - k))
+									return false;
+		}
+	}
+	return true;
+}
+
+void Optimizer::setupTiming(const vector<word>& words)
+{	Violations.clear();
+	forEachViolation(words, 0, words.size(), [this](uint64_t key, unsigned dist)
+	{	auto rp = Violations.emplace(key, dist);
+		if (!rp.second && rp.first->second > dist)
+			rp.first->second = dist;
+		return true;
+	});
+}
+
+bool Optimizer::checkTiming(const vector<word>& words, int from, int to) const
+{	return forEachViolation(words, from, to + MAX_DEPEND, [this](uint64_t key, unsigned dist)
+	{	return isAllowed(key, dist);
+	});
+}
+
+void Optimizer::buildBlocks()
+{	Blocks.clear();
+	for (unsigned i = 2; i < Ops.size(); ++i)
+	{	const op& o = Ops[i];
+		unsigned pc = i - 2;
+		if (!Blocks.size() || Blocks.back().Data != o.Data || (pc < Targets.size() && Targets[pc]))
+			Blocks.emplace_back(pc, o.Data);
+		Blocks.back().Words.emplace_back(i);
+	}
+}
+
+const Optimizer::block* Optimizer::findBlock(unsigned origin) const
+{	auto bp = lower_bound(Blocks.begin(), Blocks.end(), origin, [](const block& bl, unsigned origin) { return bl.Origin < origin; });
+	if (bp == Blocks.end() || bp->Origin != origin)
+		bp = find_if(Blocks.begin(), Blocks.end(), [origin](const block& bl) { return bl.Origin == origin; });
+	return bp != Blocks.end() ? &*bp : NULL;
+}
+
+bool Optimizer::checkPaths(const vector<word>& orig, const vector<word>& words, const vector<path>& paths)
+{	for (const path& p : paths)
+	{	vector<word> a(orig), b(words);
+		if (p.Block)
+		{	// Both sequences end at the same word of the successor.
+			const vector<word>& succ = p.Block->Words;
+			unsigned end = min((unsigned)succ.size(), max(p.Skip, p.NewSkip) + MAX_DEPEND);
+			a.insert(a.end(), succ.begin() + min(p.Skip, end), succ.begin() + end);
+			b.insert(b.end(), succ.begin() + min(p.NewSkip, end), succ.begin() + end);
+		}
+		setupTiming(a);
+		if (!checkTiming(b, 0, b.size()))
+			return false;
+	}
+	return true;
+}
+
+void Optimizer::layout()
+{	FinalPC.assign(Ops.size(), NONE);
+	unsigned pc = 0;
+	for (block& bl : Blocks)
+	{	bl.Start = pc;
+		for (const word& w : bl.Words)
+		{	for (unsigned o : w.Op)
+				if (o != NONE)
+					FinalPC[o] = pc;
+			++pc;
+		}
+	}
+	Size = pc;
+	Starts.clear();
+	for (const block& bl : Blocks)
+		Starts.emplace_back(bl.Origin, bl.Start);
+	sort(Starts.begin(), Starts.end());
+	// Ops removed by a pass, e.g. nop, are located at the start of their block.
+	for (unsigned i = 2; i < Ops.size(); ++i)
+		if (FinalPC[i] == NONE)
+			FinalPC[i] = (upper_bound(Starts.begin(), Starts.end(), make_pair(Ops[i].Origin, (unsigned)NONE)) - 1)->second;
+}
+
+uint64_t Optimizer::fixedRegs() const
+{	uint64_t ret = 0;
+	for (unsigned pc = 0; pc < Count; ++pc)
+	{	const op& o = Ops[pc + 2];
+		if (o.Data)
+			continue;
+		const Inst& i = o.I;
+		if (i.Sig == Inst::S_BRANCH)
+			// branch source and link register
+			ret |= o.Rd.Regs | o.Wr.Regs;
+		else if (!i.PM)
+		{	if (i.isALU() && (i.Unpack & 7) && i.RAddrA < 32)
+				ret |= 1ULL << i.RAddrA;
+			if (i.Pack & 15)
+				ret |= o.Wr.Regs;
+		}
+	}
+
+	// Successors of each instruction, branches take effect after their delay slots.
+	vector<unsigned> targets;
+	for (unsigned pc = 0; pc < Count && pc < Targets.size(); ++pc)
+		if (Targets[pc])
+			targets.push_back(pc);
+	vector<vector<unsigned>> succ(Count);
+	vector<bool> leaves(Count); // unknown successor, maybe outside
+	for (unsigned pc = 0; pc < Count; ++pc)
+	{	bool fallthrough = true;
+		if (pc >= 2 && !Ops[pc].Data && Ops[pc].I.Sig == Inst::S_THREND)
+			fallthrough = false;
+		if (pc >= 3 && !Ops[pc - 1].Data && Ops[pc - 1].I.Sig == Inst::S_BRANCH)
+		{	const op& br = Ops[pc - 1];
+			if (br.Target != NONE)
+			{	if (br.Target < Count)
+					succ[pc].push_back(br.Target);
+			} else if (Entries.size())
+				leaves[pc] = true;
+			else
+				succ[pc] = targets;
+			fallthrough = br.I.CondBr != Inst::B_AL;
+		}
+		if (fallthrough && pc + 1 < Count)
+			succ[pc].push_back(pc + 1);
+	}
+
+	// Registers live at the start of each instruction.
+	vector<uint64_t> live(Count);
+	bool changed;
+	do
+	{	changed = false;
+		for (unsigned pc = Count; pc-- > 0; )
+		{	uint64_t out = leaves[pc] ? ~0ULL : 0;
+			for (unsigned s : succ[pc])
+				out |= live[s];
+			// Conditional writes are reads too, see analyze().
+			const op& o = Ops[pc + 2];
+			out = o.Rd.Regs | (out & ~o.Wr.Regs);
+			if (out != live[pc])
+			{	live[pc] = out;
+				changed = true;
+			}
+		}
+	} while (changed);
+
+	if (Count)
+		ret |= live[0];
+	for (unsigned pc : Entries)
+		if (pc < Count)
+			ret |= live[pc];
+	return ret;
+}
+
+bool Optimizer::moveReg(Inst& i, unsigned from, unsigned to)
+{	const bool fromB = from >= 32;
+	const uint8_t fn = from & 31;
+	const uint8_t tn = to & 31;
+	if (i.Sig == Inst::S_BRANCH)
+		return true; // see fixedRegs()
+
+	// read port
+	if (i.isALU() && (fromB ? i.Sig != Inst::S_SMI && i.RAddrB == fn : i.RAddrA == fn))
+	{	if ((!fromB && i.Sig == Inst::S_SMI) || ((i.Unpack & 7) && !i.PM))
+			return false;
+		uint8_t& src = fromB ? i.RAddrB : i.RAddrA;
+		uint8_t& dst = fromB ? i.RAddrA : i.RAddrB;
+		const Inst::mux ms = fromB ? Inst::X_RB : Inst::X_RA;
+		const Inst::mux md = fromB ? Inst::X_RA : Inst::X_RB;
+		bool swap; // swap with an invariant I/O register in the other read port
+		if (dst == Inst::R_NOP && !readsMux(i, md))
+			swap = false;
+		else if (Inst::isRRegAB(dst))
+			swap = true;
+		else
+			return false;
+		src = swap ? dst : (uint8_t)Inst::R_NOP;
+		dst = tn;
+		for (Inst::mux* mp : {&i.MuxAA, &i.MuxAB, &i.MuxMA, &i.MuxMB})
+			if (*mp == ms)
+				*mp = md;
+			else if (swap && *mp == md)
+				*mp = ms;
+	}
+
+	// write target, the write swap flag moves both targets
+	bool wa = i.WAddrA == fn && i.WS == fromB;
+	bool wm = i.WAddrM == fn && i.WS != fromB;
+	if (wa || wm)
+	{	if ((i.Pack & 15) && !i.PM)
+			return false;
+		if (!Inst::isWRegAB(wa ? i.WAddrM : i.WAddrA))
+			return false;
+		i.WS = !i.WS;
+		(wa ? i.WAddrA : i.WAddrM) = tn;
+	}
+	return true;
+}
+
+unsigned Optimizer::portConflicts() const
+{	// value of a read port, NONE if unused
+	auto port = [](const Inst& i, Inst::mux m) -> unsigned
+	{	if (m == Inst::X_RB && i.Sig == Inst::S_SMI)
+			return 0x100 | i.SImmd;
+		uint8_t reg = m == Inst::X_RA ? i.RAddrA : i.RAddrB;
+		return reg != Inst::R_NOP || readsMux(i, m) ? reg : NONE;
+	};
+	unsigned ret = 0;
+	for (const block& bl : Blocks)
+	{	if (bl.Data)
+			continue;
+		for (unsigned w = 1; w < bl.Words.size(); ++w)
+		{	const word& wa = bl.Words[w - 1];
+			const word& wb = bl.Words[w];
+			if (wa.size() != 1 || wb.size() != 1 || isPinned(wa) || isPinned(wb))
+				continue;
+			const op& a = Ops[wa.Op[0]];
+			const op& b = Ops[wb.Op[0]];
+			if (!isPairable(a.I) || !isPairable(b.I) || !canShare(a, b))
+				continue;
+			for (Inst::mux m : {Inst::X_RA, Inst::X_RB})
+			{	unsigned pa = port(a.I, m);
+				unsigned pb = port(b.I, m);
+				if (pa != NONE && pb != NONE && pa != pb)
+				{	++ret;
+					break;
+				}
+			}
+		}
+	}
+	return ret;
+}
+
+void Optimizer::rebalanceBanks()
+{	unsigned conflicts = portConflicts();
+	if (!conflicts)
+		return;
+	const uint64_t fixed = fixedRegs();
+	uint64_t used = 0;
+	for (unsigned i = 2; i < Count + 2; ++i)
+		used |= Ops[i].Rd.Regs | Ops[i].Wr.Regs;
+
+	vector<pair<unsigned,Inst>> save;
+	bool changed;
+	do
+	{	changed = false;
+		for (unsigned from = 0; from < 64 && conflicts; ++from)
+		{	if (!(used & ~fixed & (1ULL << from)))
+				continue;
+			// first unused register of the other register file
+			uint64_t free = ~used & (from < 32 ? 0xffffffff00000000ULL : 0x00000000ffffffffULL);
+			if (!free)
+				continue;
+			unsigned to = 0;
+			while (!(free & (1ULL << to)))
+				++to;
+
+			// Move the register in all instructions.
+			save.clear();
+			bool ok = true;
+			for (unsigned i = 2; i < Count + 2 && ok; ++i)
+			{	op& o = Ops[i];
+				if (o.Data || !((o.Rd.Regs | o.Wr.Regs) & (1ULL << from)))
+					continue;
+				save.emplace_back(i, o.I);
+				ok = moveReg(o.I, from, to);
+				analyze(o);
+			}
+			unsigned left = ok ? portConflicts() : UINT_MAX;
+			if (left >= conflicts)
+			{	// revert
+				for (auto& sp : save)
+				{	Ops[sp.first].I = sp.second;
+					analyze(Ops[sp.first]);
+				}
+				continue;
+			}
+			for (auto& sp : save)
+				Ops[sp.first].Raw = Ops[sp.first].I.encode();
+			used = (used & ~(1ULL << from)) | 1ULL << to;
+			Note(save.front().first, "bank", "Moved %s%u to %s%u, %u read port conflicts left.",
+				from < 32 ? "ra" : "rb", from & 31, to < 32 ? "ra" : "rb", to & 31, left);
+			conflicts = left;
+			changed = true;
+		}
+	} while (changed && conflicts);
+}
+
+void Optimizer::pairInstructions(block& bl)
+{	vector<word>& words = bl.Words;
+	setupTiming(words);
+	for (int b = 1; b < (int)words.size(); ++b)
+	{	if (words[b].size() != 1 || isPinned(words[b]))
+			continue;
+		unsigned ob = words[b].Op[0];
+		if (!isPairable(Ops[ob].I))
+			continue;
+		// search backwards for a partner
+		for (int p = b; --p >= 0; )
+		{	if (isPinned(words[p]))
+				break;
+			unsigned oa = words[p].Op[0];
+			Inst ia = Ops[oa].I;
+			Inst ib = Ops[ob].I;
+			Inst res;
+			if ( words[p].size() == 1 && canShare(Ops[oa], Ops[ob])
+				&& combine(ia, ib, res, Ops[oa].NoSwap | Ops[ob].NoSwap << 1) )
+			{	words[p].Op[1] = ob;
+				words.erase(words.begin() + b);
+				if (checkTiming(words, p, b))
+				{	Ops[oa].I = ia;
+					Ops[ob].I = ib;
+					Note(ob, "pair", "Merged instruction into a dual issue word.");
+					--b;
+					break;
+				}
+				// revert
+				words.emplace(words.begin() + b, ob);
+				words[p].Op[1] = NONE;
+			}
+			// Cannot move across a dependency.
+			if (depends(Ops[oa], Ops[ob]) || (words[p].Op[1] != NONE && depends(Ops[words[p].Op[1]], Ops[ob])))
+				break;
+		}
+	}
+}
+
+bool Optimizer::removeOp(vector<word>& words, unsigned w, unsigned op)
+{	word& wd = words[w];
+	if (wd.Op[1] == NONE)
+	{	words.erase(words.begin() + w);
+		return true;
+	}
+	if (wd.Op[0] == op)
+		wd.Op[0] = wd.Op[1];
+	wd.Op[1] = NONE;
+	return false;
+}
+
+unsigned Optimizer::ruleSelfMove(vector<word>& words, unsigned w)
+{	for (unsigned o : words[w].Op)
+	{	if (o == NONE)
+			continue;
+		const Inst& i = Ops[o].I;
+		Inst::mux src;
+		usage dst;
+		if (!isMove(i, src, dst))
+			continue;
+		usage u = muxUsage(i, src);
+		if (u.Regs != dst.Regs || u.Misc != dst.Misc)
+			continue;
+		vector<word> save(words);
+		removeOp(words, w, o);
+		if (checkTiming(words, w, w))
+			return o;
+		words.swap(save);
+	}
+	return NONE;
+}
+
+unsigned Optimizer::ruleDupMove(vector<word>& words, unsigned w)
+{	for (unsigned o : words[w].Op)
+	{	if (o == NONE)
+			continue;
+		const Inst& i = Ops[o].I;
+		Inst::mux src;
+		usage dst;
+		if (!isMove(i, src, dst))
+			continue;
+		usage su = muxUsage(i, src);
+		// Search for the last write to the destination.
+		for (unsigned p = w; p-- > 0; )
+		{	const word& wp = words[p];
+			if (isPinned(wp))
+				break;
+			bool same = false;
+			for (unsigned x : wp.Op)
+			{	if (x == NONE)
+					continue;
+				const Inst& ix = Ops[x].I;
+				Inst::mux xsrc;
+				usage xdst;
+				if (!same && isMove(ix, xsrc, xdst) && xdst.Regs == dst.Regs && xdst.Misc == dst.Misc && xsrc == src && sameSource(i, ix, src))
+					same = true;
+				else if (Ops[x].Wr.intersects(dst))
+					goto next;
+			}
+			if (writes(wp, su))
+				break;
+			if (same)
+			{	vector<word> save(words);
+				removeOp(words, w, o);
+				if (checkTiming(words, w, w))
+					return o;
+				words.swap(save);
+				break;
+			}
+		}
+	 next:;
+	}
+	return NONE;
+}
+
+unsigned Optimizer::ruleForward(vector<word>& words, unsigned w)
+{	for (unsigned o : words[w].Op)
+	{	if (o == NONE)
+			continue;
+		const Inst& i = Ops[o].I;
+		if (!i.isALU() || (i.Unpack & 7) || (i.Sig == Inst::S_SMI && i.SImmd >= 48))
+			continue;
+		for (Inst::mux port : {Inst::X_RA, Inst::X_RB})
+		{	usage ru = muxUsage(i, port);
+			if (!ru.Regs || !readsMux(i, port))
+				continue;
+			// Search for the last write to the register.
+			for (unsigned p = w; p-- > 0; )
+			{	const word& wp = words[p];
+				if (isPinned(wp))
+					break;
+				if (!writes(wp, ru))
+					continue;
+				// It must be a single move from an accumulator at least two words before.
+				Inst::mux src;
+				usage dst;
+				unsigned x = Ops[wp.Op[0]].Wr.intersects(ru) ? wp.Op[0] : wp.Op[1];
+				if (p + 1 == w || !isMove(Ops[x].I, src, dst) || src > Inst::X_R4 || dst.Regs != ru.Regs)
+					break;
+				usage au(0, U_R0 << src);
+				unsigned q = p;
+				while (q < w && !writes(words[q], au))
+					++q;
+				if (q != w)
+					break;
+				// Replace the input mux.
+				Inst save = i;
+				Inst& n = Ops[o].I;
+				if (n.isADD())
+				{	if (n.MuxAA == port)
+						n.MuxAA = src;
+					if (n.MuxAB == port)
+						n.MuxAB = src;
+				}
+				if (n.isMUL())
+				{	if (n.MuxMA == port)
+						n.MuxMA = src;
+					if (n.MuxMB == port)
+						n.MuxMB = src;
+				}
+				(port == Inst::X_RA ? n.RAddrA : n.RAddrB) = Inst::R_NOP;
+				analyze(Ops[o]);
+				Inst r;
+				if (checkTiming(words, w, w) && (words[w].Op[1] == NONE || combine(Ops[words[w].Op[0]].I, Ops[words[w].Op[1]].I, r, 3)))
+					return o;
+				n = save;
+				analyze(Ops[o]);
+				break;
+			}
+		}
+	}
+	return NONE;
+}
+
+unsigned Optimizer::ruleLdiMove(vector<word>& words, unsigned w)
+{	if (words[w].Op[1] != NONE)
+		return NONE;
+	unsigned o = words[w].Op[0];
+	const Inst& i = Ops[o].I;
+	Inst::mux src;
+	usage dst;
+	if (!isMove(i, src, dst))
+		return NONE;
+	usage su = muxUsage(i, src);
+	if (!su.Regs && !su.Misc)
+		return NONE;
+	// Search for the last write to the source.
+	for (unsigned p = w; p-- > 0; )
+	{	const word& wp = words[p];
+		if (isPinned(wp))
+			break;
+		if (!writes(wp, su))
+			continue;
+		const op& x = Ops[wp.Op[0]];
+		const Inst& l = x.I;
+		if ( wp.Op[1] != NONE || l.Sig != Inst::S_LDI || (l.LdMode & Inst::L_SEMA) || l.SF
+			|| (l.Pack & (15 >> l.PM)) || x.Rd.intersects(su) || (su.Regs && p + 1 == w) )
+			break;
+		Inst n = l;
+		n.WAddrA = n.WAddrM = Inst::R_NOP;
+		n.CondA = n.CondM = Inst::C_NEVER;
+		n.WS = i.WS;
+		if (i.isADD())
+		{	n.WAddrA = i.WAddrA;
+			n.CondA = Inst::C_AL;
+		} else
+		{	n.WAddrM = i.WAddrM;
+			n.CondM = Inst::C_AL;
+		}
+		Inst save = i;
+		Ops[o].I = n;
+		analyze(Ops[o]);
+		if (checkTiming(words, w, w))
+			return o;
+		Ops[o].I = save;
+		analyze(Ops[o]);
+		break;
+	}
+	return NONE;
+}
+
+unsigned Optimizer::ruleDeadWrite(vector<word>& words, unsigned w)
+{	for (unsigned o : words[w].Op)
+	{	if (o == NONE)
+			continue;
+		const op& x = Ops[o];
+		const Inst& i = x.I;
+		if ( (i.Sig != Inst::S_NONE && i.Sig != Inst::S_SMI && (i.Sig != Inst::S_LDI || (i.LdMode & Inst::L_SEMA)))
+			|| (x.Rd.Misc & U_IO) )
+			continue;
+		// exactly one register
+		const usage& d = x.Wr;
+		if (d.Regs ? (d.Misc || (d.Regs & (d.Regs - 1))) : (!d.Misc || (d.Misc & ~(U_ACCU & ~U_R4)) || (d.Misc & (d.Misc - 1))))
+			continue;
+		// Search for the next access.
+		for (unsigned p = w + 1; p < words.size(); ++p)
+		{	const word& wp = words[p];
+			if (isPinned(wp) || reads(wp, d))
+				break;
+			if (!writes(wp, d))
+				continue;
+			vector<word> save(words);
+			removeOp(words, w, o);
+			if (checkTiming(words, w, w))
+				return o;
+			words.swap(save);
+			break;
+		}
+	}
+	return NONE;
+}
+
+void Optimizer::peephole(block& bl)
+{	vector<word>& words = bl.Words;
+	setupTiming(words);
+	bool changed;
+	do
+	{	changed = false;
+		for (unsigned w = 0; w < words.size(); ++w)
+			for (const rule& r : rules)
+			{	if (w >= words.size() || isPinned(words[w]) || (r.Removes && !Relocatable))
+					continue;
+				unsigned o = (this->*r.Apply)(words, w);
+				if (o != NONE)
+				{	Ops[o].Raw = Ops[o].I.encode();
+					Note(o, "peephole", "%s: %s", r.Name, r.Text);
+					changed = true;
+				}
+			}
+	} while (changed);
+}
+
+bool Optimizer::hoistLdi(unsigned first, unsigned last, unsigned bi, unsigned k, uint64_t& used)
+{	vector<word>& words = Blocks[bi].Words;
+	const unsigned ol = words[k].Op[0];
+	const op& l = Ops[ol];
+	// exactly one register of a register file or r0..r3
+	const usage& u = l.Wr;
+	if (u.Regs ? u.Misc || (u.Regs & (u.Regs - 1)) : !u.Misc || (u.Misc & ~(U_R0|U_R0<<1|U_R0<<2|U_R0<<3)) || (u.Misc & (u.Misc - 1)))
+		return false;
+	// other writes within the loop
+	bool written = false;
+	for (unsigned b = first; b <= last && !written; ++b)
+		for (const word& w : Blocks[b].Words)
+			for (unsigned o : w.Op)
+				if (o != NONE && o != ol)
+				{	if (Ops[o].Wr.intersects(u))
+						written = true;
+					// Accumulators do not survive a thread switch.
+					if (u.Misc && (Ops[o].I.Sig == Inst::S_THRSW || Ops[o].I.Sig == Inst::S_LTHRSW))
+						return false;
+				}
+
+	const unsigned count = Ops.size();
+	vector<word> save(words);
+	vector<pair<unsigned,Inst>> rewritten;
+	op n = l;
+	n.Pinned = false;
+	unsigned spare = NONE;
+	if (!written)
+	{	// The ldi must be executed in each iteration before the value is read.
+		if (bi != first)
+			return false;
+		for (unsigned w = 0; w < k; ++w)
+			if (reads(words[w], u))
+				return false;
+	} else
+	{	// Read the constant from an unused register of the same register file instead.
+		// All reads of the value must be in the same block.
+		if (!u.Regs)
+			return false;
+		const unsigned reg = __builtin_ctzll(u.Regs);
+		uint64_t free = ~used & (reg < 32 ? 0x00000000ffffffffULL : 0xffffffff00000000ULL);
+		if (!free)
+			return false;
+		spare = __builtin_ctzll(free);
+		unsigned q = k + 1;
+		for (; q < words.size(); ++q)
+		{	bool kill = false;
+			for (unsigned o : words[q].Op)
+			{	if (o == NONE)
+					continue;
+				op& x = Ops[o];
+				Inst& i = x.I;
+				if (x.Wr.intersects(u))
+				{	// The old value survives conditional writes.
+					if ((i.WAddrA == (reg & 31) && i.WS == (reg >= 32) && i.CondA != Inst::C_AL)
+						|| (i.WAddrM == (reg & 31) && i.WS != (reg >= 32) && i.CondM != Inst::C_AL) )
+						goto fail;
+					kill = true;
+				}
+				if (!x.Rd.intersects(u))
+					continue;
+				if (isPinned(words[q]) || !i.isALU())
+					goto fail;
+				uint8_t& ra = reg < 32 ? i.RAddrA : i.RAddrB;
+				if (ra != (reg & 31) || (reg >= 32 && i.Sig == Inst::S_SMI))
+					goto fail;
+				rewritten.emplace_back(o, i);
+				ra = spare & 31;
+				analyze(x);
+				x.Raw = i.encode();
+			}
+			if (kill)
+				break;
+		}
+		if (q == words.size())
+			goto fail;
+		(l.I.WAddrA != Inst::R_NOP ? n.I.WAddrA : n.I.WAddrM) = spare & 31;
+		analyze(n);
+		n.Raw = n.I.encode();
+	}
+
+	{	// Remove the ldi from the loop.
+		setupTiming(save);
+		words.erase(words.begin() + k);
+		if (!checkTiming(words, k, words.size()))
+			goto fail;
+		// Insert it into the preheader as late as possible.
+		Ops.push_back(n);
+		const unsigned on = Ops.size() - 1;
+		vector<word>& pw = Blocks[first - 1].Words;
+		setupTiming(pw);
+		for (unsigned p = pw.size(); ; --p)
+		{	pw.emplace(pw.begin() + p, on);
+			if (checkTiming(pw, p, p))
+			{	if (spare == NONE)
+					Note(on, "hoist", "Moved ldi 0x%x in front of the loop.", n.I.Immd.uValue);
+				else
+				{	used |= 1ULL << spare;
+					Note(on, "hoist", "Moved ldi 0x%x in front of the loop using %s%u.", n.I.Immd.uValue,
+						spare < 32 ? "ra" : "rb", spare & 31);
+				}
+				return true;
+			}
+			pw.erase(pw.begin() + p);
+			if (!p || isPinned(pw[p - 1]) || depends(Ops[pw[p - 1].Op[0]], Ops[on])
+				|| (pw[p - 1].Op[1] != NONE && depends(Ops[pw[p - 1].Op[1]], Ops[on])))
+				break;
+		}
+	}
+ fail:
+	words.swap(save);
+	Ops.resize(count);
+	for (auto& rp : rewritten)
+	{	Ops[rp.first].I = rp.second;
+		analyze(Ops[rp.first]);
+		Ops[rp.first].Raw = rp.second.encode();
+	}
+	return false;
+}
+
+void Optimizer::hoistConstants()
+{	// Loops: blocks from a branch target to the last block with a branch back to it.
+	vector<pair<unsigned,unsigned>> loops; // first and last block
+	for (unsigned bi = 0; bi < Blocks.size(); ++bi)
+		for (const word& w : Blocks[bi].Words)
+		{	const op& br = Ops[w.Op[0]];
+			if (br.Data || br.I.Sig != Inst::S_BRANCH || br.Target == NONE || br.Target > br.Origin)
+				continue;
+			const block* tb = findBlock(br.Target);
+			if (!tb)
+				continue;
+			unsigned first = tb - Blocks.data();
+			auto lp = find_if(loops.begin(), loops.end(), [first](const pair<unsigned,unsigned>& l) { return l.first == first; });
+			if (lp == loops.end())
+				loops.emplace_back(first, bi);
+			else
+				lp->second = max(lp->second, bi);
+		}
+	// inner loops first
+	stable_sort(loops.begin(), loops.end(), [](const pair<unsigned,unsigned>& l, const pair<unsigned,unsigned>& r)
+		{ return l.second - l.first < r.second - r.first; });
+
+	uint64_t used = 0;
+	for (const block& bl : Blocks)
+		if (!bl.Data)
+			for (const word& w : bl.Words)
+				for (unsigned o : w.Op)
+					if (o != NONE)
+						used |= Ops[o].Rd.Regs | Ops[o].Wr.Regs;
+
+	for (const auto& loop : loops)
+	{	const unsigned first = loop.first;
+		const unsigned last = loop.second;
+		if (!first || Blocks[first - 1].Data)
+			continue;
+		const unsigned begin = Blocks[first].Origin;
+		const unsigned end = last + 1 < Blocks.size() ? Blocks[last + 1].Origin : Count;
+		// The loop must be entered only through the preheader, i.e. the previous block.
+		for (unsigned e : Entries)
+			if (e >= begin && e < end)
+				goto next;
+		for (unsigned bi = 0; bi < Blocks.size(); ++bi)
+			for (const word& w : Blocks[bi].Words)
+			{	const op& br = Ops[w.Op[0]];
+				if (br.Data)
+					break;
+				if ( (bi == first - 1 && (br.I.Sig == Inst::S_BRANCH ? br.I.CondBr == Inst::B_AL && br.Origin + 4 == begin
+						: br.I.Sig == Inst::S_THREND && br.Origin + 3 == begin))
+					|| ( (bi < first || bi > last) && br.I.Sig == Inst::S_BRANCH && br.Target != NONE
+						&& br.Target >= begin && br.Target < end ) )
+					goto next;
+			}
+
+		for (unsigned bi = first; bi <= last; ++bi)
+		{	vector<word>& words = Blocks[bi].Words;
+			for (unsigned k = 0; k < words.size(); ++k)
+			{	if (words[k].size() != 1 || isPinned(words[k]))
+					continue;
+				const Inst& l = Ops[words[k].Op[0]].I;
+				if ( l.Sig == Inst::S_LDI && l.LdMode == Inst::L_LDI && !l.SF && !(l.Pack & (15 >> l.PM))
+					&& (l.WAddrA == Inst::R_NOP) != (l.WAddrM == Inst::R_NOP)
+					&& (l.WAddrA != Inst::R_NOP ? l.CondA : l.CondM) == Inst::C_AL
+					&& hoistLdi(first, last, bi, k, used) )
+					--k;
+			}
+		}
+	 next:;
+	}
+}
+
+void Optimizer::uniformWord(const word& w, usage& uni) const
+{	usage kill, gen;
+	for (unsigned o : w.Op)
+	{	if (o == NONE)
+			continue;
+		const op& x = Ops[o];
+		const Inst& i = x.I;
+		kill |= x.Wr;
+		if (x.Data || i.Sig == Inst::S_BRANCH)
+			continue;
+		auto mux = [&i, &uni](Inst::mux m) -> bool
+		{	if (m == Inst::X_RA || m == Inst::X_RB)
+			{	if (m == Inst::X_RB && i.Sig == Inst::S_SMI)
+					return i.SImmd < 48;
+				uint8_t reg = m == Inst::X_RA ? i.RAddrA : i.RAddrB;
+				if (reg < 32)
+					return (uni.Regs >> (reg + 32 * (m == Inst::X_RB))) & 1;
+				return reg == 32 || reg == 39; // unif, nop
+			}
+			// vector rotation does not change uniform values
+			return Inst::isAccu(m) && ((uni.Misc >> m) & 1);
+		};
+		bool add, mul;
+		if (i.Sig == Inst::S_LDI)
+			add = mul = i.LdMode == Inst::L_LDI;
+		else
+		{	add = mux(i.MuxAA) && mux(i.MuxAB);
+			mul = mux(i.MuxMA) && mux(i.MuxMB);
+		}
+		if (i.SF && (i.Sig == Inst::S_LDI || i.isSFADD() ? add : mul))
+			gen.Misc |= U_FLAGS;
+		const bool partial = (i.Pack & (15 >> i.PM)) != 0;
+		auto result = [&uni, &gen, partial](uint8_t reg, bool regfileB, Inst::conda cond, bool value)
+		{	usage u;
+			if (reg < 32)
+				u.Regs = 1ULL << (reg + 32 * regfileB);
+			else if (reg < 36) // r0..r3
+				u.Misc = U_R0 << (reg - 32);
+			else
+				return;
+			// Conditional and partial writes keep the old value of some elements.
+			if ( value && cond != Inst::C_NEVER
+				&& ((cond == Inst::C_AL && !partial) || (uni.intersects(u) && (cond == Inst::C_AL || (uni.Misc & U_FLAGS)))) )
+				gen |= u;
+		};
+		result(i.WAddrA, i.WS, i.CondA, add);
+		result(i.WAddrM, !i.WS, i.CondM, mul);
+	}
+	uni.Regs = (uni.Regs & ~kill.Regs) | gen.Regs;
+	uni.Misc = (uni.Misc & ~kill.Misc) | gen.Misc;
+}
+
+bool Optimizer::blockSuccessors(vector<vector<unsigned>>& succ, vector<bool>* exits) const
+{	const unsigned n = Blocks.size();
+	succ.assign(n, vector<unsigned>());
+	if (exits)
+		exits->assign(n, false);
+	for (unsigned bi = 0; bi < n; ++bi)
+	{	if (Blocks[bi].Data)
+			continue;
+		bool fallthrough = true;
+		for (const word& w : Blocks[bi].Words)
+		{	const op& o = Ops[w.Op[0]];
+			if (o.I.Sig == Inst::S_BRANCH)
+			{	const block* tb = o.Target < Count ? findBlock(o.Target) : NULL;
+				if (tb)
+					succ[bi].push_back(tb - Blocks.data());
+				else if (exits)
+					(*exits)[bi] = true;
+				else if (o.Target == NONE || o.Target < Count)
+					return false;
+				fallthrough &= o.I.CondBr != Inst::B_AL;
+			} else if (o.I.Sig == Inst::S_THREND)
+				fallthrough = false;
+		}
+		if (fallthrough && bi + 1 < n)
+			succ[bi].push_back(bi + 1);
+	}
+	return true;
+}
+
+void Optimizer::uniformity(vector<usage>& in) const
+{	const unsigned n = Blocks.size();
+	vector<vector<unsigned>> succ;
+	if (!blockSuccessors(succ))
+	{	in.assign(n, usage());
+		return;
+	}
+	// Predecessors of each block, NONE: entry from outside.
+	vector<vector<unsigned>> preds(n);
+	if (n)
+		preds[0].push_back(NONE);
+	for (unsigned e : Entries)
+		if (e < Count)
+			preds[upper_bound(Blocks.begin(), Blocks.end(), e, [](unsigned pc, const block& bl) { return pc < bl.Origin; }) - Blocks.begin() - 1].push_back(NONE);
+	for (unsigned bi = 0; bi < n; ++bi)
+		for (unsigned s : succ[bi])
+			preds[s].push_back(bi);
+	// Blocks without known predecessor might be invoked from outside.
+	for (auto& p : preds)
+		if (p.empty())
+			p.push_back(NONE);
+
+	in.assign(n, usage(~0ULL, U_ALL));
+	vector<usage> out(in);
+	bool changed;
+	do
+	{	changed = false;
+		for (unsigned bi = 0; bi < n; ++bi)
+		{	if (Blocks[bi].Data)
+				continue;
+			usage u(~0ULL, U_ALL);
+			for (unsigned p : preds[bi])
+				if (p == NONE)
+					u = usage();
+				else
+				{	u.Regs &= out[p].Regs;
+					u.Misc &= out[p].Misc;
+				}
+			in[bi] = u;
+			for (const word& w : Blocks[bi].Words)
+				uniformWord(w, u);
+			if (u.Regs != out[bi].Regs || u.Misc != out[bi].Misc)
+			{	out[bi] = u;
+				changed = true;
+			}
+		}
+	} while (changed);
+}
+
+bool Optimizer::predicate(unsigned bi, usage uni)
+{	vector<word>& words = Blocks[bi].Words;
+	const unsigned n = words.size();
+	if (n < 4 || bi + 1 >= Blocks.size())
+		return false;
+	const unsigned ob = words[n - 4].Op[0];
+	const op& br = Ops[ob];
+	if ( br.Data || br.I.Sig != Inst::S_BRANCH || br.Target == NONE || br.Target <= br.Origin || br.Skip
+		|| br.I.CondBr > Inst::B_ANYCC || br.I.SF || br.Wr.Regs || br.Wr.Misc )
+		return false;
+	const block* tb = findBlock(br.Target);
+	const unsigned begin = br.Origin + 4;
+	if (!tb || Blocks[bi + 1].Origin != begin)
+		return false;
+	const unsigned ti = tb - Blocks.data();
+
+	// The skipped blocks must not be entered from elsewhere.
+	for (unsigned e : Entries)
+		if (e >= begin && e < br.Target)
+			return false;
+	for (const block& bl : Blocks)
+		for (const word& w : bl.Words)
+		{	const op& o = Ops[w.Op[0]];
+			if (o.Data)
+				break;
+			if (o.I.Sig == Inst::S_BRANCH && o.Target >= begin && o.Target < br.Target)
+				return false;
+		}
+
+	// The delay slots become ordinary instructions, so they must not be pinned by a signal
+	// and must not change the flags that the skipped instructions depend on now.
+	for (unsigned w = n > 6 ? n - 6 : 0; w < n; ++w)
+		for (unsigned o : words[w].Op)
+			if (o != NONE && o != ob && !Ops[o].Data)
+				switch (Ops[o].I.Sig)
+				{case Inst::S_BREAK:
+				 case Inst::S_THRSW:
+				 case Inst::S_THREND:
+				 case Inst::S_SBWAIT:
+				 case Inst::S_SBDONE:
+				 case Inst::S_LTHRSW:
+				 case Inst::S_LDCEND:
+					return false;
+				 default:
+					if (w > n - 4 && (Ops[o].Wr.Misc & U_FLAGS))
+						return false;
+				}
+
+	// The flags at the branch decide for all SIMD elements together,
+	// so only uniform flags are equivalent to a condition per element.
+	for (unsigned w = 0; w < n - 4; ++w)
+		uniformWord(words[w], uni);
+	const bool uniform = (uni.Misc & U_FLAGS) != 0;
+	if (!uniform && (br.I.CondBr & 2)) // any...
+		return false;
+	// Condition of the skipped words: complement of the branch condition per element.
+	const Inst::conda cond = (Inst::conda)(Inst::C_ZS + ((br.I.CondBr >> 1) & ~1) + !(br.I.CondBr & 1));
+
+	vector<word> body;
+	for (unsigned b = bi + 1; b < ti; ++b)
+	{	if (Blocks[b].Data)
+			return false;
+		body.insert(body.end(), Blocks[b].Words.begin(), Blocks[b].Words.end());
+	}
+	if (body.size() > MAX_IFCONV)
+		return false;
+	vector<pair<unsigned,Inst>> changed;
+	for (const word& w : body)
+	{	if (isPinned(w))
+			return false;
+		for (unsigned o : w.Op)
+		{	if (o == NONE)
+				continue;
+			const op& x = Ops[o];
+			Inst i = x.I;
+			// Only writes to registers and r0..r3 work conditionally and without side effects.
+			if ( (i.Sig != Inst::S_NONE && i.Sig != Inst::S_SMI && (i.Sig != Inst::S_LDI || i.LdMode != Inst::L_LDI))
+				|| i.SF || (x.Rd.Misc & U_IO) || (x.Wr.Misc & ~(U_R0|U_R0<<1|U_R0<<2|U_R0<<3)) )
+				return false;
+			auto adjust = [cond, uniform](uint8_t reg, Inst::conda& c) -> bool
+			{	if (reg == Inst::R_NOP || c == Inst::C_NEVER || c == cond)
+					return true;
+				if (c != Inst::C_AL || !uniform)
+					return false;
+				c = cond;
+				return true;
+			};
+			if (!adjust(i.WAddrA, i.CondA) || !adjust(i.WAddrM, i.CondM))
+				return false;
+			changed.emplace_back(o, i);
+		}
+	}
+
+	// Remove the branch, the original code falls through into the skipped words.
+	vector<word> orig(words);
+	orig.insert(orig.end(), body.begin(), body.end());
+	setupTiming(orig);
+	for (auto& cp : changed)
+	{	op& x = Ops[cp.first];
+		swap(x.I, cp.second);
+		analyze(x);
+		x.Raw = x.I.encode();
+	}
+	vector<word> res(words.begin(), words.end() - 4);
+	res.insert(res.end(), words.end() - 3, words.end());
+	res.insert(res.end(), body.begin(), body.end());
+	if (!checkTiming(res, 0, res.size()))
+	{	for (auto& cp : changed)
+		{	op& x = Ops[cp.first];
+			x.I = cp.second;
+			analyze(x);
+			x.Raw = x.I.encode();
+		}
+		return false;
+	}
+	// Remove nop from the former delay slots as long as the timing permits.
+	for (unsigned w = n - 1; w-- > n - 4; )
+		if (isNop(res[w]))
+		{	word save = res[w];
+			res.erase(res.begin() + w);
+			if (!checkTiming(res, 0, res.size()))
+				res.insert(res.begin() + w, save);
+		}
+
+	for (unsigned w = n - 3; w < n; ++w)
+		for (unsigned o : words[w].Op)
+			if (o != NONE)
+				Ops[o].Pinned = false;
+	Note(ob, "ifconv", "Replaced branch over %u instruction%s by conditional execution.", (unsigned)body.size(), body.size() == 1 ? "" : "s");
+	words.swap(res);
+	Blocks.erase(Blocks.begin() + bi + 1, Blocks.begin() + ti);
+	return true;
+}
+
+void Optimizer::convertBranches()
+{	vector<usage> uniform;
+	uniformity(uniform);
+	for (unsigned bi = 0; bi < Blocks.size(); ++bi)
+	{	const unsigned count = Blocks.size();
+		if (!Blocks[bi].Data && predicate(bi, uniform[bi]))
+			uniform.erase(uniform.begin() + bi + 1, uniform.begin() + bi + 1 + count - Blocks.size());
+	}
+}
+
+bool Optimizer::pipelineLoop(unsigned pc)
+{	const block* lb = findBlock(pc);
+	if (!lb || lb->Data || lb == Blocks.data() || lb[-1].Data)
+	{	Note(NONE, "pipeline", "No loop with a preceding block at .pipeline.");
+		return false;
+	}
+	const unsigned bi = lb - Blocks.data();
+	const vector<word> words(lb->Words);
+	const unsigned n = words.size();
+	auto reject = [this, &words](const char* reason)
+	{	Note(words[0].Op[0], "pipeline", "Loop not pipelined: %s.", reason);
+		return false;
+	};
+	const unsigned end = bi + 1 < Blocks.size() ? Blocks[bi + 1].Origin : Count;
+	if (n < 5 || end < pc + 3)
+		return reject("the loop is too short");
+	const unsigned ob = words[n - 4].Op[0];
+	{	const op& br = Ops[ob];
+		if ( br.Data || br.I.Sig != Inst::S_BRANCH || br.Target != pc || br.I.CondBr == Inst::B_AL
+			|| br.I.SF || br.Wr.Regs || br.Wr.Misc || br.Skip )
+			return reject("the block does not end with a conditional branch to its start");
+	}
+	for (unsigned w = n - 3; w < n; ++w)
+		if (!isNop(words[w]))
+			return reject("the branch delay slots are not empty");
+
+	// The loop must be entered only through the preceding block.
+	for (unsigned e : Entries)
+		if (e >= pc && e < end)
+			return reject("the loop is entered from elsewhere");
+	for (unsigned b = 0; b < Blocks.size(); ++b)
+		for (const word& w : Blocks[b].Words)
+		{	const op& o = Ops[w.Op[0]];
+			if (o.Data)
+				break;
+			if ( (o.I.Sig == Inst::S_BRANCH && w.Op[0] != ob && o.Target >= pc && o.Target < end)
+				|| (b == bi - 1 && (o.I.Sig == Inst::S_BRANCH ? o.I.CondBr == Inst::B_AL && o.Origin + 4 == pc
+					: o.I.Sig == Inst::S_THREND && o.Origin + 3 == pc)) )
+				return reject("the loop is entered from elsewhere");
+		}
+
+	// Split the loop body behind the last TMU request in front of the first ldtmu.
+	const unsigned m = n - 4;
+	unsigned s = NONE, first = m, a = 0;
+	for (unsigned w = 0; w < m; ++w)
+	{	if (isPinned(words[w]))
+			return reject("the loop body contains signals that must not be moved");
+		if (writes(words[w], usage(0, U_FLAGS)))
+			s = w;
+		for (unsigned o : words[w].Op)
+			if (o != NONE && (Ops[o].I.Sig == Inst::S_LDTMU0 || Ops[o].I.Sig == Inst::S_LDTMU1) && first == m)
+				first = w;
+		if (first == m && writes(words[w], usage(0, U_TMU)))
+			a = w + 1;
+	}
+	if (s == NONE || words[s].size() != 1)
+		return reject("the flags of the loop condition are not set by a single instruction in the loop");
+	if (!a)
+		return reject("no TMU request in front of the first ldtmu");
+	// The instruction that sets the flags moves behind the TMU requests.
+	for (unsigned w = min(s + 1, a); w < max(s, a); ++w)
+		for (unsigned o : words[w].Op)
+			if (o != NONE && depends(Ops[o], Ops[words[s].Op[0]]))
+				return reject("the loop condition depends on the instructions in between");
+	vector<word> head, body;
+	for (unsigned w = 0; w < m; ++w)
+		if (w != s)
+			(w < a ? head : body).push_back(words[w]);
+	head.push_back(words[s]);
+	if (body.empty())
+		return reject("nothing to overlap with the TMU requests");
+
+	const unsigned count = Ops.size();
+	auto copy = [this](const vector<word>& src, vector<word>& dst)
+	{	for (const word& w : src)
+		{	dst.emplace_back(NONE);
+			for (unsigned k = 0; k < w.size(); ++k)
+			{	op c = Ops[w.Op[k]];
+				Ops.push_back(c);
+				dst.back().Op[k] = Ops.size() - 1;
+			}
+		}
+	};
+	// prologue: head of the first iteration, leave to the epilogue if there is only one iteration
+	vector<word> pro, loop(body), epi;
+	copy(head, pro);
+	copy(vector<word>(words.begin() + m, words.end()), pro);
+	{	op& guard = Ops[pro[pro.size() - 4].Op[0]];
+		guard.I.CondBr = (Inst::condb)(guard.I.CondBr ^ 3);
+		guard.Target = pc + 2;
+	}
+	// loop: remaining words of the current iteration, then the head of the next one
+	loop.insert(loop.end(), head.begin(), head.end());
+	loop.insert(loop.end(), words.begin() + m, words.end());
+	// epilogue: remaining words of the last iteration
+	copy(body, epi);
+
+	vector<word> orig;
+	for (unsigned i = 0; i < 3; ++i)
+		orig.insert(orig.end(), words.begin(), words.end());
+	setupTiming(orig);
+	for (unsigned pad = 0; ; ++pad)
+	{	vector<word> seq(pro);
+		seq.insert(seq.end(), loop.begin(), loop.end());
+		seq.insert(seq.end(), loop.begin(), loop.end());
+		seq.insert(seq.end(), epi.begin(), epi.end());
+		vector<word> skip(pro);
+		skip.insert(skip.end(), epi.begin(), epi.end());
+		if (checkTiming(seq, 0, seq.size()) && checkTiming(skip, 0, skip.size()))
+			break;
+		if (pad == MAX_DEPEND)
+		{	Ops.resize(count);
+			return reject("timing constraints");
+		}
+		// nop in front of the code after the loop
+		copy(vector<word>(1, words[n - 1]), epi);
+		Ops.back().Pinned = false;
+	}
+
+	Ops[ob].Target = pc + 1;
+	Blocks[bi].Origin = pc + 1;
+	Blocks[bi].Words.swap(loop);
+	Blocks.insert(Blocks.begin() + bi + 1, block(pc + 2, false));
+	Blocks[bi + 1].Words.swap(epi);
+	Blocks.insert(Blocks.begin() + bi, block(pc, false));
+	Blocks[bi].Words.swap(pro);
+	Note(ob, "pipeline", "Moved %u instruction word%s with TMU requests into the previous iteration.",
+		(unsigned)head.size(), head.size() == 1 ? "" : "s");
+	return true;
+}
+
+bool Optimizer::hasSignal(Inst::sig s) const
+{	for (const block& bl : Blocks)
+		if (!bl.Data)
+			for (const word& w : bl.Words)
+				if (Ops[w.Op[0]].I.Sig == s)
+					return true;
+	return false;
+}
+
+unsigned Optimizer::tmuRequests(const word& w) const
+{	unsigned ret = 0;
+	for (unsigned o : w.Op)
+		if (o != NONE && !Ops[o].Data && Ops[o].I.Sig != Inst::S_BRANCH)
+		{	const Inst& i = Ops[o].I;
+			ret += ((i.WAddrA & ~4) == 56 && i.CondA != Inst::C_NEVER) + ((i.WAddrM & ~4) == 56 && i.CondM != Inst::C_NEVER);
+		}
+	return ret;
+}
+
+bool Optimizer::isTmuOnly(const op& o)
+{	if (o.Data)
+		return false;
+	op c(o);
+	switch (c.I.Sig)
+	{case Inst::S_LDI:
+		if (c.I.LdMode != Inst::L_LDI)
+			return false;
+	 case Inst::S_NONE:
+	 case Inst::S_SMI:
+		break;
+	 case Inst::S_LDTMU0:
+	 case Inst::S_LDTMU1:
+		c.I.Sig = Inst::S_NONE;
+		break;
+	 default:
+		return false;
+	}
+	if (c.I.WAddrA >= 56)
+		c.I.WAddrA = Inst::R_NOP;
+	if (c.I.WAddrM >= 56)
+		c.I.WAddrM = Inst::R_NOP;
+	analyze(c);
+	return !((c.Rd.Misc | c.Wr.Misc) & U_IO);
+}
+
+void Optimizer::tmuPendingIn(vector<unsigned>& in, unsigned limit) const
+{	vector<vector<unsigned>> succ;
+	if (!blockSuccessors(succ))
+	{	in.assign(Blocks.size(), limit);
+		return;
+	}
+	in.assign(Blocks.size(), 0);
+	bool changed;
+	do
+	{	changed = false;
+		for (unsigned bi = 0; bi < Blocks.size(); ++bi)
+		{	if (Blocks[bi].Data)
+				continue;
+			unsigned pending = in[bi];
+			for (const word& w : Blocks[bi].Words)
+				pending = tmuPending(w, pending, limit);
+			for (unsigned s : succ[bi])
+				if (in[s] < pending)
+				{	in[s] = pending;
+					changed = true;
+				}
+		}
+	} while (changed);
+}
+
+void Optimizer::hoistTmuRequests(block& bl, unsigned pending, unsigned limit)
+{	vector<word>& words = bl.Words;
+	setupTiming(words);
+	for (unsigned j = 1; j < words.size(); ++j)
+	{	const unsigned req = tmuRequests(words[j]);
+		if (!req || isPinned(words[j]))
+			continue;
+		vector<word> cand(words);
+		unsigned best = j;
+		for (unsigned k = j; k; --k)
+		{	const word& we = cand[k - 1];
+			if (isPinned(we))
+				break;
+			for (unsigned e : we.Op)
+				if (e != NONE)
+					for (unsigned l : cand[k].Op)
+						if (l != NONE && depends(Ops[e], Ops[l]))
+						{	// A TMU request does not depend on the ldtmu of a previous request.
+							if (!isTmuLoad(we) || !(Ops[l].Wr.Misc & U_TMU) || !isTmuOnly(Ops[e]) || !isTmuOnly(Ops[l]))
+								goto done;
+							op a(Ops[e]), b(Ops[l]);
+							a.Rd.Misc &= ~U_IO;
+							a.Wr.Misc &= ~U_IO;
+							b.Rd.Misc &= ~U_IO;
+							b.Wr.Misc &= ~U_IO;
+							if (depends(a, b))
+								goto done;
+						}
+			if (isTmuLoad(we))
+			{	// Do not exceed the capacity of the request FIFO.
+				unsigned p = pending;
+				for (unsigned i = 0; i < k - 1; ++i)
+					p = tmuPending(cand[i], p, limit);
+				if (p + req > limit)
+					break;
+			}
+			swap(cand[k - 1], cand[k]);
+			if (checkTiming(cand, k - 1, j))
+			{	best = k - 1;
+				words = cand;
+			}
+		}
+	 done:
+		if (best != j)
+			Note(words[best].Op[0], "tmu", "Moved TMU request %u instruction%s earlier.", j - best, j - best == 1 ? "" : "s");
+	}
+}
+
+void Optimizer::insertThreadSwitches()
+{	if (!hasSignal(Inst::S_THRSW) || hasSignal(Inst::S_LTHRSW))
+		return;
+	const unsigned n = Blocks.size();
+	vector<vector<unsigned>> succ;
+	if (!blockSuccessors(succ))
+	{	Note(NONE, "tmu", "No thread switches inserted because of branches with unknown target.");
+		return;
+	}
+	// Accumulators and flags do not survive a thread switch.
+	auto liveBefore = [this](const word& w, uint32_t live)
+	{	uint32_t rd = 0, wr = 0;
+		for (unsigned o : w.Op)
+			if (o != NONE)
+			{	rd |= Ops[o].Rd.Misc;
+				wr |= Ops[o].Wr.Misc;
+			}
+		return ((live & ~wr) | rd) & (U_ACCU|U_FLAGS);
+	};
+	vector<uint32_t> in(n);
+	bool changed;
+	do
+	{	changed = false;
+		for (unsigned bi = n; bi--; )
+		{	if (Blocks[bi].Data)
+				continue;
+			uint32_t live = 0;
+			for (unsigned s : succ[bi])
+				live |= in[s];
+			const vector<word>& words = Blocks[bi].Words;
+			for (unsigned w = words.size(); w--; )
+				live = liveBefore(words[w], live);
+			if (live != in[bi])
+			{	in[bi] = live;
+				changed = true;
+			}
+		}
+	} while (changed);
+
+	for (unsigned bi = 0; bi < n; ++bi)
+	{	if (Blocks[bi].Data)
+			continue;
+		vector<word>& words = Blocks[bi].Words;
+		vector<uint32_t> live(words.size() + 1);
+		for (unsigned s : succ[bi])
+			live.back() |= in[s];
+		for (unsigned w = words.size(); w--; )
+			live[w] = liveBefore(words[w], live[w + 1]);
+		for (unsigned l = 3; l < words.size(); ++l)
+		{	if (!isTmuLoad(words[l]) || live[l])
+				continue;
+			// The request must be in the same block and close enough to cause a stall.
+			unsigned r = l;
+			while (r && !tmuRequests(words[r - 1]) && !isTmuLoad(words[r - 1]))
+				--r;
+			if (!r || !tmuRequests(words[--r]) || l - r >= TMU_LATENCY)
+				continue;
+			const unsigned k = l - 3;
+			for (unsigned w = k; w <= l; ++w)
+				if (isPinned(words[w]))
+					goto next;
+			for (unsigned o : words[k].Op)
+				if (o != NONE && Ops[o].I.Sig != Inst::S_NONE)
+					goto next;
+			{	op& t = Ops[words[k].Op[0]];
+				t.I.Sig = Inst::S_THRSW;
+				t.Raw = t.I.encode();
+				analyze(t);
+			}
+			for (unsigned w = k; w < l; ++w)
+				for (unsigned o : words[w].Op)
+					if (o != NONE)
+						Ops[o].Pinned = true;
+			Note(words[k].Op[0], "tmu", "Inserted thread switch in front of ldtmu.");
+		 next:;
+		}
+	}
+}
+
+void Optimizer::fillSfuLatency(block& bl)
+{	vector<word>& words = bl.Words;
+	const usage sfu(0, U_SFU);
+	setupTiming(words);
+	// Issue requests early, this places independent requests back to back.
+	for (unsigned j = 1; j < words.size(); ++j)
+	{	if (!writes(words[j], sfu) || isPinned(words[j]))
+			continue;
+		vector<word> cand(words);
+		unsigned best = j;
+		for (unsigned k = j; k && !isPinned(cand[k - 1]); --k)
+		{	for (unsigned e : cand[k - 1].Op)
+				if (e != NONE)
+					for (unsigned l : cand[k].Op)
+						if (l != NONE && depends(Ops[e], Ops[l]))
+							goto done;
+			swap(cand[k - 1], cand[k]);
+			if (checkTiming(cand, k - 1, j))
+			{	best = k - 1;
+				words = cand;
+			}
+		}
+	 done:
+		if (best != j)
+			Note(words[best].Op[0], "sfu", "Moved SFU request %u instruction%s earlier.", j - best, j - best == 1 ? "" : "s");
+	}
+
+	// Replace nop in the latency of each request.
+	for (unsigned s = 0; s < words.size(); ++s)
+	{	if (!writes(words[s], sfu))
+			continue;
+		for (unsigned k = s + 1; k <= s + 2 && k < words.size(); ++k)
+		{	if (!isNop(words[k]) || isPinned(words[k]))
+				continue;
+			vector<word> cand(words);
+			cand.erase(cand.begin() + k);
+			if (checkTiming(cand, k, k))
+			{	Note(words[k].Op[0], "sfu", "Removed nop after SFU request.");
+				words.swap(cand);
+				--k;
+				continue;
+			}
+			// Search for a word that does not depend on the words it moves across.
+			usage rd, wr; // access of the words in between
+			for (unsigned p = k + 1; p < words.size() && !isPinned(words[p]); ++p)
+			{	bool dep = false;
+				for (unsigned o : words[p].Op)
+					if (o != NONE && (Ops[o].Rd.intersects(wr) || Ops[o].Wr.intersects(rd) || Ops[o].Wr.intersects(wr)))
+						dep = true;
+				if (!dep && !isNop(words[p]))
+				{	cand = words;
+					cand[k] = words[p];
+					cand.erase(cand.begin() + p);
+					if (checkTiming(cand, k, p))
+					{	Note(words[p].Op[0], "sfu", "Moved instruction %u words up into the latency of an SFU request.", p - k);
+						words.swap(cand);
+						break;
+					}
+				}
+				for (unsigned o : words[p].Op)
+					if (o != NONE)
+					{	rd |= Ops[o].Rd;
+						wr |= Ops[o].Wr;
+					}
+			}
+		}
+	}
+}
+
+bool Optimizer::fallsThrough(const block& bl) const
+{	if (bl.Data)
+		return false;
+	for (const word& w : bl.Words)
+	{	const op& o = Ops[w.Op[0]];
+		if ( o.I.Sig == Inst::S_THREND
+			|| (o.I.Sig == Inst::S_BRANCH && o.I.CondBr == Inst::B_AL && !o.Wr.Regs && !o.Wr.Misc) )
+			return false;
+	}
+	return true;
+}
+
+bool Optimizer::removeBranch(block& bl, const block& next)
+{	const unsigned n = bl.Words.size();
+	const unsigned b = n - 4;
+	// Delay slots of signals must stay in place.
+	for (unsigned w = b >= 2 ? b - 2 : 0; w < n; ++w)
+		if (!Ops[bl.Words[w].Op[0]].Data)
+			switch (Ops[bl.Words[w].Op[0]].I.Sig)
+			{case Inst::S_BREAK:
+			 case Inst::S_THRSW:
+			 case Inst::S_THREND:
+			 case Inst::S_SBWAIT:
+			 case Inst::S_SBDONE:
+			 case Inst::S_LTHRSW:
+			 case Inst::S_LDCEND:
+				return false;
+			 default:;
+			}
+	vector<word> orig(bl.Words);
+	orig.insert(orig.end(), next.Words.begin(), next.Words.begin() + min((unsigned)next.Words.size(), (unsigned)MAX_DEPEND));
+	setupTiming(orig);
+	vector<word> words(orig);
+	words.erase(words.begin() + b);
+	if (!checkTiming(words, 0, words.size()))
+		return false;
+	unsigned removed = 0;
+	for (unsigned k = b; k < n - 1 - removed; )
+	{	if (!isNop(words[k]))
+		{	++k;
+			continue;
+		}
+		vector<word> cand(words);
+		cand.erase(cand.begin() + k);
+		if (!checkTiming(cand, 0, cand.size()))
+		{	++k;
+			continue;
+		}
+		words.swap(cand);
+		++removed;
+	}
+	words.erase(words.begin() + (n - 1 - removed), words.end());
+	bl.Words.swap(words);
+	return true;
+}
+
+void Optimizer::reachable(vector<bool>& reached) const
+{	reached.assign(Blocks.size(), false);
+	vector<unsigned> todo;
+	auto reach = [&reached, &todo](unsigned bi)
+	{	if (!reached[bi])
+		{	reached[bi] = true;
+			todo.push_back(bi);
+		}
+	};
+	if (Blocks.size())
+		reach(0);
+	for (unsigned e : Entries)
+		if (e < Count)
+			reach(upper_bound(Blocks.begin(), Blocks.end(), e, [](unsigned pc, const block& bl) { return pc < bl.Origin; }) - Blocks.begin() - 1);
+	while (todo.size())
+	{	const unsigned bi = todo.back();
+		todo.pop_back();
+		const block& bl = Blocks[bi];
+		if (bl.Data)
+			continue;
+		for (const word& w : bl.Words)
+		{	const op& o = Ops[w.Op[0]];
+			if (o.I.Sig == Inst::S_BRANCH && o.Target != NONE && o.Target < Count)
+			{	const block* tb = findBlock(o.Target);
+				if (!tb)
+				{	// unknown target, keep everything
+					reached.assign(Blocks.size(), true);
+					break;
+				}
+				reach(tb - Blocks.data());
+			}
+		}
+		if (fallsThrough(bl) && bi + 1 < Blocks.size())
+			reach(bi + 1);
+	}
+}
+
+void Optimizer::threadJumps()
+{	vector<bool> before;
+	reachable(before);
+
+	// Redirect branches to branches.
+	for (const block& bl : Blocks)
+	{	const unsigned n = bl.Words.size();
+		if (bl.Data || n < 4)
+			continue;
+		op& br = Ops[bl.Words[n - 4].Op[0]];
+		if (br.Data || br.I.Sig != Inst::S_BRANCH || br.Target == NONE || br.Skip)
+			continue;
+		bool flags = false; // the delay slots change the flags
+		for (unsigned w = n - 3; w < n; ++w)
+			flags |= writes(bl.Words[w], usage(0, U_FLAGS));
+		unsigned hops = 0;
+		while (hops < Blocks.size())
+		{	const block* tb = findBlock(br.Target);
+			if (!tb || tb->Data || tb->Words.size() < 4)
+				break;
+			const op& t = Ops[tb->Words[0].Op[0]];
+			if ( t.Data || t.I.Sig != Inst::S_BRANCH || t.Target == NONE || t.Target == br.Target || t.Skip
+				|| t.Wr.Regs || t.Wr.Misc
+				|| (t.I.CondBr != Inst::B_AL && (t.I.CondBr != br.I.CondBr || flags || (br.Wr.Misc & U_FLAGS))) )
+				break;
+			for (unsigned w = 1; w <= 3; ++w)
+				if (!isNop(tb->Words[w]))
+					goto done;
+			br.Target = t.Target;
+			++hops;
+		}
+	 done:
+		if (hops)
+			Note(bl.Words[n - 4].Op[0], "jump", "Redirected branch to the target of %u branch%s at its destination.", hops, hops == 1 ? "" : "es");
+	}
+
+	// Remove code that is no longer reachable.
+	vector<bool> after;
+	reachable(after);
+	unsigned kept = 0;
+	for (unsigned bi = 0; bi < Blocks.size(); ++bi)
+		if (!before[bi] || after[bi] || Blocks[bi].Data)
+		{	if (kept != bi)
+				Blocks[kept] = move(Blocks[bi]);
+			++kept;
+		} else if (Blocks[bi].Words.size())
+			Note(Blocks[bi].Words[0].Op[0], "jump", "Removed %u unreachable instruction word%s.",
+				(unsigned)Blocks[bi].Words.size(), Blocks[bi].Words.size() == 1 ? "" : "s");
+	Blocks.erase(Blocks.begin() + kept, Blocks.end());
+
+	// Remove branches to the next instruction.
+	for (unsigned bi = 0; bi + 1 < Blocks.size(); ++bi)
+	{	block& bl = Blocks[bi];
+		const unsigned n = bl.Words.size();
+		if (bl.Data || Blocks[bi + 1].Data || n < 4)
+			continue;
+		const unsigned ob = bl.Words[n - 4].Op[0];
+		const op& br = Ops[ob];
+		if ( !br.Data && br.I.Sig == Inst::S_BRANCH && br.Target == Blocks[bi + 1].Origin && !br.Skip
+			&& !br.Wr.Regs && !br.Wr.Misc && removeBranch(bl, Blocks[bi + 1]) )
+			Note(ob, "jump", "Removed branch to the next instruction.");
+	}
+}
+
+void Optimizer::liveness(vector<usage>& out) const
+{	const unsigned n = Blocks.size();
+	vector<vector<unsigned>> succ;
+	vector<bool> exits;
+	blockSuccessors(succ, &exits);
+	const usage all(~0ULL, U_ALL);
+	vector<usage> in(n);
+	for (unsigned bi = 0; bi < n; ++bi)
+		if (Blocks[bi].Data)
+			in[bi] = all;
+	out.assign(n, usage());
+	bool changed;
+	do
+	{	changed = false;
+		for (unsigned bi = n; bi-- > 0; )
+		{	const block& bl = Blocks[bi];
+			if (bl.Data)
+				continue;
+			usage u = exits[bi] || (fallsThrough(bl) && bi + 1 == n) ? all : usage();
+			for (unsigned s : succ[bi])
+				u |= in[s];
+			out[bi] = u;
+			for (unsigned w = bl.Words.size(); w-- > 0; )
+			{	usage rd, wr;
+				for (unsigned o : bl.Words[w].Op)
+					if (o != NONE)
+					{	rd |= Ops[o].Rd;
+						wr |= Ops[o].Wr;
+					}
+				// Both ops of a word read the values in front of the word.
+				u.Regs = (u.Regs & ~wr.Regs) | rd.Regs;
+				u.Misc = (u.Misc & ~wr.Misc) | rd.Misc;
+			}
+			if (u.Regs != in[bi].Regs || u.Misc != in[bi].Misc)
+			{	in[bi] = u;
+				changed = true;
+			}
+		}
+	} while (changed);
+}
+
+void Optimizer::freeUnused(Inst& i)
+{	if (!i.isALU())
+	{	if (i.WAddrA == Inst::R_NOP)
+			i.CondA = Inst::C_NEVER;
+		if (i.WAddrM == Inst::R_NOP)
+			i.CondM = Inst::C_NEVER;
+		return;
+	}
+	if (i.WAddrA == Inst::R_NOP && !i.isSFADD())
+	{	i.OpA = Inst::A_NOP;
+		i.MuxAA = i.MuxAB = Inst::X_R0;
+		i.CondA = Inst::C_NEVER;
+	}
+	if (i.WAddrM == Inst::R_NOP && !i.isSFMUL())
+	{	i.OpM = Inst::M_NOP;
+		i.MuxMA = i.MuxMB = Inst::X_R0;
+		i.CondM = Inst::C_NEVER;
+	}
+}
+
+unsigned Optimizer::replaceOp(vector<word>& words, unsigned w, unsigned o, const Inst& i)
+{	op& x = Ops[o];
+	x.I = i;
+	analyze(x);
+	if (!x.Wr.Regs && !x.Wr.Misc && !(x.Rd.Misc & U_IO))
+	{	vector<word> save(words);
+		if (removeOp(words, w, o))
+		{	if (checkTiming(words, w, w))
+				return 2;
+		} else if (checkTiming(words, w, w))
+			return 1;
+		words.swap(save);
+		x.I.reset();
+		x.I.CondA = x.I.CondM = Inst::C_NEVER;
+		analyze(x);
+	}
+	x.Raw = x.I.encode();
+	return 0;
+}
+
+bool Optimizer::removeDeadWrites(block& bl, usage live)
+{	vector<word>& words = bl.Words;
+	setupTiming(words);
+	bool changed = false;
+	for (unsigned w = words.size(); w-- > 0; )
+	{	if (!isPinned(words[w]))
+			for (unsigned k = 2; k-- > 0; )
+			{	const unsigned o = words[w].Op[k];
+				if (o == NONE)
+					continue;
+				op& x = Ops[o];
+				if (x.I.Sig == Inst::S_BRANCH || (x.I.Sig == Inst::S_LDI && (x.I.LdMode & Inst::L_SEMA)))
+					continue;
+				op cur;
+				cur.Data = false;
+				cur.I = x.I;
+				analyze(cur);
+				bool dropped = false;
+				for (bool mul : {false, true})
+				{	if ((mul ? cur.I.WAddrM : cur.I.WAddrA) == Inst::R_NOP)
+						continue;
+					op cand;
+					cand.Data = false;
+					cand.I = cur.I;
+					Inst& i = cand.I;
+					(mul ? i.WAddrM : i.WAddrA) = Inst::R_NOP;
+					freeUnused(i);
+					analyze(cand);
+					const usage gone(cur.Wr.Regs & ~cand.Wr.Regs, cur.Wr.Misc & ~cand.Wr.Misc);
+					if ((!gone.Regs && !gone.Misc) || (gone.Misc & ~(U_ACCU & ~U_R4)) || gone.intersects(live))
+						continue;
+					cur = cand;
+					dropped = true;
+				}
+				if (!dropped)
+					continue;
+				changed = true;
+				switch (replaceOp(words, w, o, cur.I))
+				{case 0:
+					Note(o, "dead", "Removed write that is never read.");
+					continue;
+				 case 1:
+					Note(o, "dead", "Removed instruction without effect.");
+					continue;
+				 default:
+					Note(o, "dead", "Removed instruction without effect.");
+					goto removed;
+				}
+			}
+		{	usage rd, wr;
+			for (unsigned o : words[w].Op)
+				if (o != NONE)
+				{	rd |= Ops[o].Rd;
+					wr |= Ops[o].Wr;
+				}
+			live.Regs = (live.Regs & ~wr.Regs) | rd.Regs;
+			live.Misc = (live.Misc & ~wr.Misc) | rd.Misc;
+		}
+	 removed:;
+	}
+	return changed;
+}
+
+void Optimizer::removeDeadCode()
+{	// Code behind thrend that is not reached otherwise.
+	vector<bool> reached;
+	reachable(reached);
+	bool end = false; // the previous block ends the program
+	unsigned kept = 0;
+	for (unsigned bi = 0; bi < Blocks.size(); ++bi)
+	{	block& bl = Blocks[bi];
+		if (end && !reached[bi] && !bl.Data)
+		{	if (bl.Words.size())
+				Note(bl.Words[0].Op[0], "dead", "Removed %u unreachable instruction word%s behind thrend.",
+					(unsigned)bl.Words.size(), bl.Words.size() == 1 ? "" : "s");
+			continue;
+		}
+		end = false;
+		if (!fallsThrough(bl))
+			for (const word& w : bl.Words)
+				end |= !Ops[w.Op[0]].Data && Ops[w.Op[0]].I.Sig == Inst::S_THREND;
+		if (kept != bi)
+			Blocks[kept] = move(bl);
+		++kept;
+	}
+	Blocks.erase(Blocks.begin() + kept, Blocks.end());
+
+	vector<usage> out;
+	bool changed;
+	do
+	{	liveness(out);
+		changed = false;
+		for (unsigned bi = 0; bi < Blocks.size(); ++bi)
+			if (!Blocks[bi].Data)
+				changed |= removeDeadWrites(Blocks[bi], out[bi]);
+	} while (changed);
+}
+
+Optimizer::usage Optimizer::flagInputs(const Inst& i)
+{	usage u;
+	if (!i.isSFADD())
+	{	u |= muxUsage(i, i.MuxMA);
+		u |= muxUsage(i, i.MuxMB);
+		if (i.Sig == Inst::S_SMI && i.SImmd == 48) // rotate by r5
+			u.Misc |= U_R5;
+	} else
+	{	u |= muxUsage(i, i.MuxAA);
+		u |= muxUsage(i, i.MuxAB);
+	}
+	return u;
+}
+
+bool Optimizer::sameFlags(const Inst& a, const Inst& b)
+{	if ( !a.isALU() || !b.isALU() || !a.SF || !b.SF || a.isSFADD() != b.isSFADD()
+		|| a.Unpack != b.Unpack || a.PM != b.PM || a.Pack != b.Pack )
+		return false;
+	Inst::mux m1, m2;
+	if (a.isSFADD())
+	{	if (a.CondA != Inst::C_AL || b.CondA != Inst::C_AL || a.OpA != b.OpA || a.MuxAA != b.MuxAA || a.MuxAB != b.MuxAB)
+			return false;
+		m1 = a.MuxAA;
+		m2 = a.MuxAB;
+	} else
+	{	if (a.CondM != Inst::C_AL || b.CondM != Inst::C_AL || a.OpM != b.OpM || a.MuxMA != b.MuxMA || a.MuxMB != b.MuxMB)
+			return false;
+		// vector rotation
+		if ( ((a.Sig == Inst::S_SMI && a.SImmd >= 48) || (b.Sig == Inst::S_SMI && b.SImmd >= 48))
+			&& (a.Sig != b.Sig || a.SImmd != b.SImmd) )
+			return false;
+		m1 = a.MuxMA;
+		m2 = a.MuxMB;
+	}
+	return sameSource(a, b, m1) && sameSource(a, b, m2);
+}
+
+bool Optimizer::removeRedundantFlags(block& bl, usage live)
+{	vector<word>& words = bl.Words;
+	setupTiming(words);
+	bool changed = false;
+
+	// Flags that are set again from the same unchanged operands.
+	unsigned avail = NONE; // op that set the current flags
+	usage inputs;          // operands of avail
+	for (unsigned w = 0; w < words.size(); ++w)
+	{	bool invalid = false;
+		for (unsigned k = 0; k < 2; ++k)
+		{	const unsigned o = words[w].Op[k];
+			if (o == NONE)
+				continue;
+			const Inst& i = Ops[o].I;
+			if (i.Sig == Inst::S_THRSW || i.Sig == Inst::S_LTHRSW)
+				invalid = true; // flags are not preserved
+			if (!i.SF && !(Ops[o].Wr.Misc & U_FLAGS))
+				continue;
+			if (avail == NONE || isPinned(words[w]) || !sameFlags(Ops[avail].I, i))
+			{	avail = i.isALU() && i.SF ? o : NONE;
+				inputs = avail != NONE ? flagInputs(i) : usage();
+				continue;
+			}
+			Inst n = i;
+			n.SF = false;
+			freeUnused(n);
+			changed = true;
+			Note(o, "flags", "Removed .setf, the flags did not change.");
+			if (replaceOp(words, w, o, n) == 2)
+			{	--w;
+				goto next;
+			}
+			break;
+		}
+		if (invalid || (avail != NONE && writes(words[w], inputs)))
+			avail = NONE;
+	 next:;
+	}
+
+	// Flags that are never read.
+	for (unsigned w = words.size(); w-- > 0; )
+	{	if (!(live.Misc & U_FLAGS) && !isPinned(words[w]))
+			for (unsigned k = 2; k-- > 0; )
+			{	const unsigned o = words[w].Op[k];
+				if (o == NONE || !Ops[o].I.isALU() || !Ops[o].I.SF)
+					continue;
+				Inst n = Ops[o].I;
+				n.SF = false;
+				freeUnused(n);
+				changed = true;
+				Note(o, "flags", "Removed .setf, the flags are never read.");
+				if (replaceOp(words, w, o, n) == 2)
+					goto removed;
+			}
+		{	usage rd, wr;
+			for (unsigned o : words[w].Op)
+				if (o != NONE)
+				{	rd |= Ops[o].Rd;
+					wr |= Ops[o].Wr;
+				}
+			live.Regs = (live.Regs & ~wr.Regs) | rd.Regs;
+			live.Misc = (live.Misc & ~wr.Misc) | rd.Misc;
+		}
+	 removed:;
+	}
+	return changed;
+}
+
+void Optimizer::simplifyFlags()
+{	vector<usage> out;
+	bool changed;
+	do
+	{	liveness(out);
+		changed = false;
+		for (unsigned bi = 0; bi < Blocks.size(); ++bi)
+			if (!Blocks[bi].Data)
+				changed |= removeRedundantFlags(Blocks[bi], out[bi]);
+	} while (changed);
+}
+
+void Optimizer::arrangeBlocks()
+{	for (unsigned bi = 0; bi < Blocks.size(); ++bi)
+	{	block& bl = Blocks[bi];
+		const unsigned n = bl.Words.size();
+		if (bl.Data || n < 4)
+			continue;
+		const unsigned b = n - 4;
+		const unsigned ob = bl.Words[b].Op[0];
+		const op& br = Ops[ob];
+		if ( br.Data || br.I.Sig != Inst::S_BRANCH || br.I.CondBr != Inst::B_AL || br.Target == NONE
+			|| br.Skip || br.Wr.Regs || br.Wr.Misc )
+			continue;
+		const block* tb = findBlock(br.Target);
+		if (!tb || tb->Data)
+			continue;
+		// The target must not be entered by fall through.
+		const unsigned t = tb - Blocks.data();
+		if (!t || t == bi + 1 || fallsThrough(Blocks[t - 1]))
+			continue;
+		// Move the target together with the blocks it falls through to.
+		unsigned e = t;
+		while (fallsThrough(Blocks[e]) && e + 1 < Blocks.size())
+			++e;
+		if (fallsThrough(Blocks[e]) || (bi >= t && bi <= e) || !removeBranch(bl, *tb))
+			continue;
+		{	vector<block> chain(make_move_iterator(Blocks.begin() + t), make_move_iterator(Blocks.begin() + e + 1));
+			Blocks.erase(Blocks.begin() + t, Blocks.begin() + e + 1);
+			if (t < bi)
+				bi -= chain.size();
+			Blocks.insert(Blocks.begin() + bi + 1, make_move_iterator(chain.begin()), make_move_iterator(chain.end()));
+			Note(ob, "layout", "Removed branch by moving %u block%s behind it.", (unsigned)chain.size(), chain.size() == 1 ? "" : "s");
+		}
+	}
+}
+
+unsigned Optimizer::stalls(const vector<word>& words, unsigned from, unsigned to) const
+{	// issue cycle of each word, relative to from
+	vector<unsigned> issue(to - from);
+	unsigned ret = 0;
+	for (unsigned j = from; j < to; ++j)
+	{	unsigned cycle = j - from + ret;
+		for (unsigned k = from; k < j; ++k)
+			for (unsigned e : words[k].Op)
+				if (e != NONE)
+					for (unsigned l : words[j].Op)
+						if (l != NONE && depends(Ops[e], Ops[l]))
+							cycle = max(cycle, issue[k - from] + latency(Ops[e], Ops[l]));
+		issue[j - from] = cycle;
+		ret = cycle - (j - from);
+	}
+	return ret;
+}
+
+unsigned Optimizer::scheduleRange(vector<word>& words, unsigned from, unsigned to)
+{	// nop words are not scheduled but used as filler
+	vector<word> units, nops;
+	for (unsigned i = from; i < to; ++i)
+		(isNop(words[i]) ? nops : units).push_back(words[i]);
+	const unsigned n = units.size();
+	if (n + nops.size() < 2)
+		return to - from;
+
+	// dependency graph
+	vector<vector<pair<unsigned,unsigned>>> succ(n); // successor, latency
+	vector<unsigned> height(n, 1), preds(n), earliest(n);
+	for (unsigned i = n; i--; )
+		for (unsigned j = i + 1; j < n; ++j)
+		{	unsigned lat = 0;
+			for (unsigned e : units[i].Op)
+				if (e != NONE)
+					for (unsigned l : units[j].Op)
+						if (l != NONE && depends(Ops[e], Ops[l]))
+							lat = max(lat, latency(Ops[e], Ops[l]));
+			if (lat)
+			{	succ[i].emplace_back(j, lat);
+				++preds[j];
+				height[i] = max(height[i], height[j] + lat);
+			}
+		}
+
+	// place the words
+	vector<word> sched(words.begin(), words.begin() + from);
+	vector<bool> done(n);
+	vector<unsigned> ready;
+	unsigned used = 0; // nop words used
+	auto isValid = [this](uint64_t key, unsigned dist) { return isAllowed(key, dist); };
+	for (unsigned left = n; left; )
+	{	unsigned pos = sched.size() - from;
+		ready.clear();
+		for (unsigned i = 0; i < n; ++i)
+			if (!done[i] && !preds[i])
+				ready.push_back(i);
+		// Prefer words whose inputs are available, then the longest critical path, then the source order.
+		sort(ready.begin(), ready.end(), [&earliest, &height, pos](unsigned a, unsigned b)
+		{	bool ra = earliest[a] <= pos;
+			bool rb = earliest[b] <= pos;
+			if (ra != rb)
+				return ra;
+			if (height[a] != height[b])
+				return height[a] > height[b];
+			return a < b;
+		});
+		unsigned sel = NONE;
+		for (unsigned i : ready)
+		{	sched.push_back(units[i]);
+			if (forEachViolation(sched, sched.size() - 1, sched.size() - 1, isValid))
+			{	sel = i;
+				break;
+			}
+			sched.pop_back();
+		}
+		if (sel == NONE)
+		{	if (used == nops.size())
+				return to - from; // no valid schedule found
+			sched.push_back(nops[used++]);
+			continue;
+		}
+		done[sel] = true;
+		--left;
+		for (auto& s : succ[sel])
+		{	--preds[s.first];
+			earliest[s.first] = max(earliest[s.first], pos + s.second);
+		}
+	}
+
+	// Check the words after the range and fill up with nop if required.
+	unsigned end = sched.size();
+	sched.insert(sched.end(), words.begin() + to, words.end());
+	while (!checkTiming(sched, from, end - 1))
+	{	if (used == nops.size())
+			return to - from;
+		sched.emplace(sched.begin() + end++, nops[used++]);
+	}
+
+	// Any improvement?
+	unsigned before = stalls(words, from, to);
+	unsigned after = stalls(sched, from, end);
+	if (end == to && after >= before)
+		return to - from;
+	words.swap(sched);
+	Note(words[from].Op[0], "schedule", "Reordered %u instruction words, removed %u nop, estimated stall cycles %u instead of %u.",
+		end - from, to - end, after, before);
+	return end - from;
+}
+
+void Optimizer::scheduleInstructions(block& bl)
+{	vector<word>& words = bl.Words;
+	setupTiming(words);
+	for (unsigned from = 0; from < words.size(); )
+	{	if (isPinned(words[from]))
+		{	++from;
+			continue;
+		}
+		unsigned to = from;
+		while (to < words.size() && !isPinned(words[to]))
+			++to;
+		from += scheduleRange(words, from, to);
+	}
+}
+
+void Optimizer::fillDelaySlots(block& bl)
+{	vector<word>& words = bl.Words;
+	for (unsigned b = 0; b + MAX_DEPEND < words.size(); ++b)
+	{	const unsigned ob = words[b].Op[0];
+		const op& br = Ops[ob];
+		if (br.Data || br.I.Sig != Inst::S_BRANCH)
+			continue;
+		// Successors
+		const block* target = br.Target != NONE ? findBlock(br.Target) : NULL;
+		if (target && target->Data)
+			target = NULL;
+		vector<path> paths;
+		paths.push_back(path{target, br.Skip, br.Skip});
+		if (br.I.CondBr != Inst::B_AL)
+		{	const block* next = &bl + 1 < Blocks.data() + Blocks.size() ? &bl + 1 : NULL;
+			paths.push_back(path{next && !next->Data ? next : NULL, 0, 0});
+		}
+
+		// Move independent instructions from before the branch into the slots.
+		for (unsigned k = b + 1; k <= b + 3; ++k)
+		{	if (!isNop(words[k]))
+				continue;
+			for (unsigned p = b; p-- > 0; )
+			{	const word& wp = words[p];
+				if (isPinned(wp))
+					break;
+				if (wp.size() != 1)
+					continue;
+				const op& o = Ops[wp.Op[0]];
+				bool dep = false;
+				for (unsigned q = p + 1; q < k && !dep; ++q)
+					for (unsigned x : words[q].Op)
+						if (x != NONE && depends(o, Ops[x]))
+							dep = true;
+				if (dep)
+					continue;
+				vector<word> changed(words);
+				changed[k] = wp;
+				changed.erase(changed.begin() + p);
+				if (!checkPaths(words, changed, paths))
+					continue;
+				Ops[wp.Op[0]].Pinned = true;
+				Note(wp.Op[0], "delay", "Moved instruction into branch delay slot %u.", k - b);
+				words.swap(changed);
+				--b;
+				--k;
+				break;
+			}
+		}
+
+		// Copy the first words at the target of unconditional branches into the last slots.
+		if (br.I.CondBr != Inst::B_AL || !target)
+			continue;
+		const unsigned skip = br.Skip;
+		unsigned m = 0; // words to copy
+		while ( m < MAX_DEPEND && isNop(words[b + MAX_DEPEND - m]) && skip + m + 1 < target->Words.size()
+			&& !isPinned(target->Words[skip + m]) )
+			++m;
+		for (; m; --m)
+		{	const unsigned count = Ops.size();
+			vector<word> changed(words);
+			for (unsigned i = 0; i < m; ++i)
+			{	word& w = changed[b + MAX_DEPEND + 1 - m + i];
+				w = target->Words[skip + i];
+				for (unsigned& o : w.Op)
+					if (o != NONE)
+					{	op copy = Ops[o];
+						copy.Pinned = true;
+						Ops.push_back(copy);
+						o = Ops.size() - 1;
+					}
+			}
+			paths[0].NewSkip = skip + m;
+			if (checkPaths(words, changed, paths))
+			{	Ops[ob].Skip += m;
+				// The target must not change anymore.
+				for (unsigned i = 0; i <= skip + m; ++i)
+					for (unsigned o : target->Words[i].Op)
+						if (o != NONE)
+							Ops[o].Pinned = true;
+				words.swap(changed);
+				for (unsigned k = b + 1; k <= b + MAX_DEPEND; ++k)
+					for (unsigned o : words[k].Op)
+						if (o >= count && o != NONE)
+							Note(o, "delay", "Copied instruction from the branch target into delay slot %u.", k - b);
+				break;
+			}
+			Ops.resize(count);
+		}
+	}
+}
+
+/// ALU operations to synthesize constants, see Optimizer::synthesize().
+static const struct { bool Mul; uint8_t Op; } constOps[] =
+{	{false, Inst::A_OR }
+,	{false, Inst::A_ADD }
+,	{false, Inst::A_SUB }
+,	{false, Inst::A_SHR }
+,	{false, Inst::A_ASR }
+,	{false, Inst::A_ROR }
+,	{false, Inst::A_SHL }
+,	{false, Inst::A_MIN }
+,	{false, Inst::A_MAX }
+,	{false, Inst::A_AND }
+,	{false, Inst::A_XOR }
+,	{false, Inst::A_NOT }
+,	{false, Inst::A_CLZ }
+,	{false, Inst::A_FADD }
+,	{false, Inst::A_FSUB }
+,	{false, Inst::A_FMIN }
+,	{false, Inst::A_FMAX }
+,	{false, Inst::A_FMINABS }
+,	{false, Inst::A_FMAXABS }
+,	{false, Inst::A_FTOI }
+,	{false, Inst::A_ITOF }
+,	{false, Inst::A_V8ADDS }
+,	{false, Inst::A_V8SUBS }
+,	{true,  Inst::M_V8MIN }
+,	{true,  Inst::M_FMUL }
+,	{true,  Inst::M_MUL24 }
+,	{true,  Inst::M_V8MULD }
+,	{true,  Inst::M_V8MAX }
+,	{true,  Inst::M_V8ADDS }
+,	{true,  Inst::M_V8SUBS }
+};
+
+/// Check whether an ALU operation uses only its first operand.
+static bool isUnary(bool mul, uint8_t op)
+{	return !mul && (op == Inst::A_FTOI || op == Inst::A_ITOF || op == Inst::A_NOT || op == Inst::A_CLZ);
+}
+
+bool Optimizer::evalStep(const step& s, const qpuValue* acc, qpuValue target, qpuValue& result)
+{	Inst i;
+	i.reset();
+	i.Sig = Inst::S_SMI;
+	i.SImmd = s.SImmd;
+	i.Pack = s.Pack;
+	i.WS = s.Mul; // apply regfile A pack mode
+	auto value = [&](uint8_t src) { return src < 4 ? acc[src] : src == SRC_SMI ? i.SMIValue() : target; };
+	qpuValue l = value(s.A);
+	qpuValue r = value(s.B);
+	// The hardware flushes denormals and does not handle Inf/NaN like IEEE 754.
+	auto isExact = [](qpuValue v) { return !(v.uValue & 0x7fffffff) || isnormal(v.fValue); };
+	bool flt = s.Mul ? s.Op == Inst::M_FMUL : s.Op >= Inst::A_FADD && s.Op <= Inst::A_FTOI;
+	if (flt && (!isExact(l) || !isExact(r)))
+		return false;
+	if (s.Mul)
+	{	i.OpM = (Inst::opmul)s.Op;
+		if (!i.evalMUL(l, r))
+			return false;
+	} else
+	{	i.OpA = (Inst::opadd)s.Op;
+		if (!i.evalADD(l, r))
+			return false;
+	}
+	if (flt && s.Op != Inst::A_FTOI && !isExact(l))
+		return false;
+	// The pack mode must replace all bits.
+	qpuValue r0, r1;
+	r0.uValue = 0;
+	r1.uValue = ~0U;
+	if (!i.evalPack(r0, l, s.Mul) || !i.evalPack(r1, l, s.Mul) || r0.uValue != r1.uValue)
+		return false;
+	result = r0;
+	return true;
+}
+
+bool Optimizer::makeStep(const step& s, const Inst& ldi, Inst& r)
+{	const bool mul = ldi.WAddrA == Inst::R_NOP;
+	const uint8_t reg = mul ? ldi.WAddrM : ldi.WAddrA;
+	const bool fileB = ldi.WS != mul;
+	r.reset();
+	if (s.A == SRC_SMI || s.B == SRC_SMI)
+	{	r.Sig = Inst::S_SMI;
+		r.SImmd = s.SImmd;
+	}
+	if (s.Pack)
+	{	if (fileB || reg >= 32)
+			return false;
+		r.Pack = s.Pack;
+	}
+	r.WS = fileB != s.Mul;
+	auto mux = [&](uint8_t src, Inst::mux& m)
+	{	if (src < 4)
+			m = (Inst::mux)src;
+		else if (src == SRC_SMI)
+			m = Inst::X_RB;
+		else if (reg >= 32 && reg < 36) // r0..r3
+			m = (Inst::mux)(reg - 32);
+		else if (reg >= 32)
+			return false;
+		else if (!fileB)
+		{	r.RAddrA = reg;
+			m = Inst::X_RA;
+		} else if (r.Sig == Inst::S_SMI)
+			return false;
+		else
+		{	r.RAddrB = reg;
+			m = Inst::X_RB;
+		}
+		return true;
+	};
+	if (s.Mul)
+	{	r.OpM = (Inst::opmul)s.Op;
+		r.WAddrM = reg;
+		return mux(s.A, r.MuxMA) && mux(s.B, r.MuxMB);
+	} else
+	{	r.OpA = (Inst::opadd)s.Op;
+		r.WAddrA = reg;
+		return mux(s.A, r.MuxAA) && mux(s.B, r.MuxAB);
+	}
+}
+
+void Optimizer::setupSmiSteps()
+{	static const Inst::pack packs[] = { Inst::P_32, Inst::P_8abcd, Inst::P_8abcdS };
+	SmiSteps.clear();
+	for (Inst::pack pack : packs)
+		for (const auto& co : constOps)
+			for (uint8_t si = 0; si < 48; ++si)
+			{	step s = { co.Mul, co.Op, SRC_SMI, SRC_SMI, si, pack };
+				qpuValue v;
+				v.uValue = 0;
+				if (!evalStep(s, NULL, v, v))
+					continue;
+				vector<step>& alt = SmiSteps[v.uValue];
+				if (alt.size() < 2 && (!alt.size() || alt[0].Mul != s.Mul))
+					alt.push_back(s);
+			}
+}
+
+unsigned Optimizer::knownAccus(const vector<word>& words, unsigned w, qpuValue* acc) const
+{	unsigned known = 0;
+	unsigned thrsw = NONE; // last word before the thread switch takes effect
+	for (unsigned p = 0; p < w; ++p)
+	{	// Both ops of a word read the values before the word.
+		qpuValue value[4];
+		unsigned written = 0, valid = 0;
+		for (unsigned o : words[p].Op)
+		{	if (o == NONE)
+				continue;
+			const op& x = Ops[o];
+			if (x.Data)
+				return 0;
+			const Inst& i = x.I;
+			if (i.Sig == Inst::S_THRSW || i.Sig == Inst::S_LTHRSW)
+				thrsw = p + 2;
+			for (unsigned n = 0; n < 4; ++n)
+			{	if (!(x.Wr.Misc & (U_R0 << n)))
+					continue;
+				written |= 1 << n;
+				// Unconditional write without pack and unpack.
+				bool mul = i.WAddrM == 32 + n;
+				if ((mul ? i.CondM : i.CondA) != Inst::C_AL || (i.Pack & (15 >> i.PM)))
+					continue;
+				if (i.Sig == Inst::S_LDI)
+				{	if (i.LdMode != Inst::L_LDI)
+						continue;
+					value[n] = i.Immd;
+				} else
+				{	if ((i.Sig != Inst::S_NONE && (i.Sig != Inst::S_SMI || i.SImmd >= 48)) || (i.Unpack & 7))
+						continue;
+					// operands must be small immediates or known accumulators
+					step s = { mul, mul ? (uint8_t)i.OpM : (uint8_t)i.OpA, 0, 0, i.SImmd, Inst::P_32 };
+					auto operand = [&](Inst::mux m, uint8_t& src)
+					{	if (m == Inst::X_RB && i.Sig == Inst::S_SMI)
+							src = SRC_SMI;
+						else if (m <= Inst::X_R3 && (known & (1 << m)))
+							src = m;
+						else
+							return false;
+						return true;
+					};
+					if ( !operand(mul ? i.MuxMA : i.MuxAA, s.A)
+						|| !(isUnary(mul, s.Op) ? (s.B = s.A, true) : operand(mul ? i.MuxMB : i.MuxAB, s.B))
+						|| !evalStep(s, acc, value[n], value[n]) )
+						continue;
+				}
+				valid |= 1 << n;
+			}
+		}
+		for (unsigned n = 0; n < 4; ++n)
+			if (valid & (1 << n))
+				acc[n] = value[n];
+		known = (known & ~written) | valid;
+		// Accumulators do not survive the thread switch.
+		if (p == thrsw)
+			known = 0;
+	}
+	return known;
+}
+
+void Optimizer::synthesize(qpuValue value, const qpuValue* acc, unsigned known, bool twoSteps, vector<recipe>& result) const
+{	const size_t limit = 8;
+	result.clear();
+	qpuValue v;
+	v.uValue = 0;
+	// single operation with small immediate values
+	auto sp = SmiSteps.find(value.uValue);
+	if (sp != SmiSteps.end())
+		for (const step& s : sp->second)
+			result.push_back(recipe(1, s));
+	// single operation with a known accumulator value
+	for (unsigned a = 0; a < 4; ++a)
+	{	if (!(known & (1 << a)))
+			continue;
+		for (const auto& co : constOps)
+		{	step s = { co.Mul, co.Op, (uint8_t)a, (uint8_t)a, 0, Inst::P_32 };
+			const bool unary = isUnary(co.Mul, co.Op);
+			for (unsigned b = unary ? a : 0; b < (unary ? a + 1 : 4 + 48); ++b)
+			{	if (b < 4)
+				{	if (!(known & (1 << b)))
+						continue;
+					s.B = b;
+					if (evalStep(s, acc, v, v) && v.uValue == value.uValue)
+						result.push_back(recipe(1, s));
+				} else
+				{	// small immediate as first or second operand
+					s.SImmd = b - 4;
+					s.A = a;
+					s.B = SRC_SMI;
+					if (evalStep(s, acc, v, v) && v.uValue == value.uValue)
+						result.push_back(recipe(1, s));
+					s.A = SRC_SMI;
+					s.B = a;
+					if (evalStep(s, acc, v, v) && v.uValue == value.uValue)
+						result.push_back(recipe(1, s));
+					s.A = a;
+				}
+				if (result.size() >= limit)
+					return;
+			}
+		}
+	}
+	if (!twoSteps)
+		return;
+
+	// Two operations: the second one takes the result of the first one from the target register.
+	// Candidates for the intermediate value are computed by inverting the second operation.
+	auto tryStep = [&](uint32_t pre, const step& s2)
+	{	auto pp = SmiSteps.find(pre);
+		if (pp == SmiSteps.end())
+			return;
+		for (const step& s1 : pp->second)
+		{	qpuValue t, r;
+			t.uValue = 0;
+			if ( result.size() < limit && evalStep(s1, acc, t, t)
+				&& evalStep(s2, acc, t, r) && r.uValue == value.uValue )
+				result.push_back(recipe{s1, s2});
+		}
+	};
+	const uint32_t u = value.uValue;
+	{	step s = { false, Inst::A_ADD, SRC_TARGET, SRC_TARGET, 0, Inst::P_32 };
+		tryStep(u >> 1, s);
+		tryStep(u >> 1 | 0x80000000, s);
+		if (isnormal(value.fValue) && value.fValue > 0)
+		{	s = { true, Inst::M_FMUL, SRC_TARGET, SRC_TARGET, 0, Inst::P_32 };
+			qpuValue q;
+			q.fValue = sqrtf(value.fValue);
+			tryStep(q.uValue, s);
+		}
+	}
+	Inst i;
+	i.Sig = Inst::S_SMI;
+	for (uint8_t si = 0; si < 48 && result.size() < limit; ++si)
+	{	i.SImmd = si;
+		const qpuValue c = i.SMIValue();
+		const unsigned k = c.uValue & 31;
+		auto form = [&](bool mul, uint8_t op, uint8_t a, uint8_t b, uint32_t pre)
+		{	step s = { mul, op, a, b, si, Inst::P_32 };
+			tryStep(pre, s);
+		};
+		form(false, Inst::A_ADD, SRC_TARGET, SRC_SMI, u - c.uValue);
+		form(false, Inst::A_SUB, SRC_TARGET, SRC_SMI, u + c.uValue);
+		form(false, Inst::A_SUB, SRC_SMI, SRC_TARGET, c.uValue - u);
+		form(false, Inst::A_XOR, SRC_TARGET, SRC_SMI, u ^ c.uValue);
+		form(false, Inst::A_ROR, SRC_TARGET, SRC_SMI, k ? u << k | u >> (32 - k) : u);
+		form(false, Inst::A_SHL, SRC_TARGET, SRC_SMI, u >> k);
+		form(false, Inst::A_SHL, SRC_TARGET, SRC_SMI, (uint32_t)((int32_t)u >> k));
+		form(false, Inst::A_SHR, SRC_TARGET, SRC_SMI, u << k);
+		form(false, Inst::A_ASR, SRC_TARGET, SRC_SMI, u << k);
+		if (c.uValue & 0xffffff)
+		{	uint32_t f = c.uValue & 0xffffff;
+			if (!(u % f))
+				form(true, Inst::M_MUL24, SRC_TARGET, SRC_SMI, u / f);
+		}
+		if (isnormal(value.fValue) && isnormal(c.fValue))
+		{	qpuValue q;
+			q.fValue = value.fValue - c.fValue;
+			form(false, Inst::A_FADD, SRC_TARGET, SRC_SMI, q.uValue);
+			q.fValue = value.fValue / c.fValue;
+			form(true, Inst::M_FMUL, SRC_TARGET, SRC_SMI, q.uValue);
+		}
+	}
+}
+
+bool Optimizer::absorb(vector<word>& words, unsigned b)
+{	const unsigned ob = words[b].Op[0];
+	// search backwards for a partner
+	for (unsigned p = b; p-- > 0; )
+	{	if (isPinned(words[p]))
+			break;
+		unsigned oa = words[p].Op[0];
+		Inst ia = Ops[oa].I;
+		Inst ib = Ops[ob].I;
+		Inst res;
+		if ( words[p].size() == 1 && canShare(Ops[oa], Ops[ob])
+			&& combine(ia, ib, res, Ops[oa].NoSwap | Ops[ob].NoSwap << 1) )
+		{	words[p].Op[1] = ob;
+			words.erase(words.begin() + b);
+			if (checkTiming(words, p, b))
+			{	Ops[oa].I = ia;
+				Ops[ob].I = ib;
+				return true;
+			}
+			// revert
+			words.emplace(words.begin() + b, ob);
+			words[p].Op[1] = NONE;
+		}
+		// Cannot move across a dependency.
+		if (depends(Ops[oa], Ops[ob]) || (words[p].Op[1] != NONE && depends(Ops[words[p].Op[1]], Ops[ob])))
+			break;
+	}
+	// search forwards for an op that can move into the word
+	usage rd, wr; // access of the words in between
+	for (unsigned q = b + 1; q < words.size(); ++q)
+	{	if (isPinned(words[q]))
+			break;
+		unsigned oq = words[q].Op[0];
+		Inst ia = Ops[ob].I;
+		Inst iq = Ops[oq].I;
+		Inst res;
+		if ( words[q].size() == 1 && !wr.intersects(Ops[oq].Rd) && !rd.intersects(Ops[oq].Wr) && !wr.intersects(Ops[oq].Wr) && canShare(Ops[ob], Ops[oq])
+			&& combine(ia, iq, res, Ops[ob].NoSwap | Ops[oq].NoSwap << 1) )
+		{	words[b].Op[1] = oq;
+			words.erase(words.begin() + q);
+			if (checkTiming(words, b, q))
+			{	Ops[ob].I = ia;
+				Ops[oq].I = iq;
+				return true;
+			}
+			// revert
+			words.emplace(words.begin() + q, oq);
+			words[b].Op[1] = NONE;
+		}
+		for (unsigned x : words[q].Op)
+			if (x != NONE)
+			{	rd |= Ops[x].Rd;
+				wr |= Ops[x].Wr;
+			}
+	}
+	return false;
+}
+
+bool Optimizer::placeRecipe(vector<word>& words, unsigned w, const recipe& rc)
+{	const unsigned ol = words[w].Op[0];
+	const unsigned count = Ops.size();
+	vector<word> save(words);
+	// absorb() might swap the ALU of other ops
+	vector<Inst> insts;
+	for (const word& wd : words)
+		for (unsigned o : wd.Op)
+			if (o != NONE)
+				insts.push_back(Ops[o].I);
+	words.erase(words.begin() + w);
+	for (unsigned k = 0; k < rc.size(); ++k)
+	{	op o = Ops[ol]; // keeps the source location
+		if (!makeStep(rc[k], Ops[ol].I, o.I))
+			goto fail;
+		o.Raw = o.I.encode();
+		analyze(o);
+		Ops.push_back(o);
+		words.emplace(words.begin() + w + k, Ops.size() - 1);
+	}
+	// Each step must take a free ALU slot.
+	for (unsigned o = count; o < Ops.size(); ++o)
+	{	unsigned b = 0;
+		while (words[b].Op[0] != o)
+			++b;
+		if (!absorb(words, b))
+			goto fail;
+	}
+	return true;
+ fail:
+	words.swap(save);
+	Ops.resize(count);
+	auto ip = insts.begin();
+	for (const word& wd : words)
+		for (unsigned o : wd.Op)
+			if (o != NONE)
+				Ops[o].I = *ip++;
+	return false;
+}
+
+void Optimizer::materializeConstants(block& bl)
+{	vector<word>& words = bl.Words;
+	setupTiming(words);
+	vector<recipe> recipes;
+	for (unsigned w = 0; w < words.size(); ++w)
+	{	if (words[w].size() != 1 || isPinned(words[w]))
+			continue;
+		const unsigned ol = words[w].Op[0];
+		const Inst& l = Ops[ol].I;
+		// unconditional ldi to exactly one register without flags and pack mode
+		if ( l.Sig != Inst::S_LDI || l.LdMode != Inst::L_LDI || l.SF || (l.Pack & (15 >> l.PM))
+			|| (l.WAddrA == Inst::R_NOP) == (l.WAddrM == Inst::R_NOP)
+			|| (l.WAddrA != Inst::R_NOP ? l.CondA : l.CondM) != Inst::C_AL )
+			continue;
+		// Intermediate results must not be written to peripheral registers.
+		uint8_t reg = l.WAddrA != Inst::R_NOP ? l.WAddrA : l.WAddrM;
+		qpuValue acc[4];
+		unsigned known = knownAccus(words, w, acc);
+		synthesize(l.Immd, acc, known, reg < 36, recipes);
+		for (const recipe& rc : recipes)
+			if (placeRecipe(words, w, rc))
+			{	Note(Ops.size() - rc.size(), "const", "Replaced ldi 0x%x by %u small immediate operation%s in free ALU slots.",
+					Ops[ol].I.Immd.uValue, (unsigned)rc.size(), rc.size() > 1 ? "s" : "");
+				--w;
+				break;
+			}
+	}
+}
+
+void Optimizer::AddTarget(unsigned pc)
+{	if (Targets.size() <= pc)
+		Targets.resize(pc + 1);
+	Targets[pc] = true;
+}
+
+void Optimizer::Append(uint64_t code, bool data, bool target, bool noswap, const DebugInfo::location& loc, const string& text)
+{	unsigned pc = Ops.size() - 2;
+	Ops.emplace_back();
+	op& o = Ops.back();
+	o.Raw = code;
+	o.Origin = pc;
+	o.Target = NONE;
+	o.Skip = 0;
+	o.Data = data;
+	o.Pinned = false;
+	o.NoSwap = noswap;
+	o.Loc = loc;
+	o.Text = text;
+	if (!data)
+		o.I.decode(code);
+	if (target)
+		AddTarget(pc);
+}
+
+bool Optimizer::runs(passes pass)
+{	if (!(Passes & pass))
+		return false;
+	if (Relocatable)
+		return true;
+	for (const passEntry& e : passMap)
+		if (e.Pass == pass)
+			Note(NONE, e.Name, "Skipped because the code is not relocatable.");
+	return false;
+}
+
+void Optimizer::forEachBlock(void (Optimizer::*func)(block&))
+{	for (block& bl : Blocks)
+		if (!bl.Data)
+			(this->*func)(bl);
+}
+
+void Optimizer::Run()
+{	Count = Ops.size() - 2;
+	// Analyze instructions
+	unsigned pinned = 0; // remaining delay slots
+	for (unsigned i = 2; i < Ops.size(); ++i)
+	{	op& o = Ops[i];
+		unsigned pc = i - 2;
+		analyze(o);
+		if (o.Data)
+			continue;
+		if (pinned)
+		{	o.Pinned = true;
+			--pinned;
+		}
+		switch (o.I.Sig)
+		{case Inst::S_BRANCH:
+			o.Pinned = true;
+			pinned = 3;
+			AddTarget(pc + 4);
+			if (o.I.Reg == o.I.Rel)
+				// absolute target or computed relative jump
+				Relocatable = false;
+			else if (o.I.Rel)
+			{	int target = pc + 4 + o.I.Immd.iValue / (int)sizeof(uint64_t);
+				if ((o.I.Immd.iValue & (sizeof(uint64_t)-1)) || target < 0 || (unsigned)target > Count)
+					Relocatable = false;
+				else
+				{	o.Target = target;
+					AddTarget(target);
+				}
+			}
+			break;
+		 case Inst::S_THREND:
+		 case Inst::S_LDCEND:
+			AddTarget(pc + 3);
+		 case Inst::S_BREAK:
+		 case Inst::S_THRSW:
+		 case Inst::S_SBWAIT:
+		 case Inst::S_SBDONE:
+		 case Inst::S_LTHRSW:
+			o.Pinned = true;
+			pinned = max(pinned, 2U);
+		 default:;
+		}
+	}
+	buildBlocks();
+
+	if (Passes & O_BANK)
+		rebalanceBanks();
+
+	if (Passes & O_PEEPHOLE)
+		forEachBlock(&Optimizer::peephole);
+
+	if (runs(O_JUMP))
+		threadJumps();
+
+	if (runs(O_DEAD))
+		removeDeadCode();
+
+	if (runs(O_FLAGS))
+		simplifyFlags();
+
+	if (runs(O_HOIST))
+		hoistConstants();
+
+	if (runs(O_IFCONV))
+		convertBranches();
+
+	if (Pipelines.size() && runs(O_PIPELINE))
+		for (unsigned pc : Pipelines)
+			pipelineLoop(pc);
+
+	if (runs(O_TMU))
+	{	const unsigned limit = hasSignal(Inst::S_THRSW) || hasSignal(Inst::S_LTHRSW) ? TMU_FIFO / 2 : TMU_FIFO;
+		vector<unsigned> pending;
+		tmuPendingIn(pending, limit);
+		for (unsigned bi = 0; bi < Blocks.size(); ++bi)
+			if (!Blocks[bi].Data)
+				hoistTmuRequests(Blocks[bi], pending[bi], limit);
+	}
+
+	if (runs(O_SFU))
+		forEachBlock(&Optimizer::fillSfuLatency);
+
+	if (runs(O_SCHEDULE))
+		forEachBlock(&Optimizer::scheduleInstructions);
+
+	if (runs(O_CONST))
+	{	setupSmiSteps();
+		forEachBlock(&Optimizer::materializeConstants);
+	}
+
+	if (runs(O_PAIR))
+		forEachBlock(&Optimizer::pairInstructions);
+
+	// Thread switches pin the surrounding words, so insert them after the other passes moved the instructions.
+	if ((Passes & O_TMU) && Relocatable)
+		insertThreadSwitches();
+
+	if (runs(O_LAYOUT))
+		arrangeBlocks();
+
+	if (runs(O_DELAY))
+		forEachBlock(&Optimizer::fillDelaySlots);
+
+	layout();
+	Saved = Count - Size;
+	// Notes refer to ops so far, removed ops have no location.
+	vector<bool> placed(Ops.size());
+	for (const block& bl : Blocks)
+		for (const word& w : bl.Words)
+			for (unsigned o : w.Op)
+				if (o != NONE)
+					placed[o] = true;
+	for (note& n : Notes)
+		if (n.PC != NONE)
+			n.PC = placed[n.PC] ? FinalPC[n.PC] : NONE;
+}
+
+unsigned Optimizer::Relocate(unsigned pc) const
+{	auto sp = lower_bound(Starts.begin(), Starts.end(), make_pair(pc, 0U));
+	if (sp != Starts.end() && sp->first == pc)
+		return sp->second;
+	return pc < Count ? FinalPC[pc + 2] : Size + pc - Count;
+}
+
+void Optimizer::Store(vector<uint64_t>& code, DebugInfo::locations& lines, vector<string>* text) const
+{	code.clear();
+	code.reserve(Size);
+	lines.clear();
+	if (text)
+		text->clear();
+	for (const block& bl : Blocks)
+		for (const word& w : bl.Words)
+		{	const op& o = Ops[w.Op[0]];
+			code.push_back(o.Data || (w.Op[1] == NONE && o.Target == NONE) ? o.Raw : encode(w).encode());
+			lines.push_back(o.Loc);
+			if (text)
+				text->push_back(w.Op[1] == NONE ? o.Text : o.Text + "; " + Ops[w.Op[1]].Text);
+		}
+}
@@ -0,0 +1,596 @@
+/*
+ * Optimizer.h
+ *
+ *  Created on: 19.10.2026
+ *      Author: mueller
+ */
+
+#ifndef OPTIMIZER_H_
+#define OPTIMIZER_H_
+
+#include "Inst.h"
+#include "DebugInfo.h"
+#include "utils.h"
+
+#include <vector>
+#include <string>
+#include <unordered_map>
+#include <climits>
+
+using namespace std;
+
+
+/// @brief Optimization passes that work on the code after pass 2.
+/// @details The code is split into basic blocks of instruction words.
+/// Each word consists of one or two source instructions (ops) that can be moved independently.
+/// Only data dependencies and timing constraints known to the \ref Validator restrict the transformations.
+class Optimizer
+{public:
+	/// Optimization passes, bit vector
+	enum passes : unsigned
+	{	O_NONE     = 0x0000 ///< No optimization
+	,	O_PAIR     = 0x0001 ///< Merge independent single ALU instructions into dual issue words.
+	,	O_SCHEDULE = 0x0002 ///< Reorder instructions within basic blocks to hide latencies and remove nop.
+	,	O_DELAY    = 0x0004 ///< Fill branch delay slots.
+	,	O_PEEPHOLE = 0x0008 ///< Rewrite short instruction sequences, see \ref rules.
+	,	O_BANK     = 0x0010 ///< Move registers between regfile A and B to resolve read port conflicts.
+	,	O_CONST    = 0x0020 ///< Replace ldi by small immediate operations in free ALU slots.
+	,	O_HOIST    = 0x0040 ///< Move loop invariant ldi in front of loops.
+	,	O_IFCONV   = 0x0080 ///< Replace short forward branches by conditional execution.
+	,	O_PIPELINE = 0x0100 ///< Software pipelining of loops marked by .pipeline.
+	,	O_TMU      = 0x0200 ///< Issue TMU requests early and insert thread switches in front of ldtmu.
+	,	O_SFU      = 0x0400 ///< Issue SFU requests early and fill their latency with independent instructions.
+	,	O_LAYOUT   = 0x0800 ///< Reorder blocks to replace unconditional branches by fall through.
+	,	O_JUMP     = 0x1000 ///< Redirect branches to branches, remove branches to the next instruction and unreachable code.
+	,	O_DEAD     = 0x2000 ///< Remove writes to registers that are never read and code behind thrend.
+	,	O_FLAGS    = 0x4000 ///< Remove .setf if the flags do not change or are never read.
+	,	O_ALL      = 0x7fff ///< All of the above
+	};
+	CLASSFLAGSENUM(passes, unsigned);
+	/// Report about an applied optimization.
+	struct note
+	{	unsigned       PC;   ///< Instruction after optimization, UINT_MAX if the note does not refer to a single instruction.
+		DebugInfo::location Loc;///< Source of the affected instruction.
+		const char*    Pass; ///< Name of the optimization pass.
+		string         Text; ///< Message text.
+	};
+
+ public: // Input
+	/// Passes to run.
+	passes           Passes = O_NONE;
+	/// @brief All references to code addresses are known.
+	/// @details If false, only passes that keep all instructions at their location are executed.
+	bool             Relocatable = true;
+ public: // Result
+	/// Applied optimizations in order of execution.
+	vector<note>     Notes;
+	/// Number of instruction words saved.
+	unsigned         Saved = 0;
+
+ private: // types...
+	/// Entry of the pass name lookup table, POD, compatible with binary_search().
+	struct passEntry
+	{	char           Name[12]; ///< Name of the pass as used by ParsePasses.
+		passes         Pass;     ///< Pass flag.
+	};
+	/// Pass name lookup table, ordered by Name.
+	static const passEntry passMap[];
+	/// Resources accessed by an instruction, bit vector for usage::Misc.
+	enum resource : uint32_t
+	{	U_R0       = 0x000001 ///< Accumulator r0, r1 ... r5 = U_R0 << n
+	,	U_R4       = 0x000010 ///< Accumulator r4
+	,	U_R5       = 0x000020 ///< Accumulator r5
+	,	U_ACCU     = 0x00003f ///< Any accumulator
+	,	U_FLAGS    = 0x000040 ///< Condition flags
+	,	U_IO       = 0x000080 ///< Any peripheral access with side effects, keeps the order of these instructions.
+	,	U_SFU      = 0x000100 ///< SFU request (write only)
+	,	U_UNIF     = 0x000200 ///< Uniform read
+	,	U_UNIFADDR = 0x000400 ///< unif_addr write
+	,	U_NOSWAP   = 0x000800 ///< tmu_noswap write
+	,	U_TMU      = 0x001000 ///< TMU request (write only)
+	,	U_TLBZ     = 0x002000 ///< tlbz write
+	,	U_MSFLAGS  = 0x004000 ///< ms_flags read
+	,	U_VPMSETUP = 0x008000 ///< VPM or VDW setup or DMA address write
+	,	U_VPM      = 0x010000 ///< VPM access
+	,	U_LDR4     = 0x020000 ///< Load signal that writes to r4
+	,	U_ROT0     = 0x040000 ///< Vector rotation of accumulator r0, r1 ... r5 = U_ROT0 << n, r5 means rotation by r5.
+	,	U_ROT      = 0xfc0000 ///< Any vector rotation
+	,	U_ALL      = 0xffffff ///< Everything
+	};
+	/// Register and resource usage of an instruction.
+	struct usage
+	{	uint64_t       Regs; ///< Register file A (bit 0..31) and B (bit 32..63)
+		uint32_t       Misc; ///< Other resources, see \ref resource.
+		usage() : Regs(0), Misc(0) {}
+		usage(uint64_t regs, uint32_t misc) : Regs(regs), Misc(misc) {}
+		/// Check for common resources
+		bool           intersects(const usage& r) const { return (Regs & r.Regs) || (Misc & r.Misc); }
+		usage&         operator|=(const usage& r) { Regs |= r.Regs; Misc |= r.Misc; return *this; }
+	};
+	/// Timing constraints between instructions, see hazards().
+	enum hazard : uint8_t
+	{	H_REGFILE  = 0x01 ///< Register file read immediately after write
+	,	H_SFU      = 0x02 ///< r4 or SFU access within two instructions after an SFU request
+	,	H_UNIF     = 0x04 ///< Uniform read within two instructions after unif_addr write
+	,	H_NOSWAP   = 0x08 ///< TMU request within three instructions after tmu_noswap write
+	,	H_TLBZ     = 0x10 ///< ms_flags read within two instructions after tlbz write
+	,	H_ROT      = 0x20 ///< Vector rotation of an accumulator immediately after write
+	,	H_VPM      = 0x40 ///< VPM access within three instructions after VPM setup
+	};
+	/// Maximum distance of instructions where timing constraints apply.
+	enum { MAX_DEPEND = 3 };
+	/// Estimated distance of a TMU request and the matching ldtmu without stall, used as scheduling priority only.
+	enum { TMU_LATENCY = 9 };
+	/// Number of TMU requests that can be pending per QPU, half of it in multithreaded programs.
+	enum { TMU_FIFO = 8 };
+	/// Maximum number of instruction words skipped by a branch that is replaced by conditional execution.
+	enum { MAX_IFCONV = 4 };
+	/// Op index of a missing op.
+	enum : unsigned { NONE = UINT_MAX };
+	/// Op index of the pseudo instruction in front of each block, that writes to everything.
+	enum : unsigned { TAIL = 0 };
+	/// Op index of the pseudo instruction after each block, that reads everything.
+	enum : unsigned { HEAD = 1 };
+	/// Source instruction, might be merged with another one into one instruction word.
+	struct op
+	{	Inst           I;    ///< Instruction, invalid for data.
+		uint64_t       Raw;  ///< Original instruction word or data.
+		usage          Rd;   ///< Read access, see analyze().
+		usage          Wr;   ///< Write access, see analyze().
+		unsigned       Origin;///< PC before optimization.
+		unsigned       Target;///< PC before optimization of the target of relative branches, NONE otherwise.
+		unsigned       Skip; ///< Number of words to skip at Target because they are duplicated into the branch delay slots.
+		bool           Data; ///< Data rather than an instruction.
+		bool           Pinned;///< Must not be moved or modified, e.g. branch and branch delay slots.
+		bool           NoSwap;///< Must not swap the ALU, e.g. because of vector rotation.
+		DebugInfo::location Loc;///< Source code location
+		string         Text; ///< Source code
+	};
+	/// Instruction word, i.e. one or two ops.
+	struct word
+	{	unsigned       Op[2];///< Index into Ops, Op[1] is NONE for words with a single op.
+		word(unsigned op) { Op[0] = op; Op[1] = NONE; }
+		unsigned       size() const { return 1 + (Op[1] != NONE); }
+	};
+	/// Basic block
+	struct block
+	{	unsigned       Origin;///< PC of the first word before optimization.
+		bool           Data; ///< The block contains data rather than code.
+		vector<word>   Words;///< Instruction words.
+		unsigned       Start;///< PC of the first word after optimization, valid after layout().
+		block(unsigned origin, bool data) : Origin(origin), Data(data), Start(0) {}
+	};
+	/// Timing violations of the original code, key: makeKey(), value: minimum distance.
+	typedef unordered_map<uint64_t,unsigned> violations_t;
+	/// Peephole rule
+	struct rule
+	{	char           Name[12];///< Name of the rule in the report.
+		const char*    Text; ///< Description of the change in the report.
+		bool           Removes;///< The rule removes instructions and requires relocatable code.
+		/// @brief Apply the rule to an instruction word.
+		/// @param words Words of the current block.
+		/// @param w Index of the word in \a words.
+		/// @return Affected op or NONE if the rule does not match.
+		unsigned       (Optimizer::*Apply)(vector<word>& words, unsigned w);
+	};
+	/// Peephole rules in order of execution.
+	static const rule rules[];
+	/// Successor of a block that ends with branch delay slots.
+	struct path
+	{	const block*   Block;///< Successor block, NULL if unknown.
+		unsigned       Skip; ///< Number of words skipped at the start of Block by the original code.
+		unsigned       NewSkip;///< Number of words skipped at the start of Block by the modified code.
+	};
+	/// Operands of a \ref step other than the accumulators r0..r3.
+	enum : uint8_t
+	{	SRC_SMI    = 4 ///< Small immediate value
+	,	SRC_TARGET = 5 ///< Target register, i.e. the result of the previous step
+	};
+	/// ALU operation that contributes to a constant, see synthesize().
+	struct step
+	{	bool           Mul;  ///< MUL ALU operation, ADD ALU otherwise.
+		uint8_t        Op;   ///< Inst::opadd or Inst::opmul
+		uint8_t        A;    ///< First operand, accumulator number or SRC_...
+		uint8_t        B;    ///< Second operand, accumulator number or SRC_...
+		uint8_t        SImmd;///< Small immediate value for SRC_SMI.
+		Inst::pack     Pack; ///< Regfile A pack mode
+	};
+	/// Sequence of ALU operations that computes a constant.
+	typedef vector<step> recipe;
+
+ private: // working set
+	/// All instructions and data words, the index is PC before optimization + 2.
+	/// The first two entries are the pseudo instructions TAIL and HEAD.
+	/// Copies of ops created by passes follow after the last instruction word.
+	vector<op>       Ops;
+	/// Number of instruction words before optimization.
+	unsigned         Count = 0;
+	/// Additional block starts, e.g. labels. Index: PC before optimization.
+	vector<bool>     Targets;
+	/// Instructions that can be invoked from outside, e.g. exported labels. PC before optimization.
+	vector<unsigned> Entries;
+	/// Start of loops marked for software pipelining. PC before optimization.
+	vector<unsigned> Pipelines;
+	/// Code in basic blocks in order of the resulting code.
+	vector<block>    Blocks;
+	/// Timing violations of the currently optimized block before the pass started.
+	violations_t     Violations;
+	/// Final PC of each op, valid after layout(). Index: same as Ops.
+	vector<unsigned> FinalPC;
+	/// Origin and final PC of each block ordered by origin, valid after layout().
+	vector<pair<unsigned,unsigned>> Starts;
+	/// Number of instruction words after layout().
+	unsigned         Size = 0;
+	/// Single ALU operations with a small immediate value by their result, at most one per ALU.
+	unordered_map<uint32_t,vector<step>> SmiSteps;
+
+ private:
+	/// Add a note to the optimization report.
+	/// @param op Affected op.
+	/// @param pass Pass name.
+	/// @param fmt printf like format string.
+	void             Note(unsigned op, const char* pass, const char* fmt, ...) PRINTFATTR(4);
+	/// Calculate op::Rd and op::Wr.
+	static void      analyze(op& o);
+	/// Check whether the order of two instructions must not be changed.
+	/// @param first The instruction that comes first.
+	/// @param second The instruction that comes later.
+	/// @return true: any read after write, write after read or write after write dependency.
+	static bool      depends(const op& first, const op& second) { return first.Wr.intersects(second.Rd) || first.Rd.intersects(second.Wr) || first.Wr.intersects(second.Wr); }
+	/// @brief Check whether two instructions can be executed within one instruction word.
+	/// @details Reading a register that is written by the same instruction word returns the old value,
+	/// so only write after read is allowed.
+	/// @param first The instruction that comes first.
+	/// @param second The instruction that comes later.
+	static bool      canShare(const op& first, const op& second) { return !first.Wr.intersects(second.Rd) && !first.Wr.intersects(second.Wr) && !(first.Rd.Misc & second.Rd.Misc & U_IO); }
+	/// Timing constraints violated by two instructions.
+	/// @param e The instruction that comes first.
+	/// @param l The instruction that comes later.
+	/// @param dist Distance in instruction words, at least 1.
+	/// @return Violated constraints, see \ref hazard.
+	static unsigned  hazards(const op& e, const op& l, unsigned dist);
+	/// Key for \ref Violations.
+	static uint64_t  makeKey(unsigned e, unsigned l, unsigned h) { return (uint64_t)e << 36 | (uint64_t)l << 8 | h; }
+	/// Op index that identifies an op in \ref Violations, copies of an op share the index of the original.
+	unsigned         original(unsigned op) const { return op < 2 ? op : Ops[op].Origin + 2; }
+	/// Check whether an ALU instruction reads from an input mux.
+	static bool      readsMux(const Inst& i, Inst::mux m);
+	/// Check whether an ALU instruction writes to the A side of the register files.
+	/// @param i Instruction to check.
+	/// @param ws Effective write swap flag of the instruction word.
+	static bool      writesA(const Inst& i, bool ws) { return (i.isADD() && i.WAddrA != Inst::R_NOP && !ws) || (i.isMUL() && i.WAddrM != Inst::R_NOP && ws); }
+	/// @brief Check whether an instruction is a plain move, i.e. a single unconditional \c mov without flags, pack, unpack or signal.
+	/// @param i Instruction to check.
+	/// @param src [out] Source of the move.
+	/// @param dst [out] Destination register, register file or r0 to r3.
+	/// @return true: plain move.
+	static bool      isMove(const Inst& i, Inst::mux& src, usage& dst);
+	/// Registers read by an input mux, empty for small immediates.
+	static usage     muxUsage(const Inst& i, Inst::mux m);
+	/// Check whether two instructions read the same invariant value from their input mux.
+	static bool      sameSource(const Inst& a, const Inst& b, Inst::mux m);
+	/// Check whether an instruction can be part of a dual issue word, i.e. it uses at most one ALU and no ldi or branch.
+	static bool      isPairable(const Inst& i) { return i.isALU() && !(i.isADD() && i.isMUL()) && (i.isADD() || i.isMUL() || i.Sig != Inst::S_NONE); }
+	/// @brief Merge two instructions that use different ALUs without swapping.
+	/// @return true: succeeded.
+	static bool      merge(const Inst& a, const Inst& b, Inst& result);
+	/// @brief Combine two ALU instructions into one instruction word.
+	/// @details The function swaps ALUs if required and checks for any conflict
+	/// of signals, register file read ports, pack modes and write swap.
+	/// @param a [in,out] First instruction, might be changed by a swap of the ALU.
+	/// @param b [in,out] Second instruction, might be changed by a swap of the ALU.
+	/// @param result [out] Merged instruction word.
+	/// @param noswap Swapping the ALU is not allowed, bit 0: \a a, bit 1: \a b.
+	/// @return true: succeeded.
+	static bool      combine(Inst& a, Inst& b, Inst& result, unsigned noswap);
+	/// Build the instruction word from its ops.
+	Inst             encode(const word& w) const;
+	/// Check whether a word is a plain nop without any effect.
+	bool             isNop(const word& w) const { const op& o = Ops[w.Op[0]]; return w.Op[1] == NONE && !o.Data && o.I.Sig == Inst::S_NONE && !o.I.isADD() && !o.I.isMUL() && !o.Rd.Regs && !o.Rd.Misc && !o.Wr.Regs && !o.Wr.Misc; }
+	/// @brief Minimum distance of two dependent instructions for the scheduler.
+	/// @return Distance without timing violation, or TMU_LATENCY from a TMU request to a load.
+	static unsigned  latency(const op& e, const op& l);
+	/// Estimated number of cycles the words in the range [from,to) wait for the result of a previous word in the range.
+	unsigned         stalls(const vector<word>& words, unsigned from, unsigned to) const;
+	/// Check whether any op of a word reads from a resource.
+	bool             reads(const word& w, const usage& u) const { return Ops[w.Op[0]].Rd.intersects(u) || (w.Op[1] != NONE && Ops[w.Op[1]].Rd.intersects(u)); }
+	/// Check whether any op of a word writes to a resource.
+	bool             writes(const word& w, const usage& u) const { return Ops[w.Op[0]].Wr.intersects(u) || (w.Op[1] != NONE && Ops[w.Op[1]].Wr.intersects(u)); }
+	/// Remove an op from its word.
+	/// @return true: the word has been removed.
+	bool             removeOp(vector<word>& words, unsigned w, unsigned op);
+	/// Check whether a word must not be changed.
+	bool             isPinned(const word& w) const { return Ops[w.Op[0]].Pinned || Ops[w.Op[0]].Data; }
+	/// @brief Collect the timing violations of a block.
+	/// @details The block is enclosed by the pseudo instructions TAIL and HEAD.
+	/// @param words Instruction words of the block.
+	/// @param from First word index to check.
+	/// @param to Last word index to check.
+	/// @param func Receives each violation as key (see makeKey()) and distance.
+	/// @return false: func returned false.
+	template <typename F>
+	bool             forEachViolation(const vector<word>& words, int from, int to, F func) const;
+	/// Store the timing violations of a block into \ref Violations.
+	void             setupTiming(const vector<word>& words);
+	/// Check whether a timing violation already existed at least as close in the original code.
+	bool             isAllowed(uint64_t key, unsigned dist) const { auto vp = Violations.find(key); return vp != Violations.end() && vp->second <= dist; }
+	/// Check that the words in the range [from,to] do not violate timing constraints more than the original code.
+	bool             checkTiming(const vector<word>& words, int from, int to) const;
+	/// Split the code into basic blocks.
+	void             buildBlocks();
+	/// @brief Find a block by its PC before optimization, NULL if none.
+	/// @details Blocks are ordered by their origin unless arrangeBlocks() moved them.
+	const block*     findBlock(unsigned origin) const;
+	/// Check the timing of a modified block that ends with branch delay slots on all paths to its successors.
+	/// @param orig Original words of the block.
+	/// @param words Modified words of the block.
+	/// @param paths Successors of the block.
+	/// @return true: no additional timing violation.
+	bool             checkPaths(const vector<word>& orig, const vector<word>& words, const vector<path>& paths);
+	/// Calculate the final PC of all blocks and ops.
+	void             layout();
+
+	// passes
+	/// @brief Registers that must stay in their register file.
+	/// @details These are registers accessed by branches or regfile A pack and unpack modes
+	/// and registers that are live at the program start or at an entry point.
+	/// @return Register file A (bit 0..31) and B (bit 32..63)
+	uint64_t         fixedRegs() const;
+	/// @brief Move a register to the other register file in a single instruction.
+	/// @details Read ports and the write swap flag are adjusted.
+	/// @param i Instruction to change.
+	/// @param from Register to replace, register file A: 0..31, B: 32..63.
+	/// @param to New register, must be in the other register file.
+	/// @return false: the instruction cannot be encoded with the new register, \a i might be modified anyway.
+	static bool      moveReg(Inst& i, unsigned from, unsigned to);
+	/// Number of adjacent single instruction words that cannot be paired because they read different registers of the same register file.
+	unsigned         portConflicts() const;
+	/// @brief Rename registers of one register file to unused registers of the other file
+	/// as long as this reduces the number of portConflicts().
+	void             rebalanceBanks();
+	/// Merge independent single ALU instructions into dual issue words.
+	void             pairInstructions(block& b);
+	/// Apply \ref rules to each word that is not pinned until nothing changes.
+	void             peephole(block& b);
+	/// Peephole rule: remove moves of a register to itself.
+	unsigned         ruleSelfMove(vector<word>& words, unsigned w);
+	/// Peephole rule: remove moves that assign the value that the register already has.
+	unsigned         ruleDupMove(vector<word>& words, unsigned w);
+	/// Peephole rule: read the source accumulator of a move instead of its register file destination.
+	unsigned         ruleForward(vector<word>& words, unsigned w);
+	/// Peephole rule: replace a move of a value loaded by ldi by the ldi itself.
+	unsigned         ruleLdiMove(vector<word>& words, unsigned w);
+	/// Peephole rule: remove writes to registers that are overwritten before they are read.
+	unsigned         ruleDeadWrite(vector<word>& words, unsigned w);
+	/// @brief Calculate the result of a step.
+	/// @details Floating point operations are only emulated for normal numbers and zero.
+	/// @param s Step to evaluate.
+	/// @param acc Values of the accumulators r0..r3.
+	/// @param target Value of the target register for SRC_TARGET.
+	/// @param result [out] Value of the target register after the step.
+	/// @return false: the result is not known exactly or does not replace all bits of the target.
+	static bool      evalStep(const step& s, const qpuValue* acc, qpuValue target, qpuValue& result);
+	/// Create the instruction of a step that writes to the target of an ldi instruction.
+	/// @return false: the step cannot be encoded for this target.
+	static bool      makeStep(const step& s, const Inst& ldi, Inst& result);
+	/// Initialize \ref SmiSteps.
+	void             setupSmiSteps();
+	/// @brief Known values of the accumulators r0..r3 in front of a word.
+	/// @details Only values loaded by ldi or small immediate operations within the block are known.
+	/// @param acc [out] Accumulator values.
+	/// @return Known accumulators, bit n: rn.
+	unsigned         knownAccus(const vector<word>& words, unsigned w, qpuValue* acc) const;
+	/// @brief Search for ALU operations that compute a constant.
+	/// @param value Constant to compute.
+	/// @param acc Values of the accumulators r0..r3.
+	/// @param known Known accumulators, bit n: rn.
+	/// @param twoSteps Allow recipes that store an intermediate result in the target register.
+	/// @param result [out] Recipes in order of the number of steps.
+	void             synthesize(qpuValue value, const qpuValue* acc, unsigned known, bool twoSteps, vector<recipe>& result) const;
+	/// @brief Move a single op word into a free ALU slot of another word of the block.
+	/// @details The op is merged into a previous word or the op of a following word is merged into it.
+	/// @return true: succeeded, the number of words decreased by one.
+	bool             absorb(vector<word>& words, unsigned w);
+	/// @brief Replace an ldi by the steps of a recipe.
+	/// @details The cost of a recipe is the number of steps that do not fit into a free ALU slot.
+	/// The recipe is only applied if the cost is zero, i.e. the ldi word is saved.
+	/// @return true: succeeded.
+	bool             placeRecipe(vector<word>& words, unsigned w, const recipe& rc);
+	/// Replace ldi instructions by small immediate operations that fit into free ALU slots.
+	void             materializeConstants(block& b);
+	/// @brief Move an ldi of a loop into the preheader, i.e. the block in front of the loop.
+	/// @details If the target register is written elsewhere in the loop, the reads of the constant
+	/// use an unused register of the same register file instead.
+	/// @param first First block of the loop.
+	/// @param last Last block of the loop.
+	/// @param bi Block of the ldi.
+	/// @param k Word index of the ldi.
+	/// @param used [in,out] Registers used anywhere in the program.
+	/// @return true: succeeded.
+	bool             hoistLdi(unsigned first, unsigned last, unsigned bi, unsigned k, uint64_t& used);
+	/// @brief Move loop invariant ldi instructions in front of loops.
+	/// @details Loops are identified by backward branches. Only loops without other entries than the preceding block are changed.
+	void             hoistConstants();
+	/// @brief Update the registers that have the same value in all SIMD elements by an instruction word.
+	/// @param w Instruction word.
+	/// @param uni [in,out] Uniform registers, accumulators r0..r3 and U_FLAGS for uniform condition flags.
+	void             uniformWord(const word& w, usage& uni) const;
+	/// @brief Get the successors of each block in the control flow.
+	/// @param succ [out] Block indices of the successors per block.
+	/// @param exits [out] Optional, blocks with a branch to an unknown target or behind the end of the code.
+	/// If present unknown targets are no error.
+	/// @return false: a branch target is unknown, e.g. because of a branch to a register.
+	bool             blockSuccessors(vector<vector<unsigned>>& succ, vector<bool>* exits = NULL) const;
+	/// @brief Registers and condition flags that have the same value in all SIMD elements at the start of each block.
+	/// @details Forward data flow analysis over all blocks.
+	/// Only values computed from constants, small immediates and uniforms are known.
+	/// @param in [out] Uniform registers per block, see uniformWord().
+	void             uniformity(vector<usage>& in) const;
+	/// @brief Replace a forward branch at the end of a block by conditional execution of the skipped words.
+	/// @details The branch condition must not depend on the SIMD element, i.e. the flags are uniform,
+	/// or all skipped writes must already be conditional on the complement of an \c all branch condition.
+	/// @param bi Block with the branch.
+	/// @param uni Uniform registers at the start of the block.
+	/// @return true: succeeded, the skipped blocks are merged into block \a bi.
+	bool             predicate(unsigned bi, usage uni);
+	/// Replace short forward branches by conditional execution.
+	void             convertBranches();
+	/// @brief Software pipelining of a loop that consists of a single block.
+	/// @details The words up to the last TMU request in front of the first \c ldtmu and the instruction
+	/// that sets the flags of the loop condition are executed one iteration ahead.
+	/// A prologue executes them for the first iteration, an epilogue the remaining words of the last iteration.
+	/// This places the TMU requests of the next iteration after the processing of the current one.
+	/// @param pc PC before optimization of the first instruction of the loop.
+	/// @return true: succeeded.
+	bool             pipelineLoop(unsigned pc);
+	/// Check whether the program contains a signal.
+	bool             hasSignal(Inst::sig s) const;
+	/// Number of TMU requests issued by a word, i.e. writes to \c tmu0_s or \c tmu1_s.
+	unsigned         tmuRequests(const word& w) const;
+	/// Check whether a word loads the result of a TMU request.
+	bool             isTmuLoad(const word& w) const { const op& o = Ops[w.Op[0]]; return !o.Data && (o.I.Sig == Inst::S_LDTMU0 || o.I.Sig == Inst::S_LDTMU1); }
+	/// Check whether the only peripheral access of an instruction is a TMU request or ldtmu.
+	static bool      isTmuOnly(const op& o);
+	/// Number of TMU requests pending after a word.
+	/// @param w Instruction word.
+	/// @param pending TMU requests pending in front of \a w.
+	/// @param limit Maximum result.
+	unsigned         tmuPending(const word& w, unsigned pending, unsigned limit) const { pending -= min(pending, (unsigned)isTmuLoad(w)); return min(pending + tmuRequests(w), limit); }
+	/// @brief Maximum number of TMU requests pending at the start of each block.
+	/// @details Forward data flow analysis over all blocks. The result is \a limit for all blocks if the control flow is unknown.
+	/// @param in [out] Pending requests per block.
+	/// @param limit Maximum number of pending requests.
+	void             tmuPendingIn(vector<unsigned>& in, unsigned limit) const;
+	/// @brief Move words with TMU requests to the earliest location within the block.
+	/// @details A request may move in front of the ldtmu of a previous request as long as no more than
+	/// \a limit requests are pending.
+	/// @param bl Block to optimize.
+	/// @param pending TMU requests pending at the start of the block.
+	/// @param limit Maximum number of pending requests.
+	void             hoistTmuRequests(block& bl, unsigned pending, unsigned limit);
+	/// @brief Add \c thrsw signals three words in front of ldtmu that follow their TMU request closely.
+	/// @details Only programs that already use \c thrsw and no \c lthrsw are changed.
+	/// No accumulator or flag must be live at the thread switch because they are not preserved.
+	void             insertThreadSwitches();
+	/// @brief Hide the latency of SFU requests.
+	/// @details SFU requests move up within the block right behind the use of the previous result.
+	/// nop words in the two words after a request are removed or replaced by independent words from later in the block.
+	void             fillSfuLatency(block& bl);
+	/// @brief Check whether the execution continues at the next block after the end of a block.
+	/// @details Calls continue at the next block as well because the return address depends on the location.
+	bool             fallsThrough(const block& bl) const;
+	/// @brief Remove the branch at the end of a block, the delay slots become ordinary words.
+	/// @details nop in the delay slots are removed as long as the timing allows.
+	/// @param bl Block that ends with the branch and its delay slots.
+	/// @param next Block that is executed after \a bl once the branch is removed.
+	/// @return false: not possible because of timing constraints or signals.
+	bool             removeBranch(block& bl, const block& next);
+	/// @brief Remove unconditional branches by moving the target behind the branch.
+	/// @details The target block and all blocks it falls through to are moved as a whole,
+	/// so only blocks that are not entered by fall through can move. nop in the delay slots are removed.
+	void             arrangeBlocks();
+	/// @brief Blocks that can be reached from the program start, exported labels or return addresses.
+	/// @param reached [out] Flag per block, true for all blocks if a branch target is unknown.
+	void             reachable(vector<bool>& reached) const;
+	/// @brief Simplify the control flow.
+	/// @details Branches to unconditional branches or branches with the same condition are redirected
+	/// to the final target, branches to the next instruction are removed.
+	/// Blocks that are no longer reached afterwards are removed.
+	void             threadJumps();
+	/// @brief Registers, accumulators and flags that are live at the end of each block.
+	/// @details Backward data flow analysis over all blocks.
+	/// Nothing is live behind thrend. Everything is live at the end of the code, in front of data
+	/// and at unknown branch targets, e.g. the return of a subroutine.
+	/// @param out [out] Live resources per block.
+	void             liveness(vector<usage>& out) const;
+	/// Turn ALUs that neither write to a register nor set the flags into nop.
+	static void      freeUnused(Inst& i);
+	/// @brief Replace the instruction of an op that lost some of its effects.
+	/// @details An instruction without any remaining effect is removed if the timing allows, otherwise it becomes a nop.
+	/// @param words Words of the current block, the timing must be set up by setupTiming().
+	/// @param w Index of the word in \a words.
+	/// @param o Op to change.
+	/// @param i New instruction.
+	/// @return 0: the op has been changed, 1: the op has been removed, 2: the word has been removed.
+	unsigned         replaceOp(vector<word>& words, unsigned w, unsigned o, const Inst& i);
+	/// @brief Remove writes to registers and accumulators other than r4 that are not live afterwards.
+	/// @details The ALU of a dead write becomes a nop unless it sets the flags.
+	/// Instructions without any remaining effect are removed.
+	/// @param bl Block to optimize.
+	/// @param live Resources live at the end of the block.
+	/// @return true: something changed.
+	bool             removeDeadWrites(block& bl, usage live);
+	/// @brief Remove unreachable blocks behind thrend and dead writes until nothing changes.
+	void             removeDeadCode();
+	/// Registers read by the ALU that sets the flags of an instruction.
+	static usage     flagInputs(const Inst& i);
+	/// @brief Check whether two instructions set the flags by the same unconditional operation on the same operands.
+	/// @details The operands are only compared, not checked for changes in between.
+	static bool      sameFlags(const Inst& a, const Inst& b);
+	/// @brief Remove unnecessary .setf from a block.
+	/// @details \c .setf is removed if the previous flags came from the same operation on the same operands
+	/// that did not change in between or if the flags are not live afterwards.
+	/// The ALU becomes a nop if it has no target, instructions without remaining effect are removed.
+	/// @param bl Block to optimize.
+	/// @param live Resources live at the end of the block.
+	/// @return true: something changed.
+	bool             removeRedundantFlags(block& bl, usage live);
+	/// Remove unnecessary .setf from all blocks until nothing changes.
+	void             simplifyFlags();
+	/// Reorder the instructions of each sequence of words that are not pinned.
+	void             scheduleInstructions(block& b);
+	/// @brief List scheduler for the words in the range [from,to).
+	/// @details Words are placed in order of their critical path length as long as they add no timing violation.
+	/// nop words are only used if no other word fits.
+	/// @return Number of words in the range after scheduling.
+	unsigned         scheduleRange(vector<word>& words, unsigned from, unsigned to);
+	/// @brief Replace nop in branch delay slots.
+	/// @details Independent instructions in front of the branch are moved into the delay slots.
+	/// Remaining slots of unconditional branches take a copy of the first words at the branch target.
+	void             fillDelaySlots(block& b);
+	/// @brief Check whether a pass is selected and can run.
+	/// @details The passes that use this function change the code size, so they are skipped
+	/// with a note unless the code is relocatable.
+	bool             runs(passes pass);
+	/// Apply a pass to each block of code.
+	void             forEachBlock(void (Optimizer::*func)(block&));
+
+ public:
+	                 Optimizer();
+	/// @brief Parse a comma separated list of pass names, e.g. \c pair.
+	/// @details \c all selects all passes, a leading \c - removes a pass.
+	/// @exception std::string Unknown pass name.
+	static passes    ParsePasses(const char* list);
+	/// Append the next instruction word.
+	/// @param code Instruction word or data.
+	/// @param data This is data rather than an instruction.
+	/// @param target The instruction is a branch target, i.e. it starts a basic block.
+	/// @param noswap Do not swap the ALUs of this instruction.
+	/// @param loc Source code location.
+	/// @param text Source code.
+	void             Append(uint64_t code, bool data, bool target, bool noswap, const DebugInfo::location& loc, const string& text);
+	/// @brief Mark an instruction as referenced from outside, e.g. by a label.
+	/// @param pc PC before optimization.
+	void             AddTarget(unsigned pc);
+	/// @brief Mark an instruction as entry point that can be invoked from outside, e.g. by an exported label.
+	/// @details Registers live at entry points are not moved to the other register file.
+	/// @param pc PC before optimization.
+	void             AddEntry(unsigned pc) { Entries.push_back(pc); }
+	/// @brief Mark the start of a loop for software pipelining, see \c .pipeline.
+	/// @param pc PC before optimization.
+	void             AddPipeline(unsigned pc) { Pipelines.push_back(pc); }
+	/// Execute the selected passes.
+	void             Run();
+	/// @brief Translate a code location.
+	/// @details Block starts, e.g. labels, refer to the first word of the block even if its instruction moved.
+	/// @param pc PC before optimization.
+	/// @return PC after optimization.
+	unsigned         Relocate(unsigned pc) const;
+	/// Write the optimized code.
+	/// @param code [out] Instruction words.
+	/// @param lines [out] Source location of each instruction.
+	/// @param text [out] Source code of each instruction, optional.
+	void             Store(vector<uint64_t>& code, DebugInfo::locations& lines, vector<string>* text) const;
+};
+
+#endif // OPTIMIZER_H_
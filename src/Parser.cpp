@@ -16,6 +16,7 @@
 #include <cfloat>
 #include <cmath>
 #include <algorithm>
+#include <chrono>
 #include <cctype>
 #include <sys/stat.h>
 #include <inttypes.h>
@@ -95,7 +96,7 @@ static const char msgpfx[][10]
 
 void Parser::CaughtMsg(const char* msg)
 {	Success = false;
-	if (OperationMode == IRGNOREERRORS && !Pass2)
+	if ((OperationMode == IRGNOREERRORS && !Pass2) || VRegState == VR_RECORD)
 		return;
 	fputs(msgpfx[ERROR], stderr);
 	fputs(msg, stderr);
@@ -103,7 +104,9 @@ void Parser::CaughtMsg(const char* msg)
 }
 
 void Parser::Msg(severity level, const char* fmt, ...)
-{	if (Verbose < level)
+{	// A cached macro invocation would not repeat the message.
+	taintExpansions();
+	if (Verbose < level || VRegState == VR_RECORD)
 		return;
 	switch (OperationMode)
 	{case NORMAL:
@@ -123,36 +126,224 @@ void Parser::Msg(severity level, const char* fmt, ...)
 	fputc('\n', stderr);
 }
 
+void Parser::taintExpansions(size_t depth)
+{	for (auto r : Recordings)
+		if (r->Base > depth)
+			r->Tainted = true;
+}
+
+const Parser::constDef* Parser::findConst(const string& name)
+{	const constDef* ret = NULL;
+	size_t depth = 0;
+	for (auto i = Context.end(); i != Context.begin(); )
+	{	++Stats.Lookups;
+		auto c = (*--i)->Consts.find(name);
+		if (c != (*i)->Consts.end())
+		{	ret = &c->second;
+			depth = i - Context.begin();
+			break;
+		}
+	}
+	// Record dependency for all macro invocations outside the context where the name resolved.
+	for (auto r = Recordings.rbegin(); r != Recordings.rend() && (*r)->Base > depth; ++r)
+	{	auto& deps = (*r)->Deps;
+		if (!(*r)->Tainted && find_if(deps.begin(), deps.end(), [&name](const constDep& d) { return d.Name == name; }) == deps.end())
+			deps.emplace_back(name, ret ? &ret->Value : NULL);
+	}
+	return ret;
+}
+
 void Parser::FlagsSize(size_t min)
-{	if (InstFlags.size() < min)
-		InstFlags.resize(min, IF_NONE);
+{	if (InstFlags.size() < min - Flushed)
+		InstFlags.resize(min - Flushed, IF_NONE);
 }
 
 void Parser::StoreInstruction(uint64_t inst)
 {
-	if (!Pass2)
+	if (PC + Back - Flushed >= Instructions.size())
 		Instructions.emplace_back();
-	LineNumbers.emplace_back();
-	uint64_t* ptr = &Instructions[PC+Back];
+	uint64_t* ptr = &Instructions[PC + Back - Flushed];
 	uint64_t* ip  = ptr - Back;
-	instFlags* fp = &InstFlags[PC+Back];
-	location* lp  = &LineNumbers[PC+Back];
+	instFlags* fp = &InstFlags[PC + Back - Flushed];
 	while (ptr != ip)
 	{	*ptr = ptr[-1];
 		*fp  = fp[-1];
-		*lp  = lp[-1];
 		--ptr;
 		--fp;
-		--lp;
 	}
 	*ptr = inst;
 	*fp = Flags;
-	*lp  = *Context.back();
+	LineNumbers.insert(PC, *Context.back());
+	if (RecordUsage)
+	{	auto& code = Allocator.Code;
+		if (code.size() <= PC + Back)
+			code.resize(PC + Back + 1);
+		for (unsigned pc = PC + Back; pc != PC; --pc)
+			code[pc] = move(code[pc-1]);
+		recordUsage(PC);
+	}
+}
+
+void Parser::recordUsage(unsigned pc)
+{	if (Allocator.Code.size() <= pc)
+		Allocator.Code.resize(pc + 1);
+	auto& usage = Allocator.Code[pc] = Usage;
+	usage.Entry = (InstFlags[pc] & IF_BRANCH_TARGET) != 0;
+}
+
+void Parser::restoreUsage(unsigned pc)
+{	if (RecordUsage)
+		Usage = pc < Allocator.Code.size() ? Allocator.Code[pc] : RegAlloc::inst();
+}
+
+void Parser::saveCode(expansion& e, unsigned start, size_t lines)
+{
+	e.Code.assign(Instructions.begin() + (start - Flushed), Instructions.begin() + (PC - Flushed));
+	e.CodeFlags.assign(InstFlags.begin() + (start - Flushed), InstFlags.begin() + (PC - Flushed));
+	e.Lines.clear();
+	e.Lines.reserve(PC - start);
+	for (unsigned pc = start; pc != PC; ++pc)
+		e.Lines.push_back(LineNumbers[pc]);
+	e.Text.assign(LineForInstruction.begin() + lines, LineForInstruction.end());
+	if (RecordUsage)
+	{	Allocator.Code.resize(max<size_t>(Allocator.Code.size(), PC));
+		e.Usage.assign(Allocator.Code.begin() + start, Allocator.Code.begin() + PC);
+	}
+}
+
+void Parser::storeCode(const expansion& e)
+{
+	unsigned end = PC + e.Code.size();
+	if (Instructions.size() < end - Flushed)
+		Instructions.resize(end - Flushed);
+	FlagsSize(end);
+	copy(e.Code.begin(), e.Code.end(), Instructions.begin() + (PC - Flushed));
+	copy(e.CodeFlags.begin(), e.CodeFlags.end(), InstFlags.begin() + (PC - Flushed));
+	for (const location& loc : e.Lines)
+		LineNumbers.push_back(loc);
+	LineForInstruction.insert(LineForInstruction.end(), e.Text.begin(), e.Text.end());
+	if (RecordUsage)
+	{	Allocator.Code.resize(max<size_t>(Allocator.Code.size(), end));
+		copy(e.Usage.begin(), e.Usage.end(), Allocator.Code.begin() + PC);
+	}
+	PC = end;
+}
+
+void Parser::finishCode(unsigned end)
+{	auto starttime = chrono::steady_clock::now();
+	// Optimize instructions identify code segments automatically
+	unsigned pc = Finished.PC;
+	auto sp = Segments.begin() + Finished.Segment;
+	auto np = sp + 1;
+	bool autocode = Finished.AutoCode;
+	while (pc != end)
+	{	auto& inst = Instructions[pc - Flushed];
+		// next segment?
+		if (np != Segments.end() && np->Start <= pc)
+		{	sp = np++;
+			autocode = false;
+		}
+		if ((InstFlags[pc++ - Flushed] & IF_DATA) == 0)
+		{	// instruction
+			decode(inst);
+			optimize();
+			inst = encode();
+			// auto code?
+			if (sp->Flags == SF_None)
+			{	if (sp->Start != pc)
+				{	// not current pc => insert new segment
+					sp = Segments.emplace(np, pc, SF_Code);
+					np = sp + 1;
+				} else
+					// exact match => just change the flags
+					sp->Flags = SF_Code;
+				autocode = true;
+			}
+		} else if (autocode)
+		{	// autocode implies that sp->Start != pc && last Flags = SF_None
+			// => insert an entry at pc
+			sp = Segments.insert(np, segment(pc, SF_None));
+			np = sp + 1;
+			autocode = false;
+		}
+	}
+	Finished.PC = pc;
+	Finished.Segment = sp - Segments.begin();
+	Finished.AutoCode = autocode;
+	Stats.OptimizeTime += chrono::duration<double>(chrono::steady_clock::now() - starttime).count();
+}
+
+void Parser::optimizeCode()
+{	auto starttime = chrono::steady_clock::now();
+	Optimizer opt;
+	opt.Passes = Optimize;
+	opt.Relocatable = !PositionDependent;
+	const string empty;
+	for (unsigned pc = 0; pc < Instructions.size(); ++pc)
+	{	instFlags flags = pc < InstFlags.size() ? InstFlags[pc] : IF_NONE;
+		opt.Append(Instructions[pc], (flags & IF_DATA) != 0, (flags & IF_BRANCH_TARGET) != 0, (flags & IF_NOASWAP) != 0,
+			LineNumbers[pc], pc < LineForInstruction.size() ? LineForInstruction[pc] : empty);
+		if (flags & IF_PIPELINE)
+			opt.AddPipeline(pc);
+	}
+	for (const auto& label : Labels)
+	{	opt.AddTarget(label.Value / sizeof(uint64_t));
+		if (label.Exported)
+			opt.AddEntry(label.Value / sizeof(uint64_t));
+	}
+	for (const auto& global : GlobalsByName)
+		if (global.second.Type == V_LABEL)
+			opt.AddEntry(global.second.iValue / sizeof(uint64_t));
+	for (const auto& seg : Segments)
+		opt.AddTarget(seg.Start);
+
+	opt.Run();
+	opt.Store(Instructions, LineNumbers, &LineForInstruction);
+	InstFlags.clear();
+
+	// Relocate everything that refers to code.
+	auto relocate = [&opt](uint64_t value) { return opt.Relocate(value / sizeof(uint64_t)) * sizeof(uint64_t) + value % sizeof(uint64_t); };
+	for (auto& label : Labels)
+		label.Value = relocate(label.Value);
+	for (auto& seg : Segments)
+		seg.Start = opt.Relocate(seg.Start);
+	for (auto& global : GlobalsByName)
+		if (global.second.Type == V_LABEL)
+			global.second.iValue = relocate(global.second.iValue);
+
+	Stats.Optimized += opt.Notes.size();
+	Stats.OptimizerSaved += opt.Saved;
+	Optimizations = move(opt.Notes);
+	Stats.OptimizeTime += chrono::duration<double>(chrono::steady_clock::now() - starttime).count();
+}
+
+void Parser::flushCode()
+{
+	// Keep the instructions that .back (up to 10 slots + 1 for combine support) can reach.
+	if (!Streaming || Back || PC < Flushed + 4096 + 11)
+		return;
+	unsigned end = min(PC - 11, Pinned);
+	if (end <= Flushed)
+		return;
+	// Recorded macro invocations need their code.
+	for (auto r : Recordings)
+		if (r->Start < end)
+			r->Tainted = true;
+
+	if (Pass2)
+	{	finishCode(end);
+		Streaming->Write(Instructions.data(), end - Flushed);
+	}
+	Instructions.erase(Instructions.begin(), Instructions.begin() + (end - Flushed));
+	InstFlags.erase(InstFlags.begin(), InstFlags.begin() + min<size_t>(end - Flushed, InstFlags.size()));
+	LineNumbers.discard(end);
+	Flushed = end;
 }
 
 Parser::token_t Parser::NextToken()
 {	size_t i;
 	token_t ret;
+	++Stats.Tokens;
  restart:
 	switch (*At)
 	{case 0:
@@ -222,6 +413,16 @@ Parser::token_t Parser::NextToken()
 	return ret;
 }
 
+unsigned Parser::Tokenize(const char* line)
+{	strncpy(Line, line, sizeof(Line) - 1);
+	Line[sizeof(Line) - 1] = 0;
+	At = Line;
+	unsigned count = 0;
+	while (NextToken() != END)
+		++count;
+	return count;
+}
+
 size_t Parser::parseInt(const char* src, int64_t& dst)
 {	dst = 0;
 	const char* cp = src;
@@ -255,7 +456,9 @@ size_t Parser::parseInt(const char* src, int64_t& dst)
 }
 
 Parser::label& Parser::labelRef(string name, bool forward)
-{
+{	// Label values depend on the location.
+	taintExpansions();
+	++Stats.Lookups;
 	const auto& l = LabelsByName.emplace(name, LabelCount);
 	if (!!l.second || (forward && !!Labels[l.first->second].Definition))
 	{	// new label
@@ -320,6 +523,7 @@ void Parser::parseRegister()
 {	auto savectx = InstCtx;
 	InstCtx = IC_NONE;
 	reg_t reg;
+	reg.Virt = 0;
 	ParseExpression();
 	if (ExprValue.Type != V_INT)
 		Fail("Expecting integer constant, found %s.", type2string(ExprValue.Type));
@@ -363,9 +567,92 @@ void Parser::parseRegister()
 	InstCtx = savectx;
 }
 
+void Parser::parseNUM()
+{	if (Token.find('.') != string::npos || (Token.find_first_of("eE") != string::npos && (Token[1] & 0xdf) != 'X'))
+	{	// float number
+		size_t len;
+		if (sscanf(Token.c_str(), "%lf%zn", &ExprValue.fValue, &len) != 1 || len != Token.size())
+			Fail("%s is no real number.", Token.c_str());
+		ExprValue.Type = V_FLOAT;
+	} else
+	{	// integer
+		//size_t len;  sscanf of gcc4.8.2/Linux x32 can't read "0x80000000".
+		//if (sscanf(Token.c_str(), "%i%n", &stack.front().iValue, &len) != 1 || len != Token.size())
+		if (parseInt(Token.c_str(), ExprValue.iValue) != Token.size())
+			Fail("%s is no integral number.", Token.c_str());
+		ExprValue.Type = V_INT;
+	}
+}
+
+size_t Parser::foldableLength(const char* src)
+{	const char* cp = src;
+	int depth = 0;
+	bool braces = false;
+	for (;; ++cp)
+		switch (*cp)
+		{case 0:
+		 case '#':
+		 case ',':
+		 case ';':
+			if (*cp == ',' && depth)
+				continue;
+		 end:
+			return braces ? cp - src : 0;
+		 case '(':
+		 case '[':
+			++depth;
+			braces = true;
+			continue;
+		 case ')':
+		 case ']':
+			if (--depth < 0)
+				goto end;
+		}
+}
+
 void Parser::ParseExpression()
+{	ToNextChar();
+	size_t len = Preprocessed ? 0 : foldableLength(At);
+	if (!len)
+		return evaluateExpression();
+
+	FoldKey.assign(At, len);
+	auto fp = Folded.find(FoldKey);
+	if (fp != Folded.end())
+	{	const folded& f = fp->second;
+		for (const constDep& dep : f.Deps)
+		{	auto cp = findConst(dep.Name);
+			if (!cp != !dep.Defined || (cp && cp->Value != dep.Value))
+				goto miss;
+		}
+		At += f.Length;
+		ExprValue = f.Value;
+		++Stats.FoldHits;
+		return;
+	}
+ miss:
+	char* start = At;
+	recording rec(Context.size(), PC, true);
+	Recordings.push_back(&rec);
+	try
+	{	evaluateExpression();
+	} catch (...)
+	{	Recordings.pop_back();
+		throw;
+	}
+	Recordings.pop_back();
+	if (rec.Tainted || (size_t)(At - start) > len)
+		return;
+	folded& f = Folded[string(start, len)];
+	f.Length = At - start;
+	f.Value = ExprValue;
+	f.Deps = move(rec.Deps);
+	++Stats.FoldMisses;
+}
+
+void Parser::evaluateExpression()
 {
-	Eval eval;
+	Eval eval(&EvalArena);
 	try
 	{next:
 		switch (NextToken())
@@ -377,15 +664,14 @@ void Parser::ParseExpression()
 
 		 case WORD:
 			{	// Expand constants
-				for (auto i = Context.end(); i != Context.begin(); )
-				{	auto c = (*--i)->Consts.find(Token);
-					if (c != (*i)->Consts.end())
-					{	ExprValue = c->second.Value;
-						goto have_value;
-					}
+				auto cp = findConst(Token);
+				if (cp)
+				{	ExprValue = cp->Value;
+					goto have_value;
 				}
 			}
 			{	// try function
+				++Stats.Lookups;
 				auto fp = Functions.find(Token);
 				if (fp != Functions.end())
 				{	// Hit!
@@ -394,6 +680,7 @@ void Parser::ParseExpression()
 				}
 			}
 			{	// try functional macro
+				++Stats.Lookups;
 				auto mp = MacroFuncs.find(Token);
 				if (mp != MacroFuncs.end())
 				{	doFUNCMACRO(mp);
@@ -445,6 +732,9 @@ void Parser::ParseExpression()
 					if (NextToken() != BRACE2)
 						Fail("Expected ')', found '%s'.", Token.c_str());
 					ExprValue.Type = V_LABEL;
+					// Keep track of the label value.
+					taintExpansions();
+					++PositionDependent;
 					goto have_value;
 
 				 case SQBRC1: // Internal register constant
@@ -460,6 +750,7 @@ void Parser::ParseExpression()
 				 case WORD:;
 				}
 				ExprValue = exprValue(labelRef(Token, forward).Value, V_LABEL);
+				++PositionDependent;
 			}
 			break;
 
@@ -473,7 +764,10 @@ void Parser::ParseExpression()
 					goto discard;
 				ToNextChar();
 				if (*At == '.')
-				{	ExprValue = eval.PeekExpression();
+				{	// Instruction extensions might apply to the current instruction.
+					for (auto r : Recordings)
+						r->Tainted |= r->Expression;
+					ExprValue = eval.PeekExpression();
 					doInstrExt();
 					eval.PeekExpression() = ExprValue;
 				}
@@ -484,27 +778,101 @@ void Parser::ParseExpression()
 			break;
 
 		 case NUM:
-			// parse number
-			if (Token.find('.') != string::npos || (Token.find_first_of("eE") != string::npos && (Token[1] & 0xdf) != 'X'))
-			{	// float number
-				size_t len;
-				if (sscanf(Token.c_str(), "%lf%zn", &ExprValue.fValue, &len) != 1 || len != Token.size())
-					Fail("%s is no real number.", Token.c_str());
-				ExprValue.Type = V_FLOAT;
-			} else
-			{	// integer
-				//size_t len;  sscanf of gcc4.8.2/Linux x32 can't read "0x80000000".
-				//if (sscanf(Token.c_str(), "%i%n", &stack.front().iValue, &len) != 1 || len != Token.size())
-				if (parseInt(Token.c_str(), ExprValue.iValue) != Token.size())
-					Fail("%s is no integral number.", Token.c_str());
-				ExprValue.Type = V_INT;
-			}
+			parseNUM();
 			break;
 		}
 	 have_value:
 		ToNextChar();
 		if (*At == '.')
+		{	for (auto r : Recordings)
+				r->Tainted |= r->Expression;
 			doInstrExt();
+		}
+
+		eval.PushValue(ExprValue);
+		goto next;
+	} catch (const Message& msg) // Messages from Eval are not yet enriched.
+	{	throw enrichMsg(msg);
+	}
+}
+
+bool Parser::compileExpression(const string& index, vector<exprStep>& prog)
+{
+	Eval eval(&EvalArena);
+	try
+	{next:
+		switch (NextToken())
+		{default:
+		 discard:
+			At -= Token.size();
+			ExprValue = eval.Evaluate();
+			return true;
+
+		 case WORD:
+			if (Token == index)
+			{	// The index is always the innermost constant and initially 0.
+				prog.emplace_back(exprStep::INDEX);
+				ExprValue = exprValue((int64_t)0);
+				goto have_index;
+			}
+			{	// Expand constants
+				auto cp = findConst(Token);
+				if (cp)
+				{	ExprValue = cp->Value;
+					goto have_value;
+				}
+			}
+			// Functions might depend on the index in any way.
+			if (Functions.find(Token) != Functions.end() || MacroFuncs.find(Token) != MacroFuncs.end())
+				return false;
+			{	// try register
+				auto rp = binary_search(regMap, Token.c_str());
+				if (rp)
+				{	ExprValue = rp->Value;
+					goto have_value;
+				}
+			}
+			{	// try alphanumeric operator
+				auto op = binary_search(operatorMap2, Token.c_str());
+				if (op)
+				{	if (!eval.PushOperator(op->Op))
+						goto discard;
+					prog.emplace_back(op->Op);
+					goto next;
+				}
+			}
+			// labels or whatever
+			return false;
+
+		 case OP:
+		 case BRACE1:
+		 case BRACE2:
+			{	const opInfo* op = binary_search(operatorMap, Token.c_str());
+				if (!op)
+					Fail("Invalid operator: %s", Token.c_str());
+				if (!eval.PushOperator(op->Op))
+					goto discard;
+				prog.emplace_back(op->Op);
+				ToNextChar();
+				if (*At == '.')
+					return false;
+				goto next;
+			}
+
+		 case NUM:
+			parseNUM();
+			break;
+
+		 case COLON:
+		 case SQBRC1:
+			return false;
+		}
+	 have_value:
+		prog.emplace_back(ExprValue);
+	 have_index:
+		ToNextChar();
+		if (*At == '.')
+			return false;
 
 		eval.PushValue(ExprValue);
 		goto next;
@@ -716,7 +1084,12 @@ void Parser::assembleMOV(int mode)
 	// Try ALU expression first
 	if (mode < 0)
 	{	if (applyMOVsrc(ExprValue))
+		{	if (ExprValue.Type != V_REG)
+				++Stats.SmallImmediates;
 			return;
+		}
+		if (ExprValue.Type != V_REG)
+			++Stats.LoadImmediates;
 		mode = ::Inst::L_LDI;
 	}
 	// Try LDI
@@ -776,7 +1149,8 @@ void Parser::assembleREAD(int)
 }
 
 void Parser::assembleBRANCH(int relative)
-{
+{	// Branches depend on the location and set flags behind the current instruction.
+	taintExpansions();
 	prepareBRANCH(!!relative);
 	ExprValue.Type = V_NONE;
 	doInstrExt();
@@ -795,6 +1169,8 @@ void Parser::assembleBRANCH(int relative)
 	 case 2:
 		InstCtx ^= IC_DST|IC_SRCA;
 		ParseExpression();
+		if (ExprValue.Type == V_LABEL && relative)
+			--PositionDependent;
 		applyBranchSource(ExprValue, PC);
 		if (NextToken() != COMMA)
 			Fail("Expected ', <branch target>', found %s.", Token.c_str());
@@ -805,11 +1181,13 @@ void Parser::assembleBRANCH(int relative)
 	}
 
 	ParseExpression();
+	if (ExprValue.Type == V_LABEL && relative)
+		--PositionDependent;
 	if (applyBranchSource(ExprValue, PC))
 	{	// add branch target flag for the branch point
 		size_t pos = PC + 4;
 		FlagsSize(pos + 1);
-		InstFlags[pos] |= IF_BRANCH_TARGET;
+		InstFlags[pos - Flushed] |= IF_BRANCH_TARGET;
 	}
 	if (NextToken() != END)
 		Fail("Expected end of line after branch instruction.");
@@ -851,8 +1229,9 @@ void Parser::ParseInstruction()
 }
 
 void Parser::defineLabel(bool exportable_label)
-{
+{	taintExpansions();
 	// Lookup symbol
+	++Stats.Lookups;
 	const auto& lname = LabelsByName.emplace(Token, LabelCount);
 	label* lp;
 	if (lname.second)
@@ -913,7 +1292,7 @@ void Parser::parseLabel()
 }
 
 void Parser::parseGLOBAL(int)
-{
+{	taintExpansions();
 	if (NextToken() != WORD)
 		Fail("Expected global symbol name after .global. Found '%s'.", Token.c_str());
 	string name = Token;
@@ -933,6 +1312,8 @@ void Parser::parseGLOBAL(int)
 				Fail("Cannot export 64 bit constant 0x%" PRIx64 "as symbol.", ExprValue.iValue);
 		 case V_LABEL:;
 		}
+		if (ExprValue.Type == V_LABEL)
+			--PositionDependent;
 		break;
 	 case COLON:
 		{ // Search for '::name' labels
@@ -959,13 +1340,8 @@ void Parser::parseGLOBAL(int)
 	}
 }
 
-void Parser::parseDATA(int bits)
-{	if (doPreprocessor())
-		return;
-
-	int alignment = 0;
- next:
-	ParseExpression();
+void Parser::doDATA(int bits, int& alignment)
+{	taintExpansions();
 	if (ExprValue.Type != V_INT && ExprValue.Type != V_FLOAT)
 		Fail("Immediate data instructions require integer or floating point constants. Found %s.", type2string(ExprValue.Type));
 	if (bits < 0 && ExprValue.Type == V_INT)
@@ -1010,7 +1386,7 @@ void Parser::parseDATA(int bits)
 	else if (!alignment && (alignment = BitOffset & (bits-1)) != 0)
 		Msg(WARNING, "Unaligned immediate data directive. %i bits missing for correct alignment.", bits - alignment);
 	// store value
-	uint64_t& target = Instructions[PC];
+	uint64_t& target = Instructions[PC - Flushed];
 	target |= ExprValue.iValue << BitOffset;
 	if ((BitOffset += bits) >= 64)
 	{	++PC;
@@ -1020,6 +1396,16 @@ void Parser::parseDATA(int bits)
 			StoreInstruction((uint64_t)ExprValue.iValue >> (bits - BitOffset));
 			Flags = IF_NONE;
 	}	}
+}
+
+void Parser::parseDATA(int bits)
+{	if (doPreprocessor())
+		return;
+
+	int alignment = 0;
+ next:
+	ParseExpression();
+	doDATA(bits, alignment);
 	switch (NextToken())
 	{default:
 		Fail("Syntax error. Expected ',' or end of line.");
@@ -1030,9 +1416,170 @@ void Parser::parseDATA(int bits)
 	reset();
 }
 
+void Parser::parseINCBIN(int)
+{	if (doPreprocessor())
+		return;
+
+	string file = parseFileName("incbin");
+	int64_t offset = 0;
+	int64_t length = -1;
+	switch (NextToken())
+	{default:
+		Fail("Expected ', <offset>' or end of line after file name.");
+	 case COMMA:
+		ParseExpression();
+		if (ExprValue.Type != V_INT || ExprValue.iValue < 0)
+			Fail("The offset of .incbin must be a non-negative integer. Found %s.", ExprValue.toString().c_str());
+		offset = ExprValue.iValue;
+		switch (NextToken())
+		{default:
+			Fail("Expected ', <length>' or end of line after offset.");
+		 case COMMA:
+			ParseExpression();
+			if (ExprValue.Type != V_INT || ExprValue.iValue < 0)
+				Fail("The length of .incbin must be a non-negative integer. Found %s.", ExprValue.toString().c_str());
+			length = ExprValue.iValue;
+			if (NextToken() != END)
+				Fail("Expected end of line after length.");
+		 case END:;
+		}
+	 case END:;
+	}
+
+	// read file
+	FILE* f = fopen(file.c_str(), "rb");
+	if (!f)
+		Fail("Failed to open file %s.", file.c_str());
+	struct stat buffer;
+	if (fstat(fileno(f), &buffer) != 0 || offset > buffer.st_size)
+	{	fclose(f);
+		Fail("The offset %" PRIi64 " is beyond the end of file %s.", offset, file.c_str());
+	}
+	if (length < 0)
+		length = buffer.st_size - offset;
+	else if (length > buffer.st_size - offset)
+	{	fclose(f);
+		Fail("File %s has only %" PRIi64 " bytes after offset %" PRIi64 ".", file.c_str(), (int64_t)buffer.st_size - offset, offset);
+	}
+	vector<unsigned char> data(length);
+	bool ok = fseek(f, offset, SEEK_SET) == 0 && fread(data.data(), 1, data.size(), f) == data.size();
+	fclose(f);
+	if (!ok)
+		Fail("Failed to read %" PRIi64 " bytes from file %s.", length, file.c_str());
+
+	// Binary data starts at a byte boundary.
+	if (doALIGN(1, 0))
+		Msg(WARNING, "Used padding to enforce byte alignment of binary data.");
+
+	uint8_t segflags = setSegment(PC, SF_Data);
+	const unsigned char* dp = data.data();
+	const unsigned char* const ep = dp + data.size();
+	// complete the current slot
+	while (BitOffset && dp != ep)
+	{	Instructions[PC - Flushed] |= (uint64_t)*dp++ << BitOffset;
+		if ((BitOffset += 8) == 64)
+		{	++PC;
+			BitOffset = 0;
+		}
+	}
+	// whole slots
+	while (dp != ep)
+	{	unsigned n = min<size_t>(ep - dp, sizeof(uint64_t));
+		uint64_t value = 0;
+		for (unsigned i = 0; i < n; ++i)
+			value |= (uint64_t)dp[i] << 8*i;
+		dp += n;
+		Flags |= IF_BRANCH_TARGET|IF_DATA;
+		StoreInstruction(value);
+		Flags = IF_NONE;
+		if (n == sizeof(uint64_t))
+		{	++PC;
+			flushCode();
+		} else
+			BitOffset = 8*n;
+	}
+	setSegment(PC + (BitOffset != 0), segflags);
+	reset();
+}
+
+void Parser::parseTABLE(int)
+{	if (doPreprocessor())
+		return;
+
+	if (NextToken() != WORD)
+		Fail("Expected data type after .table.");
+	const opEntry<12>* op = binary_search(directiveMap, Token.c_str());
+	if (!op || op->Func != &Parser::parseDATA)
+		Fail("%s is no valid data type for .table.", Token.c_str());
+	const int bits = op->Arg;
+	if (NextToken() != COMMA || NextToken() != WORD)
+		Fail("Expected ', <identifier>' after data type of .table.");
+	const string name = Token;
+	if (NextToken() != COMMA)
+		Fail("Expected ', <count>' at .table.");
+	ParseExpression();
+	if (ExprValue.Type != V_INT || (uint64_t)ExprValue.iValue > 0x1000000)
+		Fail("The element count of .table must be a non-negative integral number. Found %s", ExprValue.toString().c_str());
+	const unsigned count = (unsigned)ExprValue.iValue;
+	if (NextToken() != COMMA)
+		Fail("Expected ', <expression>' at .table.");
+	if (!count)
+		return;
+
+	// The index is a local constant of a nested block like the loop variable of .rep.
+	saveContext ctx(*this, new fileContext(CTX_BLOCK, Context.back()->File, Context.back()->Line));
+	auto& current = *Context.back();
+	auto& value = current.Consts.emplace(name, constDef(exprValue((int64_t)0), current)).first->second.Value;
+
+	// Compile the expression while evaluating index 0.
+	char* const expr = At;
+	vector<exprStep> prog;
+	bool compiled = compileExpression(name, prog);
+	if (!compiled)
+	{	// Fallback: parse the expression once per element.
+		At = expr;
+		ParseExpression();
+	}
+	if (NextToken() != END)
+		Fail("Expected end of line after expression, found '%s'.", Token.c_str());
+
+	int alignment = 0;
+	doDATA(bits, alignment);
+	try
+	{	for (unsigned i = 1; i < count; ++i)
+		{	if (compiled)
+			{	Eval eval(&EvalArena);
+				for (const exprStep& step : prog)
+					switch (step.Kind)
+					{case exprStep::VALUE:
+						eval.PushValue(step.Value);
+						break;
+					 case exprStep::INDEX:
+						eval.PushValue(exprValue((int64_t)i));
+						break;
+					 case exprStep::OPERATOR:
+						eval.PushOperator(step.Op);
+						break;
+					}
+				ExprValue = eval.Evaluate();
+			} else
+			{	value.iValue = i;
+				At = expr;
+				ParseExpression();
+			}
+			doDATA(bits, alignment);
+			flushCode();
+		}
+	} catch (const Message& msg) // Messages from Eval are not yet enriched.
+	{	throw enrichMsg(msg);
+	}
+	reset();
+}
+
 void Parser::parseALIGN(int bytes)
 {	if (doPreprocessor())
 		return;
+	taintExpansions();
 
 	if (bytes < 0)
 	{	ParseExpression();
@@ -1063,6 +1610,8 @@ void Parser::parseALIGN(int bytes)
 	 case END:;
 	}
 
+	if (bytes > (int)sizeof(uint64_t))
+		++PositionDependent;
 	doALIGN(bytes, offset);
 }
 
@@ -1119,6 +1668,16 @@ void Parser::endLOCAL(int)
 	Context.back()->Line = line;
 }
 
+void Parser::parsePIPELINE(int)
+{
+	if (doPreprocessor())
+		return;
+
+	if (NextToken() != END)
+		Fail("Expected end of line, found '%s'.", Token.c_str());
+	Flags |= IF_BRANCH_TARGET|IF_PIPELINE;
+}
+
 void Parser::beginREP(int mode)
 {	if (doPreprocessor())
 		return;
@@ -1182,6 +1741,10 @@ void Parser::endREP(int mode)
 		sscanf(m.Args[1].c_str(), "%zi", &count);
 	auto& current = *Context.back();
 	auto& value = current.Consts.emplace(m.Args.front(), constDef(exprValue((int64_t)0), current)).first->second.Value;
+	// Can we replicate the first loop cycle in binary?
+	Stats.RepCycles += count;
+	bool invariant = !mode && count > 1 && !Back && !BitOffset && !Preprocessed && isInvariantBody(m);
+	const unsigned pinned = Pinned;
 	for (size_t i = 0; i < count; ++i)
 	{	// set argument
 		if (mode)
@@ -1192,14 +1755,90 @@ void Parser::endREP(int mode)
 		} else
 			value.iValue = i;
 		// Invoke body
+		Context.back()->Line = m.Definition.Line;
+		const unsigned start = PC;
+		const size_t lines = LineForInstruction.size();
+		const unsigned labels = LabelCount;
+		// Keep the code of the first cycle for the replication in streaming mode.
+		if (invariant)
+			Pinned = min(pinned, start);
 		for (const string& line : m.Content)
 		{	++Context.back()->Line;
 			strncpy(Line, line.c_str(), sizeof(Line));
 			ParseLine();
 		}
+
+		if (!invariant)
+			continue;
+		Pinned = pinned;
+		// Check the generated code. Relative branches and labels depend on the location.
+		if (BitOffset || LabelCount != labels)
+			invariant = false;
+		for (unsigned pc = start; invariant && pc != PC; ++pc)
+			if ((Instructions[pc - Flushed] & 0xF000000000000000ULL) == 0xF000000000000000ULL)
+				invariant = false;
+		if (!invariant)
+			continue;
+
+		// Replicate the remaining loop cycles.
+		expansion e;
+		saveCode(e, start, lines);
+		if (!Streaming)
+		{	Instructions.reserve(PC - Flushed + (count - 1) * e.Code.size());
+			LineForInstruction.reserve(LineForInstruction.size() + (count - 1) * e.Text.size());
+		}
+		while (--count)
+		{	storeCode(e);
+			flushCode();
+		}
+		break;
 	}
 }
 
+bool Parser::isInvariantText(const char* cp, const string& index, int depth)
+{
+	while (*cp && *cp != '#')
+	{	size_t len = strspn(cp, "0123456789ABCDEFGHIJKLMNOPQRSTUVWXYZ_abcdefghijklmnopqrstuvwxyz");
+		if (!len)
+		{	++cp;
+			continue;
+		}
+		if (!isdigit(*cp))
+		{	const string id(cp, len);
+			if (id == index || Macros.count(id) || MacroFuncs.count(id))
+				return false;
+			auto fp = Functions.find(id);
+			if (fp != Functions.end() && (!depth || !isInvariantText(fp->second.Start, index, depth - 1)))
+				return false;
+		}
+		cp += len;
+	}
+	return true;
+}
+
+bool Parser::isInvariantBody(const macro& m)
+{
+	bool first = true;
+	for (const string& line : m.Content)
+	{	const char* cp = line.c_str();
+		cp += strspn(cp, " \t\r\n");
+		switch (*cp)
+		{case 0:
+		 case '#':
+			continue;
+		 case '.': // directive
+			return false;
+		 case ';': // would combine with the last instruction of the previous loop cycle
+			if (first)
+				return false;
+		}
+		first = false;
+		if (!isInvariantText(cp, m.Args.front(), 16))
+			return false;
+	}
+	return true;
+}
+
 void Parser::beginBACK(int)
 {
 	if (doPreprocessor())
@@ -1207,6 +1846,7 @@ void Parser::beginBACK(int)
 
 	if (Back)
 		Fail("Cannot nest .back directives.");
+	taintExpansions();
 	ParseExpression();
 	if (ExprValue.Type != V_INT)
 		Fail("Expected integer constant after .back.");
@@ -1222,12 +1862,13 @@ void Parser::beginBACK(int)
 	size_t pos = PC -= Back;
 	// Load last instruction before .back to provide combine support
 	if (pos)
-	{	decode(Instructions[pos-1]);
-		Flags = InstFlags[pos-1];
+	{	decode(Instructions[pos-1 - Flushed]);
+		Flags = InstFlags[pos-1 - Flushed];
+		restoreUsage(pos-1);
 	}
 	if (Pass2)
 		while (++pos < PC + Back)
-			if (InstFlags[pos] & IF_BRANCH_TARGET)
+			if (InstFlags[pos - Flushed] & IF_BRANCH_TARGET)
 				Msg(WARNING, ".back crosses branch target at address 0x%zx. Code might not work.", pos*8);
 }
 
@@ -1244,8 +1885,9 @@ void Parser::endBACK(int)
 	Back = 0;
 	// Restore last instruction to provide combine support
 	if (PC)
-	{	decode(Instructions[PC-1]);
-		Flags = InstFlags[PC-1];
+	{	decode(Instructions[PC-1 - Flushed]);
+		Flags = InstFlags[PC-1 - Flushed];
+		restoreUsage(PC-1);
 	}
 }
 
@@ -1254,9 +1896,11 @@ void Parser::parseCLONE(int)
 	if (doPreprocessor())
 		return;
 
+	taintExpansions();
 	ParseExpression();
 	if (ExprValue.Type != V_LABEL)
 		Fail("The first argument to .clone must by a label. Found %s.", type2string(ExprValue.Type));
+	--PositionDependent;
 	unsigned param1 = (unsigned)ExprValue.iValue >> 3; // offset in instructions rather than bytes
 	if (NextToken() != COMMA)
 		Fail("Expected ', <count>' at .clone.");
@@ -1270,24 +1914,33 @@ void Parser::parseCLONE(int)
 	unsigned param2 = (unsigned)ExprValue.iValue;
 	FlagsSize(PC + param2);
 	param2 += param1; // end offset rather than count
-	if (Pass2 && param2 >= Instructions.size())
+	if (Pass2 && !Streaming && param2 >= Instructions.size())
 		Fail("Cannot clone behind the end of the code.");
+	if (Pass2 && Streaming && (param1 < Flushed || param2 > Flushed + Instructions.size()))
+		Fail("In streaming mode .clone can only copy recently assembled code.");
 
 	if (doALIGN(8, 0))
 		Msg(WARNING, "Used padding to enforce 64 bit alignment of GPU instruction.");
 
 	auto src = param1;
 	do
-	{	InstFlags[PC] |= InstFlags[src] & ~IF_BRANCH_TARGET;
-		if ((Instructions[src] & 0xF000000000000000ULL) == 0xF000000000000000ULL)
+	{	// In pass 1 the source might already have been written in streaming mode.
+		uint64_t inst = 0;
+		if (src >= Flushed)
+		{	InstFlags[PC - Flushed] |= InstFlags[src - Flushed] & ~(IF_BRANCH_TARGET|IF_PIPELINE);
+			inst = Instructions[src - Flushed];
+		}
+		if ((inst & 0xF000000000000000ULL) == 0xF000000000000000ULL)
 			Msg(WARNING, "You should not clone branch instructions. (#%u)", src - param1);
-		StoreInstruction(Instructions[src]);
+		restoreUsage(src);
+		StoreInstruction(inst);
 		++PC;
 		++src;
 	} while (src < param2);
 	// Restore last instruction to provide combine support
-	decode(Instructions[PC-1]);
-	Flags = InstFlags[PC-1];
+	decode(Instructions[PC-1 - Flushed]);
+	Flags = InstFlags[PC-1 - Flushed];
+	restoreUsage(PC-1);
 }
 
 void Parser::parseSET(int flags)
@@ -1325,6 +1978,9 @@ void Parser::parseSET(int flags)
 			func.DefLine = Line;
 			func.Start = At;
 
+			taintExpansions();
+			Expansions.clear();
+			Folded.clear();
 			const auto& ret = Functions.emplace(name, func);
 			if (!ret.second)
 			{	Msg(INFO, "Redefinition of function %s.\n"
@@ -1340,7 +1996,9 @@ void Parser::parseSET(int flags)
 			if (NextToken() != END)
 				Fail("Syntax error: unexpected %s.", Token.c_str());
 
-			auto& consts = (flags & C_LOCAL ? Context.back() : Context.front())->Consts;
+			size_t depth = flags & C_LOCAL ? Context.size() - 1 : 0;
+			taintExpansions(depth);
+			auto& consts = Context[depth]->Consts;
 			auto r = consts.emplace(name, constDef(ExprValue, *Context.back()));
 			if (!r.second)
 			{	if (flags & C_CONST)
@@ -1364,13 +2022,64 @@ void Parser::parseUNSET(int flags)
 	if (NextToken() != END)
 		Fail("Syntax error: unexpected %s.", Token.c_str());
 
-	auto& consts = (flags & C_LOCAL ? Context.back() : Context.front())->Consts;
+	size_t depth = flags & C_LOCAL ? Context.size() - 1 : 0;
+	taintExpansions(depth);
+	auto& consts = Context[depth]->Consts;
 	auto r = consts.find(Name);
 	if (r == consts.end())
 		return Msg(WARNING, "Cannot unset %s because it has not yet been definied in the required context.", Name.c_str());
 	consts.erase(r);
 }
 
+void Parser::parseVREG(int flags)
+{
+	if (doPreprocessor())
+		return;
+
+	if (Streaming)
+		Fail("Virtual registers are not supported in streaming mode.");
+
+	size_t depth = flags & C_LOCAL ? Context.size() - 1 : 0;
+	taintExpansions(depth);
+	auto& consts = Context[depth]->Consts;
+	for (;;)
+	{	if (NextToken() != WORD)
+			Fail("Directive .vreg requires identifier.");
+		unsigned id = VRegCount++;
+		if (id >= 0xffff)
+			Fail("Too many virtual registers.");
+		if (!Pass2)
+			VRegs.emplace_back(Token, *Context.back());
+		else if (id >= VRegs.size() || VRegs[id].Name != Token)
+			Fail("Inconsistent virtual register %s during pass 2.", Token.c_str());
+
+		exprValue value;
+		if (VRegState == VR_ASSIGNED)
+			value = VRegs[id].Reg;
+		else
+		{	reg_t reg;
+			reg.Num = id & 31;
+			reg.Type = R_RWAB;
+			reg.Rotate = 0;
+			reg.Pack.reset();
+			reg.Virt = id + 1;
+			value = reg;
+		}
+		auto r = consts.emplace(Token, constDef(value, *Context.back()));
+		if (!r.second)
+			r.first->second.Value = value;
+
+		switch (NextToken())
+		{default:
+			Fail("Expected ',' or end of line after virtual register %s. Found '%s'.", VRegs[id].Name.c_str(), Token.c_str());
+		 case COMMA:
+			continue;
+		 case END:
+			return;
+		}
+	}
+}
+
 bool Parser::doCondition()
 {
 	ParseExpression();
@@ -1399,15 +2108,7 @@ void Parser::parseIFSET(int)
 
 	int state = 4;
 	if (!isDisabled())
-	{	state = 0;
-		for (auto i = Context.end(); i != Context.begin(); )
-		{	auto c = (*--i)->Consts.find(Token);
-			if (c != (*i)->Consts.end())
-			{	state = 1;
-				break;
-			}
-		}
-	}
+		state = findConst(Token) != NULL;
 
 	if (NextToken() != END)
 		Fail("Expected end of line, found '%s'.", Token.c_str());
@@ -1479,6 +2180,10 @@ void Parser::beginMACRO(int flags)
 		     fName(AtMacro->Definition.File), AtMacro->Definition.Line);
 	if (NextToken() != WORD)
 		Fail("Expected macro name.");
+	// Cached invocations might refer to the old definition.
+	taintExpansions();
+	Expansions.clear();
+	Folded.clear();
 	AtMacro = &(flags & M_FUNC ? MacroFuncs : Macros)[Token];
 	if (!!AtMacro->Definition)
 	{	Msg(INFO, "Redefinition of macro %s.\n"
@@ -1539,7 +2244,7 @@ void Parser::endMACRO(int flags)
 }
 
 void Parser::doMACRO(macros_t::const_iterator m)
-{
+{	++Stats.MacroCalls;
 	InstCtx = IC_XP;
 	// Fetch macro arguments
 	const auto& argnames = m->second.Args;
@@ -1565,6 +2270,11 @@ void Parser::doMACRO(macros_t::const_iterator m)
 	} else if (NextToken() != END)
 		Fail("The macro %s does not take arguments.", m->first.c_str());
 
+	// Identical invocation already cached?
+	bool cache = !Back && !BitOffset && !Preprocessed;
+	if (cache && replayMACRO(m->second, args))
+		return;
+
 	// Setup invocation context
 	saveContext ctx(*this, new fileContext(CTX_MACRO, m->second.Definition.File, m->second.Definition.Line));
 
@@ -1576,15 +2286,77 @@ void Parser::doMACRO(macros_t::const_iterator m)
 		current.Consts.emplace(arg, constDef(args[n++], current));
 
 	// Invoke macro
-	for (const string& line : m->second.Content)
-	{	++Context.back()->Line;
-		strncpy(Line, line.c_str(), sizeof(Line));
-		ParseLine();
+	recording rec(Context.size() - 1, PC);
+	const instFlags flags = Flags;
+	const size_t lines = LineForInstruction.size();
+	const size_t ifs = AtIf.size();
+	if (cache)
+		Recordings.push_back(&rec);
+	try
+	{	for (const string& line : m->second.Content)
+		{	++Context.back()->Line;
+			strncpy(Line, line.c_str(), sizeof(Line));
+			ParseLine();
+		}
+	} catch (...)
+	{	if (cache)
+			Recordings.pop_back();
+		throw;
 	}
+	if (cache)
+		Recordings.pop_back();
+
+	if (!cache || rec.Tainted || AtMacro || Back || BitOffset || AtIf.size() != ifs)
+		++Stats.MacroCacheSkipped;
+	else
+		cacheMACRO(m->second, args, rec, flags, lines);
 }
 
-void Parser::doFUNCMACRO(macros_t::const_iterator m)
+bool Parser::replayMACRO(const macro& m, const vector<exprValue>& args)
 {
+	auto ep = Expansions.find(&m);
+	if (ep == Expansions.end())
+		return false;
+	for (const expansion& e : ep->second)
+	{	if (e.EntryFlags != Flags || e.Args != args)
+			continue;
+		for (const constDep& dep : e.Deps)
+		{	auto cp = findConst(dep.Name);
+			if (!cp != !dep.Defined || (cp && cp->Value != dep.Value))
+				goto next;
+		}
+		{	// Hit => copy the code
+			storeCode(e);
+			Flags = e.ExitFlags;
+			++Stats.MacroCacheHits;
+			return true;
+		}
+	 next:;
+	}
+	return false;
+}
+
+void Parser::cacheMACRO(const macro& m, const vector<exprValue>& args, recording& rec, instFlags entryFlags, size_t lines)
+{
+	auto& list = Expansions[&m];
+	// Limit the number of variants per macro to keep the lookup fast.
+	// An instruction that could be combined with the next line would require the internal state of AssembleInst.
+	if (list.size() >= 16 || (PC != rec.Start && (InstFlags[PC-1 - Flushed] & IF_CMB_ALLOWED)))
+	{	++Stats.MacroCacheSkipped;
+		return;
+	}
+	list.emplace_back();
+	expansion& e = list.back();
+	e.Args = args;
+	e.EntryFlags = entryFlags;
+	e.ExitFlags = Flags;
+	e.Deps = move(rec.Deps);
+	saveCode(e, rec.Start, lines);
+	++Stats.MacroCacheMisses;
+}
+
+void Parser::doFUNCMACRO(macros_t::const_iterator m)
+{	++Stats.FunctionCalls;
 	if (NextToken() != BRACE1)
 		Fail("Expected '(' after function name.");
 
@@ -1669,7 +2441,7 @@ void Parser::doFUNCMACRO(macros_t::const_iterator m)
 }
 
 void Parser::doFUNC(funcs_t::const_iterator f)
-{
+{	++Stats.FunctionCalls;
 	if (NextToken() != BRACE1)
 		Fail("Expected '(' after function name.");
 
@@ -1720,61 +2492,81 @@ void Parser::doFUNC(funcs_t::const_iterator f)
 		Fail("Function %s evaluated to an incomplete expression.", f->first.c_str());
 }
 
-void Parser::doSEGMENT(int flags)
-{
-	if (doPreprocessor())
-		return;
-
-	if (NextToken() != END)
-		Msg(ERROR, "End of line expected.");
+uint8_t Parser::setSegment(unsigned pc, uint8_t flags)
+{	taintExpansions();
 
-	// Search segment entry at PC
-	auto ptr = upper_bound(Segments.begin()+1, Segments.end(), PC,
-		[](decltype(PC) pc, const segment& seg) { return pc < seg.Start; } );
+	// Search segment entry at pc
+	auto ptr = upper_bound(Segments.begin()+1, Segments.end(), pc,
+		[](unsigned pc, const segment& seg) { return pc < seg.Start; } );
 	auto cur = ptr - 1;
+	uint8_t old = cur->Flags;
 
 	// Segment attributes happen to match => no action
-	if (cur->Flags == flags)
-		return;
-	// otherwise ensure distinct entry at PC
-	if (cur->Start != PC)
-		Segments.insert(ptr, segment(PC, (uint8_t)flags));
+	if (old == flags)
+		return old;
+	// otherwise ensure distinct entry at pc
+	if (cur->Start != pc)
+		Segments.insert(ptr, segment(pc, flags));
 	else
 		cur->Flags = flags;
+	return old;
 }
 
-void Parser::doINCLUDE(int)
+void Parser::doSEGMENT(int flags)
 {
 	if (doPreprocessor())
 		return;
 
-	At += strspn(At, " \t\r\n");
-	{	// remove trailing blanks
-		char* cp = At + strlen(At);
-		while (strchr(" \t\r\n", *--cp))
-			*cp = 0;
+	if (NextToken() != END)
+		Msg(ERROR, "End of line expected.");
+
+	setSegment(PC, (uint8_t)flags);
+}
+
+string Parser::parseFileName(const char* directive)
+{
+	ToNextChar();
+	const char* ep = NULL;
+	switch (*At)
+	{case '"':
+		ep = strchr(At+1, '"');
+		break;
+	 case '<':
+		ep = strchr(At+1, '>');
 	}
-	size_t len = strlen(At);
-	if ((*At != '"' || At[len-1] != '"') && (*At != '<' || At[len-1] != '>'))
-		Fail("Syntax error. Expected \"file-name\" or <file-name> after .include, found '%s'.", At);
-	Token.assign(At+1, len-2);
+	if (!ep)
+		Fail("Syntax error. Expected \"file-name\" or <file-name> after .%s, found '%s'.", directive, At);
+	Token.assign(At+1, ep-At-1);
+	bool syspath = *At == '<';
+	At = (char*)ep + 1;
 
 	// find file
 	struct stat buffer;
 	string file;
-	if (*At == '<')
+	if (syspath)
 	{	// check include paths first
 		for (string path : IncludePaths)
 		{	file = path + Token;
 			if (stat(file.c_str(), &buffer) == 0)
-				goto got_it;
+				return file;
 		}
 	}
 	file = relpath(SourceFiles[Context.back()->File].Name, Token);
 	if (stat(file.c_str(), &buffer) != 0)
-		Fail("Cannot locate included file '%s'.", Token.c_str());
+		Fail("Cannot locate file '%s' of .%s.", Token.c_str(), directive);
+	return file;
+}
+
+void Parser::doINCLUDE(int)
+{
+	if (doPreprocessor())
+		return;
+
+	taintExpansions();
+	string file = parseFileName("include");
+	if (NextToken() != END)
+		Fail("Expected end of line after file name, found '%s'.", Token.c_str());
 
- got_it:
 	if (Pass2)
 	{	const auto& p1file = SourceFiles[FilesCount];
 		if (p1file.Name != file)
@@ -1793,7 +2585,7 @@ void Parser::ParseDirective()
 	if (NextToken() != WORD)
 		Fail("Expected assembler directive after '.'. Found '%s'.", Token.c_str());
 
-	const opEntry<8>* op = binary_search(directiveMap, Token.c_str());
+	const opEntry<12>* op = binary_search(directiveMap, Token.c_str());
 	if (!op)
 		Fail("Invalid assembler directive: %s", Token.c_str());
 
@@ -1810,7 +2602,7 @@ bool Parser::doPreprocessor(preprocType type)
 }
 
 void Parser::ParseLine()
-{
+{	++Stats.Lines;
 	At = Line;
 	bool trycombine = false;
 	bool isinst = false;
@@ -1844,8 +2636,12 @@ void Parser::ParseLine()
 	 case SEMI:
 		if (doPreprocessor())
 			return;
-		if (pos && (InstFlags[pos-1] & IF_CMB_ALLOWED) && (InstFlags[pos] & IF_BRANCH_TARGET) == 0)
+		if (pos && (InstFlags[pos-1 - Flushed] & IF_CMB_ALLOWED) && (InstFlags[pos - Flushed] & IF_BRANCH_TARGET) == 0)
 			trycombine = true;
+		// Combining depends on the code before a macro invocation.
+		for (auto r : Recordings)
+			if (r->Start >= pos || (InstFlags[pos - Flushed] & IF_BRANCH_TARGET))
+				r->Tainted = true;
 		isinst = true;
 		goto next;
 
@@ -1867,12 +2663,13 @@ void Parser::ParseLine()
 			}else{
 				defineLabel();
 			}
-			InstFlags[pos] |= IF_BRANCH_TARGET;
+			InstFlags[pos - Flushed] |= IF_BRANCH_TARGET;
 			++At;
 			goto next;
 		}
 
 		// Try macro
+		++Stats.Lookups;
 		macros_t::const_iterator m = Macros.find(Token);
 		if (m != Macros.end())
 		{	doMACRO(m);
@@ -1883,7 +2680,8 @@ void Parser::ParseLine()
 			Msg(WARNING, "Used padding to enforce 64 bit alignment of GPU instruction.");
 
 		if (trycombine)
-		{	char* atbak = At;
+		{	++Stats.CombineTries;
+			char* atbak = At;
 			bool succbak = Success;
 			string tokenbak = Token;
 			try
@@ -1893,8 +2691,13 @@ void Parser::ParseLine()
 				if (isTMUconflict())
 					throw string();
 				// Combine succeeded
-				Instructions[pos-1] = encode();
-				InstFlags[pos-1] = Flags;
+				Instructions[pos-1 - Flushed] = encode();
+				InstFlags[pos-1 - Flushed] = Flags;
+				if (RecordUsage)
+				{	finishUsage(pos-1);
+					recordUsage(pos-1);
+				}
+				++Stats.Combined;
 				return;
 			} catch (const string& msg)
 			{	// Combine failed => try new instruction.
@@ -1907,8 +2710,10 @@ void Parser::ParseLine()
 		reset();
 
 		ParseInstruction();
+		if (RecordUsage)
+			finishUsage(PC);
 		StoreInstruction(encode());
-		if (Pass2)
+		if (Pass2 && !Streaming)
 		{	LineForInstruction.emplace_back(Line);
 			auto &l = LineForInstruction.back();
 			if (l.back() == '\n')
@@ -1922,6 +2727,7 @@ void Parser::ParseLine()
 
 		++PC;
 		Flags = IF_NONE;
+		flushCode();
 		return;
 	}
 }
@@ -1938,6 +2744,7 @@ void Parser::ParseFile()
 		{	++Context.back()->Line;
 			try
 			{	ParseLine();
+				flushCode();
 			} catch (const string& msg)
 			{	// recover from errors
 				CaughtMsg(msg.c_str());
@@ -1981,6 +2788,18 @@ void Parser::ResetPass()
 	GlobalsByName.clear();
 	LabelCount = 0;
 	InstFlags.clear();
+	LineNumbers.clear();
+	Expansions.clear();
+	Folded.clear();
+	if (Streaming)
+		Instructions.clear();
+	Flushed = 0;
+	PositionDependent = 0;
+	Pinned = UINT_MAX;
+	Finished.PC = 0;
+	Finished.Segment = 0;
+	Finished.AutoCode = false;
+	VRegCount = 0;
 	PC = 0;
 	reset();
 	BitOffset = 0;
@@ -1996,7 +2815,6 @@ void Parser::EnsurePass2()
 
 	// enter pass 2
 	Pass2 = true;
-	ResetPass();
 
 	// Check all labels
 	for (auto& label : Labels)
@@ -2006,10 +2824,44 @@ void Parser::EnsurePass2()
 		if (!label.Reference)
 			Msg(INFO, "Label '%s' defined at %s (%u) is not used.\n",
 				label.Name.c_str(), fName(label.Definition.File), label.Definition.Line);
-		// prepare for next pass
-		label.Definition.Line = 0;
 	}
 
+	if (VRegs.size())
+	{	// Record the register usage with placeholders for the virtual registers.
+		bool success = Success;
+		VRegState = VR_RECORD;
+		RecordUsage = true;
+		Allocator.Code.clear();
+		parsePass2();
+		unsigned pc = PC;
+		RecordUsage = false;
+		Success = success;
+		VRegState = VR_PLACEHOLDER;
+		allocateVRegs();
+		parsePass2();
+		if (PC != pc)
+			Msg(ERROR, "The code size changed after assigning the virtual registers from %u to %u instructions.", pc, PC);
+	} else
+		parsePass2();
+
+	finishCode(Flushed + Instructions.size());
+	if (Optimize && !Streaming)
+		optimizeCode();
+	if (Streaming)
+	{	// Write the remaining code.
+		Streaming->Write(Instructions.data(), Instructions.size());
+		Flushed += Instructions.size();
+		Instructions.clear();
+		InstFlags.clear();
+	}
+}
+
+void Parser::parsePass2()
+{	ResetPass();
+	// prepare for next pass
+	for (auto& label : Labels)
+		label.Definition.Line = 0;
+
 	//for (auto& file : SourceFiles)
 	while (FilesCount < SourceFiles.size())
 	{	const auto& file = SourceFiles[FilesCount];
@@ -2019,46 +2871,72 @@ void Parser::EnsurePass2()
 		++FilesCount;
 		ParseFile();
 	}
+}
 
-	// Optimize instructions identify code segments automatically
-	unsigned pc = 0;
-	auto sp = Segments.begin();
-	auto np = sp + 1;
-	bool autocode = false;
-	for (auto& inst : Instructions)
-	{	// next segment?
-		if (np != Segments.end() && np->Start <= pc)
-		{	sp = np++;
-			autocode = false;
-		}
-		if ((InstFlags[pc++] & IF_DATA) == 0)
-		{	// instruction
-			decode(inst);
-			optimize();
-			inst = encode();
-			// auto code?
-			if (sp->Flags == SF_None)
-			{	if (sp->Start != pc)
-				{	// not current pc => insert new segment
-					sp = Segments.emplace(np, pc, SF_Code);
-					np = sp + 1;
-				} else
-					// exact match => just change the flags
-					sp->Flags = SF_Code;
-				autocode = true;
-			}
-		} else if (autocode)
-		{	// autocode implies that sp->Start != pc && last Flags = SF_None
-			// => insert an entry at pc
-			sp = Segments.insert(np, segment(pc, SF_None));
-			np = sp + 1;
-			autocode = false;
+void Parser::allocateVRegs()
+{	Allocator.Count = VRegs.size();
+	Allocator.Code.resize(PC);
+	try
+	{	Allocator.Run();
+	} catch (const RegAlloc::error& err)
+	{	const vregDef& vreg = VRegs[err.VReg];
+		const location& loc = LineNumbers[err.PC];
+		if (err.Live)
+			Msg(ERROR, "No register left for virtual register %s defined at %s (%u).\n"
+				"%u virtual registers are live at %s (%u).",
+				vreg.Name.c_str(), fName(vreg.Definition.File), vreg.Definition.Line, err.Live, fName(loc.File), loc.Line);
+		else
+			Msg(ERROR, "No register of virtual register %s defined at %s (%u) can be encoded at %s (%u).\n"
+				"Too many registers of the same register file are accessed by the instruction.",
+				vreg.Name.c_str(), fName(vreg.Definition.File), vreg.Definition.Line, fName(loc.File), loc.Line);
+		return;
+	}
+	for (unsigned id = 0; id < VRegs.size(); ++id)
+	{	vregDef& vreg = VRegs[id];
+		const RegAlloc::reg& phys = Allocator.Regs[id];
+		reg_t& reg = vreg.Reg;
+		reg.Rotate = 0;
+		reg.Pack.reset();
+		reg.Virt = 0;
+		const char* name;
+		switch (phys.Class)
+		{default:
+			// never used
+			reg.Num = 39; // nop
+			reg.Type = R_RWAB;
+			continue;
+		 case RegAlloc::RC_ACC:
+			reg.Num = 32 + phys.Num;
+			reg.Type = R_WRAB;
+			name = "r";
+			break;
+		 case RegAlloc::RC_A:
+			reg.Num = phys.Num;
+			reg.Type = R_RWA;
+			name = "ra";
+			break;
+		 case RegAlloc::RC_B:
+			reg.Num = phys.Num;
+			reg.Type = R_RWB;
+			name = "rb";
 		}
+		Msg(INFO, "Virtual register %s defined at %s (%u) assigned to %s%u.",
+			vreg.Name.c_str(), fName(vreg.Definition.File), vreg.Definition.Line, name, phys.Num);
+	}
+	for (unsigned id : Allocator.Delayed)
+	{	const vregDef& vreg = VRegs[id];
+		Msg(WARNING, "Virtual register %s defined at %s (%u) is read immediately after write but no accumulator is available.",
+			vreg.Name.c_str(), fName(vreg.Definition.File), vreg.Definition.Line);
 	}
+	VRegState = VR_ASSIGNED;
 }
 
 void Parser::Reset()
 { ResetPass();
+	VRegs.clear();
+	VRegState = VR_PLACEHOLDER;
+	RecordUsage = false;
+	Stats = statistics();
 	Labels.clear();
 	Pass2 = false;
 	SourceFiles.clear();
@@ -11,6 +11,8 @@
 #include "Eval.h"
 #include "AssembleInst.h"
 #include "DebugInfo.h"
+#include "Optimizer.h"
+#include "RegAlloc.h"
 #include "Message.h"
 #include "utils.h"
 
@@ -33,6 +35,14 @@ class Parser : private AssembleInst, public DebugInfo
 	,	NORMAL       ///< Break after pass 1 in case of errors. @remarks Causes Warnings to be suppressed during pass 1.
 	,	IRGNOREERRORS///< Always enter pass 2, even in case of errors. @remarks Show no messages in pass 1.
 	};
+	/// Receiver of finished code in streaming mode.
+	struct codeSink
+	{	/// @brief Receive the next block of finished instructions.
+		/// @details The blocks arrive in order of PC during pass 2. Each instruction is passed exactly once.
+		/// @param code Instruction words.
+		/// @param count Number of instruction words.
+		virtual void Write(const uint64_t* code, size_t count) = 0;
+	};
 
  public: // Input
 	/// List of path prefixes to search for include files.
@@ -46,13 +56,48 @@ class Parser : private AssembleInst, public DebugInfo
 	severity       Verbose = WARNING;
 	/// See \see mode.
 	mode           OperationMode = NORMAL;
+	/// @brief Streaming mode: write finished code to this receiver during pass 2.
+	/// @details If not NULL only a small window of the code is kept in \ref Instructions in both passes.
+	/// The Instructions array is empty after EnsurePass2.
+	/// LineForInstruction is not maintained and code cannot be cloned from instructions that have already been written.
+	codeSink*      Streaming = NULL;
+	/// @brief Optimization passes to run after pass 2, see \ref Optimizer.
+	/// @details The optimizer is not available in streaming mode.
+	Optimizer::passes Optimize = Optimizer::O_NONE;
  public: // Result
 	/// Assembled result. The index is PC.
 	/// This is only valid after EnsurePass2 has been called.
+	/// In streaming mode the index is PC - \ref Flushed.
 	vector<uint64_t> Instructions;
+	/// Number of instructions that have been removed from the start of \ref Instructions in streaming mode.
+	unsigned       Flushed = 0;
 
 	/// Hold after assembly the source code for each entry of Instructions.
 	vector<string> LineForInstruction;
+	/// Report of the optimizer, only valid if \ref Optimize is not O_NONE.
+	vector<Optimizer::note> Optimizations;
+
+	/// Counters of the assembly process.
+	struct statistics
+	{	unsigned       MacroCacheHits = 0;   ///< Macro invocations replayed from the expansion cache.
+		unsigned       MacroCacheMisses = 0; ///< Macro invocations that have been stored in the expansion cache.
+		unsigned       MacroCacheSkipped = 0;///< Macro invocations that cannot be cached, e.g. because they define labels.
+		unsigned long  FoldHits = 0;         ///< Expressions served from the folding cache.
+		unsigned long  FoldMisses = 0;       ///< Expressions that have been stored in the folding cache.
+		unsigned long  Lines = 0;            ///< Source lines parsed, including macro and .rep bodies.
+		unsigned long  Tokens = 0;           ///< Tokens read by the lexer.
+		unsigned long  MacroCalls = 0;       ///< Macro invocations.
+		unsigned long  FunctionCalls = 0;    ///< Invocations of .func functions and functional macros.
+		unsigned long  RepCycles = 0;        ///< Loop cycles of .rep/.foreach, including replicated ones.
+		unsigned long  CombineTries = 0;     ///< Attempts to merge an instruction into the previous one.
+		unsigned long  Combined = 0;         ///< Successful merges into the previous instruction.
+		unsigned long  SmallImmediates = 0;  ///< mov with immediate value encoded as ALU instruction.
+		unsigned long  LoadImmediates = 0;   ///< mov with immediate value that required ldi.
+		unsigned long  Lookups = 0;          ///< Hash lookups of constants, labels, functions and macros.
+		unsigned long  Optimized = 0;        ///< Optimizations applied by the optimizer passes.
+		unsigned long  OptimizerSaved = 0;   ///< Instruction words saved by the optimizer passes.
+		double         OptimizeTime = 0;     ///< Seconds spent in the final instruction optimization.
+	}              Stats;
  private: // types...
 	/// Type of a parser token.
 	enum token_t : char
@@ -121,7 +166,7 @@ class Parser : private AssembleInst, public DebugInfo
 	///< OP code extension lookup table, ordered by Name.
 	static const opExtEntry extMap[];
 	///< Assembler directive lookup table, ordered by Name.
-	static const opEntry<8> directiveMap[];
+	static const opEntry<12> directiveMap[];
 
 	/// Label instance
 	struct label
@@ -166,6 +211,19 @@ class Parser : private AssembleInst, public DebugInfo
 		/// Construct an empty function definition. The properties have to be assigned later.
 		function(const location& definition) : Definition(definition), Start(NULL) {}
 	};
+	/// Virtual register declared by \c .vreg.
+	struct vregDef
+	{	string         Name;      ///< Name of the virtual register.
+		location       Definition;///< Where has the virtual register been declared (for messages only)
+		reg_t          Reg;       ///< Assigned physical register, only valid if VRegState is VR_ASSIGNED.
+		vregDef(const string& name, const location& loc) : Name(name), Definition(loc), Reg() {}
+	};
+	/// State of the virtual register allocation.
+	enum vregState : unsigned char
+	{	VR_PLACEHOLDER       ///< Virtual registers evaluate to placeholders, i.e. pass 1 or allocation failed.
+	,	VR_RECORD            ///< Pass 2 with placeholders to record the register usage, messages are suppressed.
+	,	VR_ASSIGNED          ///< Virtual registers evaluate to the assigned physical registers.
+	};
 	/// @brief Function lookup table.
 	/// @details The key is the function name, the value is the function definition.
 	typedef unordered_map<string,function> funcs_t;
@@ -214,11 +272,71 @@ class Parser : private AssembleInst, public DebugInfo
 	{	const contextType Type;   ///< Type of this context.
 		consts_t       Consts;    ///< Constants (.set)
 		/// Create a new invocation context.
-		fileContext(contextType type, uint16_t file, uint16_t line) : Type(type) { File = file; Line = line; }
+		fileContext(contextType type, uint16_t file, uint32_t line) : Type(type) { File = file; Line = line; }
+	};
+	/// @brief Step of a compiled expression.
+	/// @details A compiled expression is a sequence of Eval operations that can be replayed
+	/// without parsing the source code again. The only variable is an integer index.
+	struct exprStep
+	{	/// Kind of step
+		enum kind : unsigned char
+		{	VALUE          ///< Push Value
+		,	INDEX          ///< Push the current index as integer value
+		,	OPERATOR       ///< Push operator Op
+		}              Kind;
+		Eval::mathOp   Op;        ///< Operator for OPERATOR
+		exprValue      Value;     ///< Value for VALUE
+		exprStep(kind k) : Kind(k), Op(Eval::BRO) {}
+		exprStep(Eval::mathOp op) : Kind(OPERATOR), Op(op) {}
+		exprStep(const exprValue& value) : Kind(VALUE), Op(Eval::BRO), Value(value) {}
 	};
 	/// Call stack of file invocations. The innermost context is the last entry.
 	/// The containers owns the context instances exclusively.
 	typedef vector<unique_ptr<fileContext>> contexts_t;
+	/// @brief Constant lookup of a macro expansion that has been resolved outside the macro context.
+	/// @details The cached expansion is only valid as long as the lookup gives the same result.
+	struct constDep
+	{	string         Name;      ///< Identifier name.
+		bool           Defined;   ///< The identifier has been found at all.
+		exprValue      Value;     ///< Value of the identifier if Defined.
+		constDep(const string& name, const exprValue* value) : Name(name), Defined(value != NULL) { if (value) Value = *value; }
+	};
+	/// @brief Cached result of a macro invocation.
+	/// @details The entry is valid for invocations with the same argument values and entry flags
+	/// as long as all dependencies evaluate to the same values.
+	struct expansion
+	{	vector<exprValue> Args;   ///< Argument values of the invocation.
+		instFlags      EntryFlags;///< Flags before the invocation.
+		instFlags      ExitFlags; ///< Flags after the invocation.
+		vector<constDep> Deps;    ///< External constant lookups.
+		vector<uint64_t> Code;    ///< Generated instruction words.
+		vector<instFlags> CodeFlags;///< Flags of the generated instruction words.
+		vector<location> Lines;   ///< Source locations of the generated instruction words.
+		vector<string> Text;      ///< Entries for LineForInstruction, pass 2 only.
+		vector<RegAlloc::inst> Usage;///< Register usage of the generated instruction words, VR_RECORD only.
+	};
+	/// @brief Macro expansion cache.
+	/// @details The key is the macro definition, the value the list of cached invocations.
+	typedef unordered_map<const macro*,vector<expansion>> expansions_t;
+	/// State of a macro invocation or expression that is currently recorded for the expansion or folding cache.
+	struct recording
+	{	size_t         Base;      ///< Index of the macro context in Context. Lookups into lower contexts are dependencies.
+		unsigned       Start;     ///< PC at the start of the invocation.
+		bool           Tainted;   ///< The invocation has side effects or depends on the location and cannot be cached.
+		bool           Expression;///< Recording of an expression for \ref Folded.
+		vector<constDep> Deps;    ///< External constant lookups so far.
+		recording(size_t base, unsigned start, bool expression = false) : Base(base), Start(start), Tainted(false), Expression(expression) {}
+	};
+	/// @brief Cached value of an expression.
+	/// @details The entry is valid as long as all dependencies evaluate to the same values.
+	struct folded
+	{	size_t         Length;    ///< Number of characters consumed by the expression.
+		exprValue      Value;     ///< Expression value.
+		vector<constDep> Deps;    ///< Constant lookups.
+	};
+	/// @brief Expression folding cache.
+	/// @details The key is the source text of the expression.
+	typedef unordered_map<string,folded> foldings_t;
 	/// RAII class to enter a deeper file context.
 	class saveContext
 	{protected:
@@ -259,6 +377,8 @@ class Parser : private AssembleInst, public DebugInfo
  private: // items valid per expression...
 	/// Current expression.
 	exprValue        ExprValue;
+	/// Storage for evaluation stacks of deeply nested expressions, shared by all Eval instances.
+	Eval::arena      EvalArena;
  private: // items valid per QPU instruction word...
 	/// Current program counter in GPU words. Relative to the start of the assembly.
 	unsigned         PC;
@@ -266,6 +386,14 @@ class Parser : private AssembleInst, public DebugInfo
 	/// @details Only valid for data directives since instruction words must always start on a 64 bit boundary.
 	/// A non-zero value implies that the instruction slot at PC already has been allocated.
 	unsigned         BitOffset;
+	/// Streaming mode: do not remove instructions at this PC or above from \ref Instructions.
+	unsigned         Pinned = UINT_MAX;
+	/// Progress of finishCode.
+	struct
+	{	unsigned       PC;        ///< Next instruction to finish.
+		size_t         Segment;   ///< Index of the current entry in Segments.
+		bool           AutoCode;  ///< The current segment has been created by automatic code detection.
+	}                Finished;
 
  private: // context
 	/// Points to an entry of \ref Macros if we are currently inside a macro definition block. NULL otherwise.
@@ -308,9 +436,32 @@ class Parser : private AssembleInst, public DebugInfo
 	/// @remarks The flags are kept in a separate array to keep the Instructions array a binary blob that can directly be written to disk.
 	vector_safe<instFlags,IF_NONE> InstFlags;
 
+	/// Cached macro invocations. Cleared whenever a macro or function is (re)defined.
+	expansions_t     Expansions;
+	/// Macro invocations that are currently recorded, the innermost is the last entry.
+	vector<recording*> Recordings;
+	/// Cached values of expressions with functions or per QPU element constants.
+	/// Cleared whenever a macro or function is (re)defined.
+	foldings_t       Folded;
+	/// Lookup key for \ref Folded, kept to avoid allocations.
+	string           FoldKey;
+	/// Virtual registers by ID (= vector index) in order of declaration.
+	vector<vregDef>  VRegs;
+	/// Next virtual register ID in the current pass.
+	unsigned         VRegCount = 0;
+	/// State of the virtual register allocation.
+	vregState        VRegState = VR_PLACEHOLDER;
+	/// Register allocator for virtual registers, receives the register usage during VR_RECORD.
+	RegAlloc         Allocator;
+	/// @brief Number of label values that have not been consumed by a relative branch, .global or .clone.
+	/// @details Any other use, e.g. label arithmetic, data or \c ldi of a label,
+	/// as well as alignment makes the code depend on its location.
+	/// The optimizer must not move instructions in this case.
+	unsigned         PositionDependent = 0;
+
  private:
 	/// Get name of file ID.
-	const char*      fName(uint16_t file) { return SourceFiles[file].Name.c_str(); }
+	const char*      fName(unsigned file) { return SourceFiles[file].Name.c_str(); }
 	/// Enrich an assembler message with file and line context including the context stack.
 	string           enrichMsg(string msg);
 	/// Enrich the formatted message and throws the result as std::string.
@@ -324,11 +475,54 @@ class Parser : private AssembleInst, public DebugInfo
 	/// @param fmt printf like format string.
 	virtual void     Msg(severity level, const char* fmt, ...) PRINTFATTR(3);
 
+	/// @brief Mark the currently recorded macro invocations as not cacheable.
+	/// @param depth Only invocations whose macro context is deeper than the context index \a depth are affected.
+	/// The default affects all recordings.
+	void             taintExpansions(size_t depth = 0);
+	/// @brief Look up a constant in the current context stack.
+	/// @details The lookup is recorded as dependency of all macro invocations that are currently recorded
+	/// if the name does not resolve within their own context.
+	/// @param name Identifier name.
+	/// @return Constant definition or NULL if the identifier is not defined.
+	const constDef*  findConst(const string& name);
 	/// Ensure minimum size of InstFlags array.
+	/// @param min PC behind the last instruction that needs flags.
 	void             FlagsSize(size_t min);
 	/// Store instruction word and take care of .back block if any.
 	/// @param value Instruction to store.
 	void             StoreInstruction(uint64_t value);
+	/// @brief Copy the code generated since \a start.
+	/// @param e [out] Receives the instruction words, flags, locations and listing lines.
+	/// @param start First instruction to copy.
+	/// @param lines Size of LineForInstruction at \a start.
+	void             saveCode(expansion& e, unsigned start, size_t lines);
+	/// Append the code saved by saveCode at the current PC.
+	void             storeCode(const expansion& e);
+	/// @brief Optimize instructions and identify code segments automatically.
+	/// @details The function continues where the last call stopped.
+	/// @param end PC behind the last instruction to finish.
+	void             finishCode(unsigned end);
+	/// Store \ref Usage of the current instruction for the register allocator.
+	/// @param pc Location of the instruction.
+	void             recordUsage(unsigned pc);
+	/// Restore \ref Usage of a previous instruction to provide combine support.
+	/// @param pc Location of the instruction.
+	void             restoreUsage(unsigned pc);
+	/// @brief Assign physical registers to the virtual registers.
+	/// @details The function uses the register usage recorded during VR_RECORD
+	/// and enters VR_ASSIGNED on success.
+	void             allocateVRegs();
+	/// @brief Parse all source files in pass 2.
+	/// @details The function is invoked twice if there are virtual registers.
+	void             parsePass2();
+	/// @brief Run the optimizer passes selected by \ref Optimize on the entire code.
+	/// @details The function updates the labels, segments and global symbols to the new locations.
+	/// @pre Pass 2 completed, no streaming mode.
+	void             optimizeCode();
+	/// @brief Streaming mode: pass finished instructions to \ref Streaming and remove them from \ref Instructions.
+	/// @details Instructions are finished if neither a \c .back block nor a combined instruction can reach them any more.
+	/// The function does nothing if not in streaming mode or if there are only a few finished instructions.
+	void             flushCode();
 
 	/// Move At to the next non whitespace character or the end of the line.
 	/// @post At points to non whitespace character or 0 in case of line end.
@@ -359,6 +553,9 @@ class Parser : private AssembleInst, public DebugInfo
 	/// \see At is after the closing square brace.
 	/// @exception std::string Syntax error.
 	void             parseRegister();
+	/// Parse the numeric literal in \ref Token into \ref ExprValue.
+	/// @exception std::string Syntax error.
+	void             parseNUM();
 	/// @brief Parse any expression and return its value.
 	/// @details The parser will eat any expression and read until the next token cannot be part of the expression.
 	/// It stops e.g. at a closing brace that is not opened within this function call.
@@ -371,7 +568,26 @@ class Parser : private AssembleInst, public DebugInfo
 	/// @par NextToken does not return WORD, COLON, OP, BRACE1, SQBRC1 or NUM on the next invocation.
 	/// I.e. only END, BRACE2, SQBRC2, COMMA and SEMI are left.
 	/// @exception std::string Syntax error.
+	/// @remarks Expressions with function calls or per QPU element constants are served from \ref Folded
+	/// if the same source text has been evaluated before and the referenced constants did not change.
 	void             ParseExpression();
+	/// @brief Length of the source text of the expression at \a src.
+	/// @details The text ends before the first ',', ';' or ')' or ']' without matching opening brace
+	/// or at the end of the line.
+	/// @return Length of the text or 0 if the expression is not worth caching.
+	static size_t    foldableLength(const char* src);
+	/// Evaluate an expression without the folding cache, see ParseExpression.
+	void             evaluateExpression();
+	/// @brief Compile an expression with an integer index variable.
+	/// @details The function works like ParseExpression but it records the operations
+	/// into \a prog. Constants are resolved immediately, the identifier \a index evaluates to 0.
+	/// @param index Name of the index variable.
+	/// @param prog [out] Compiled expression. Only valid if the function returns true.
+	/// @return false: the expression cannot be compiled because it contains functions, labels
+	/// or instruction extensions. The parser position is undefined in this case.
+	/// @post ExprValue is assigned the expression value for index 0.
+	/// @exception std::string Syntax error.
+	bool             compileExpression(const string& index, vector<exprStep>& prog);
 	/// @brief Count the number of Arguments
 	/// @param rem Remaining text in the line, usually At.
 	/// @param max Scan for at most \a max arguments.
@@ -490,10 +706,25 @@ class Parser : private AssembleInst, public DebugInfo
 	// directives
 	/// @brief Handle .global
 	void             parseGLOBAL(int);
+	/// Store the value of \ref ExprValue as raw data.
+	/// @param bits Number of bits. Negative values are IEEE 754 floating point types.
+	/// @param alignment [in,out] Alignment check state, initially 0. Avoids repeated warnings.
+	/// @exception std::string Failed, error message.
+	void             doDATA(int bits, int& alignment);
 	/// Handle raw data directives like \c .byte.
 	/// @param bits Number of bits. Negative values are IEEE 754 floating point types.
 	/// @exception std::string Failed, error message.
 	void             parseDATA(int bits);
+	/// @brief Handle \c .incbin directive.
+	/// @details The function copies the content of a binary file into the instruction stream
+	/// and marks the range as data segment.
+	/// @exception std::string Failed, error message.
+	void             parseINCBIN(int);
+	/// @brief Handle \c .table directive.
+	/// @details The function evaluates an expression for each index in a range and stores
+	/// the results like a data directive. The expression is compiled once if possible.
+	/// @exception std::string Failed, error message.
+	void             parseTABLE(int);
 	/// Handle .align.
 	/// @param bytes Bytes to align. 1 = byte alignment, 8 = 64 bit alignment etc.
 	/// Must be a power of 2 or -1 for parsing an alignment argument.
@@ -520,6 +751,21 @@ class Parser : private AssembleInst, public DebugInfo
 	/// @details This completes the .rep/.foreach macro and invokes it immediately the requested number of times.
 	/// @exception std::string Failed, error message.
 	void             endREP(int node);
+	/// @brief Check whether source code is independent of a loop variable.
+	/// @details The check is conservative. It fails if the text refers to \a index, macros
+	/// or functional macros, including indirect references through functions.
+	/// @param cp Source text, e.g. a line of a macro body.
+	/// @param index Name of the loop variable.
+	/// @param depth Maximum nesting level of functions to check.
+	/// @return true: the text evaluates to the same result regardless of the loop variable.
+	bool             isInvariantText(const char* cp, const string& index, int depth);
+	/// @brief Check whether the body of a \c .rep block generates the same code in each loop cycle.
+	/// @details This is a precondition for endREP to replicate the code of the first loop cycle.
+	/// Directives, references to the loop variable and macros are not allowed.
+	/// The generated code must be checked for label definitions and branches additionally.
+	/// @param m The \c .rep block.
+	/// @return true: the body is candidate for replication.
+	bool             isInvariantBody(const macro& m);
 	/// @brief Handle \c .back directive.
 	/// @details This function basically sets the \ref Back member to a specific value.
 	/// @exception std::string Failed, error message.
@@ -537,6 +783,17 @@ class Parser : private AssembleInst, public DebugInfo
 	/// @param flags Directive type, must be of type defFlags.
 	/// @exception std::string Failed, error message.
 	void             parseSET(int flags);
+	/// @brief Handle \c .vreg directive.
+	/// @details The function declares one or more virtual registers.
+	/// Their names evaluate to placeholders until the register allocation has been done
+	/// and to the assigned physical register afterwards.
+	/// @param flags Directive type, C_NONE or C_LOCAL.
+	/// @exception std::string Failed, error message.
+	void             parseVREG(int flags);
+	/// @brief Handle \c .pipeline directive.
+	/// @details The function marks the next instruction as start of a loop for the optimizer pass \c pipeline.
+	/// @exception std::string Failed, error message.
+	void             parsePIPELINE(int);
 	/// @brief Handle directives to remove constants or inline functions, e.g. \c .unset.
 	/// @param flags Directive type, must be of type defFlags.
 	/// @exception std::string Failed, error message.
@@ -588,6 +845,18 @@ class Parser : private AssembleInst, public DebugInfo
 	/// This is an iterator to an entry in \ref Macros to get access to the macro name for error messages too.
 	/// @exception std::string Failed, error message.
 	void             doMACRO(macros_t::const_iterator m);
+	/// @brief Try to replay a macro invocation from the expansion cache.
+	/// @param m The macro to invoke.
+	/// @param args Argument values.
+	/// @return true: the cached code has been stored at the current PC.
+	bool             replayMACRO(const macro& m, const vector<exprValue>& args);
+	/// @brief Store the result of a macro invocation into the expansion cache.
+	/// @param m The invoked macro.
+	/// @param args Argument values.
+	/// @param rec Recording of the invocation.
+	/// @param entryFlags Flags before the invocation.
+	/// @param lines Size of LineForInstruction before the invocation.
+	void             cacheMACRO(const macro& m, const vector<exprValue>& args, recording& rec, instFlags entryFlags, size_t lines);
 	/// @brief Invoke a functional macro defined by \c .func.
 	/// @details It reads the optional macro arguments and invokes the function.
 	/// @par Executing a function macro also creates a new invocation context.
@@ -608,9 +877,21 @@ class Parser : private AssembleInst, public DebugInfo
 	/// @post ExprValue receives the value to which the function evaluated after passing arguments.
 	/// @exception std::string Failed, error message.
 	void             doFUNC(funcs_t::const_iterator f);
+	/// Change the segment flags starting at \a pc.
+	/// @param pc First instruction with the new flags.
+	/// @param flags see \ref SegFlags.
+	/// @return Previous flags at \a pc.
+	uint8_t          setSegment(unsigned pc, uint8_t flags);
 	/// Handle code segment directive
 	/// @param flags see \ref SegFlags.
 	void             doSEGMENT(int flags);
+	/// @brief Parse file name argument of a directive and locate the file.
+	/// @details The file name is either "relative-to-current-file" or <searched-in-include-paths>.
+	/// @param directive Directive name for error messages.
+	/// @return Path of the file.
+	/// @post At points behind the file name.
+	/// @exception std::string Syntax error or the file does not exist.
+	string           parseFileName(const char* directive);
 	/// Handle \c .include directive.
 	/// @details The Function reads the file name and immediately invokes the parser for this file.
 	/// @par This creates a new invocation context.
@@ -664,6 +945,11 @@ class Parser : private AssembleInst, public DebugInfo
 	/// This function switches to pass 2 after pass 1, i.e. ParseFile, has completed.
 	/// @post This call ensures the validity of Instructions, GlobalSymbolsByName and DebugInfo.
 	void             EnsurePass2();
+	/// @brief Split a source line into tokens without parsing it.
+	/// @details This runs the lexer only, e.g. for benchmarks. The parser state is not changed otherwise.
+	/// @param line Source line, longer lines are truncated to the size of the line buffer.
+	/// @return Number of tokens.
+	unsigned         Tokenize(const char* line);
 
 	/// Return reference on labels.
 	const labels_t   getLabels() const{
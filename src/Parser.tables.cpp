@@ -575,7 +575,7 @@ const Parser::opExtEntry Parser::extMap[] =
 ,	{ "zs",             IC_DST,              &Parser::addIf,   ::Inst::C_ZS }
 };
 
-const Parser::opEntry<8> Parser::directiveMap[] =
+const Parser::opEntry<12> Parser::directiveMap[] =
 {	{ "align",   &Parser::parseALIGN, -1 }
 ,	{ "assert",  &Parser::parseASSERT }
 ,	{ "back",    &Parser::beginBACK }
@@ -611,6 +611,7 @@ const Parser::opEntry<8> Parser::directiveMap[] =
 ,	{ "half",    &Parser::parseDATA,  -16 }
 ,	{ "if",      &Parser::parseIF }
 ,	{ "ifset",   &Parser::parseIFSET, C_NONE }
+,	{ "incbin",  &Parser::parseINCBIN }
 ,	{ "include", &Parser::doINCLUDE }
 ,	{ "int",     &Parser::parseDATA,  32 }
 ,	{ "int1",    &Parser::parseDATA,  1 }
@@ -625,14 +626,18 @@ const Parser::opEntry<8> Parser::directiveMap[] =
 ,	{ "long",    &Parser::parseDATA,  64 }
 ,	{ "lset",    &Parser::parseSET,   C_LOCAL }
 ,	{ "lunset",  &Parser::parseUNSET, C_LOCAL }
+,	{ "lvreg",   &Parser::parseVREG,  C_LOCAL }
 ,	{ "macro",   &Parser::beginMACRO, M_NONE }
+,	{ "pipeline", &Parser::parsePIPELINE }
 ,	{ "qword",   &Parser::parseDATA,  64 }
 ,	{ "rep",     &Parser::beginREP,   0 }
 ,	{ "rodata",  &Parser::doSEGMENT,  SF_Data }
 ,	{ "set",     &Parser::parseSET,   C_NONE }
 ,	{ "short",   &Parser::parseDATA,  16 }
+,	{ "table",   &Parser::parseTABLE }
 ,	{ "text",    &Parser::doSEGMENT,  SF_Code }
 ,	{ "undef",   &Parser::parseUNSET, C_NONE }
 ,	{ "unset",   &Parser::parseUNSET, C_NONE }
+,	{ "vreg",    &Parser::parseVREG,  C_NONE }
 ,	{ "word",    &Parser::parseDATA,  16 }
 };
@@ -0,0 +1,254 @@
+/*
+ * RegAlloc.cpp
+ *
+ *  Created on: 19.10.2026
+ *      Author: mueller
+ */
+
+#include "RegAlloc.h"
+
+#include <algorithm>
+
+
+unsigned RegAlloc::count(const vset& s, unsigned n)
+{	unsigned ret = 0;
+	for (unsigned i = 0; i < n; ++i)
+		ret += test(s, i);
+	return ret;
+}
+
+void RegAlloc::successors(unsigned pc, const vector<unsigned>& entries, vector<unsigned>& succ) const
+{	succ.clear();
+	bool fallthrough = true;
+	// A branch takes effect after its 3 delay slots.
+	if (pc >= 3 && Code[pc-3].Branch)
+	{	const inst& br = Code[pc-3];
+		if (br.Indirect)
+			succ.insert(succ.end(), entries.begin(), entries.end());
+		else if (br.Target < Code.size())
+			succ.push_back(br.Target);
+		fallthrough = br.CondBr;
+	}
+	if (fallthrough && pc + 1 < Code.size())
+		succ.push_back(pc + 1);
+}
+
+void RegAlloc::liveness()
+{	const unsigned n = Code.size();
+	// Targets of indirect branches: labels and return addresses.
+	vector<unsigned> entries;
+	for (unsigned pc = 0; pc < n; ++pc)
+	{	if (Code[pc].Entry)
+			entries.push_back(pc);
+		if (Code[pc].Link && pc + 4 < n)
+			entries.push_back(pc + 4);
+	}
+	vector<vector<unsigned>> succ(n);
+	vector<vset> use(n, vset(Words)), def(n, vset(Words));
+	for (unsigned pc = 0; pc < n; ++pc)
+	{	successors(pc, entries, succ[pc]);
+		for (const access& a : Code[pc].Access)
+			if (!a.Write)
+				set(use[pc], index(a.VReg));
+			else if (!a.Cond)
+				set(def[pc], index(a.VReg));
+	}
+
+	LiveIn.assign(n, vset(Words));
+	LiveOut.assign(n, vset(Words));
+	bool changed;
+	do
+	{	changed = false;
+		for (unsigned pc = n; pc-- > 0; )
+		{	vset& out = LiveOut[pc];
+			for (unsigned s : succ[pc])
+				for (size_t w = 0; w < Words; ++w)
+					out[w] |= LiveIn[s][w];
+			vset& in = LiveIn[pc];
+			for (size_t w = 0; w < Words; ++w)
+			{	uint64_t v = use[pc][w] | (out[w] & ~def[pc][w]);
+				if (v != in[w])
+				{	in[w] = v;
+					changed = true;
+				}
+			}
+		}
+	} while (changed);
+}
+
+bool RegAlloc::fits(unsigned pc, unsigned vreg, regClass cls) const
+{	const inst& i = Code[pc];
+	unsigned a = !!(i.Read & RC_A);
+	unsigned b = !!(i.Read & RC_B);
+	unsigned any = 0;
+	for (uint32_t r = i.ReadAB; r; r &= r - 1)
+		++any;
+	regClass add = i.WriteAdd;
+	regClass mul = i.WriteMul;
+	for (const access& ac : i.Access)
+	{	if (ac.VReg >= Count)
+			continue;
+		regClass c = ac.VReg == vreg ? cls : Regs[ac.VReg].Class;
+		if (c == RC_ACC)
+			continue;
+		if (ac.Write)
+			(ac.Mul ? mul : add) = c;
+		else if (c == RC_A)
+			++a;
+		else if (c == RC_B)
+			++b;
+	}
+	// Only one register per register file can be read and the ALUs must write to different register files.
+	return a <= 1 && b <= 1 && a + b + any <= 2
+		&& !(add != RC_NONE && add == mul);
+}
+
+int RegAlloc::freeReg(unsigned vreg, regClass cls) const
+{	uint32_t taken = 0;
+	int limit = 32;
+	switch (cls)
+	{case RC_ACC:
+		for (unsigned k = 0; k < 4; ++k)
+			if (test(Interfere[vreg], Count + k))
+				taken |= 1 << k;
+		limit = 4;
+		break;
+	 case RC_A:
+		taken = UsedA; break;
+	 case RC_B:
+		taken = UsedB; break;
+	 default:
+		return -1;
+	}
+	for (unsigned u = 0; u < Count; ++u)
+		if (Regs[u].Class == cls && test(Interfere[vreg], u))
+			taken |= 1 << Regs[u].Num;
+	for (int n = 0; n < limit; ++n)
+		if (!(taken & (1 << n)))
+			return n;
+	return -1;
+}
+
+void RegAlloc::Run()
+{	const unsigned n = Code.size();
+	const unsigned total = Count + 4;
+	Words = (total + 63) / 64;
+	Regs.assign(Count, reg{RC_NONE, 0});
+	Delayed.clear();
+	if (!Count)
+		return;
+
+	UsedA = UsedB = 0;
+	Uses.assign(Count, vector<unsigned>());
+	for (unsigned pc = 0; pc < n; ++pc)
+	{	const inst& i = Code[pc];
+		UsedA |= i.UsedA;
+		UsedB |= i.UsedB;
+		for (const access& a : i.Access)
+			if (a.VReg < Count && (Uses[a.VReg].empty() || Uses[a.VReg].back() != pc))
+				Uses[a.VReg].push_back(pc);
+	}
+
+	liveness();
+
+	// Registers that are live at the same time or written while another one is live interfere.
+	Interfere.assign(total, vset(Words));
+	vset s(Words);
+	auto addClique = [this, total](const vset& live)
+	{	for (unsigned i = 0; i < total; ++i)
+			if (test(live, i))
+				for (size_t w = 0; w < Words; ++w)
+					Interfere[i][w] |= live[w];
+	};
+	for (unsigned pc = 0; pc < n; ++pc)
+	{	s = LiveOut[pc];
+		for (const access& a : Code[pc].Access)
+			if (a.Write)
+				set(s, index(a.VReg));
+		addClique(s);
+		addClique(LiveIn[pc]);
+	}
+
+	// Accumulators do not survive a thread switch, which takes effect after its 2 delay slots.
+	vset switched(Words);
+	for (unsigned pc = 0; pc + 2 < n; ++pc)
+		if (Code[pc].Thrsw)
+			for (size_t w = 0; w < Words; ++w)
+				switched[w] |= LiveOut[pc + 2][w];
+
+	// Assign registers in order of the first use.
+	vector<unsigned> order;
+	for (unsigned v = 0; v < Count; ++v)
+		if (Uses[v].size())
+			order.push_back(v);
+	stable_sort(order.begin(), order.end(), [this](unsigned l, unsigned r) { return Uses[l].front() < Uses[r].front(); });
+
+	unsigned files[2] = { 0, 0 }; // number of virtual registers in register file A and B
+	for (unsigned v : order)
+	{	regClass allowed = test(switched, v) ? RC_AB : RC_ALL;
+		bool needacc = false;
+		for (unsigned pc : Uses[v])
+			for (const access& a : Code[pc].Access)
+				if (a.VReg == v)
+				{	allowed &= a.Allowed;
+					// Read immediately after write requires an accumulator.
+					if (a.Write && pc + 1 < n)
+						for (const access& a2 : Code[pc+1].Access)
+							needacc |= a2.VReg == v && !a2.Write;
+				}
+
+		regClass first = files[1] < files[0] ? RC_B : RC_A;
+		regClass second = first == RC_A ? RC_B : RC_A;
+		const regClass classes[3] =
+		{	needacc ? RC_ACC : first
+		,	needacc ? first : second
+		,	needacc ? second : RC_ACC
+		};
+		unsigned badpc = UINT_MAX;
+		bool full = false;
+		for (regClass cls : classes)
+		{	if (!(allowed & cls))
+				continue;
+			for (unsigned pc : Uses[v])
+				if (!fits(pc, v, cls))
+				{	badpc = pc;
+					goto next;
+				}
+			{	int num = freeReg(v, cls);
+				if (num >= 0)
+				{	Regs[v].Class = cls;
+					Regs[v].Num = (uint8_t)num;
+					if (cls != RC_ACC)
+						++files[cls == RC_B];
+					else
+						needacc = false;
+					goto done;
+				}
+				full = true;
+			}
+		 next:;
+		}
+		// No register left
+		{	error err = { v, badpc, 0 };
+			if (full || badpc == UINT_MAX)
+			{	// report the instruction with the highest register pressure
+				err.PC = Uses[v].front();
+				for (unsigned pc = 0; pc < n; ++pc)
+				{	if (!test(LiveIn[pc], v) && !test(LiveOut[pc], v))
+						continue;
+					unsigned live = count(LiveIn[pc], Count);
+					if (live > err.Live)
+					{	err.PC = pc;
+						err.Live = live;
+					}
+				}
+				if (!err.Live)
+					err.Live = 1;
+			}
+			throw err;
+		}
+	 done:
+		if (needacc)
+			Delayed.push_back(v);
+	}
+}
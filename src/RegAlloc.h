@@ -0,0 +1,143 @@
+/*
+ * RegAlloc.h
+ *
+ *  Created on: 19.10.2026
+ *      Author: mueller
+ */
+
+#ifndef REGALLOC_H_
+#define REGALLOC_H_
+
+#include "utils.h"
+
+#include <vector>
+#include <cstdint>
+#include <climits>
+
+using namespace std;
+
+
+/// @brief Allocator for virtual registers declared by \c .vreg.
+/// @details The allocator works on the register usage of the instruction words of the entire program
+/// that has been recorded by an assembly run with placeholder registers.
+/// The life time of the virtual registers is computed from the control flow
+/// including branches and their delay slots.
+/// Virtual registers read by the same instruction are assigned to different register files
+/// to use both read ports of the instruction.
+/// Accumulators are used if a value is read immediately after it has been written
+/// or if the register files are exhausted.
+/// Virtual registers that are live across a thread switch never get an accumulator.
+class RegAlloc
+{public:
+	/// Register class, bit vector
+	enum regClass : unsigned char
+	{	RC_NONE    = 0 ///< No register can handle the access.
+	,	RC_ACC     = 1 ///< Accumulators r0..r3
+	,	RC_A       = 2 ///< Register file A
+	,	RC_B       = 4 ///< Register file B
+	,	RC_AB      = 6 ///< Any register file
+	,	RC_ALL     = 7 ///< Any register
+	};
+	CLASSFLAGSENUM(regClass, unsigned char);
+	/// access::VReg of a physical accumulator r0, r1..r3 follow.
+	enum : unsigned { ACC = UINT_MAX - 3 };
+	/// Access of an instruction to a virtual register.
+	struct access
+	{	unsigned       VReg;   ///< ID of the virtual register or ACC + n for accumulator rn.
+		bool           Write;  ///< Write access, otherwise read access.
+		bool           Mul;    ///< Write access of the MUL ALU.
+		bool           Cond;   ///< Conditional write, i.e. the previous value might survive.
+		regClass       Allowed;///< Registers that can handle this access.
+	};
+	/// Register usage of one instruction word.
+	struct inst
+	{	vector<access> Access; ///< Access to virtual registers.
+		uint32_t       UsedA;  ///< Physical registers of register file A accessed by the instruction.
+		uint32_t       UsedB;  ///< Physical registers of register file B accessed by the instruction.
+		uint32_t       ReadAB; ///< Peripheral registers 32..63 read by any register file, bit n-32.
+		regClass       Read;   ///< Read ports occupied by physical registers or the small immediate value.
+		regClass       WriteAdd;///< Register file of the physical ADD ALU target if it depends on WS.
+		regClass       WriteMul;///< Register file of the physical MUL ALU target if it depends on WS.
+		bool           Entry;  ///< The instruction is a branch target.
+		bool           Branch; ///< The instruction is a branch.
+		bool           CondBr; ///< Conditional branch.
+		bool           Link;   ///< The branch writes the return address.
+		bool           Indirect;///< The branch target depends on a register.
+		unsigned       Target; ///< Branch target, PC in instructions.
+		bool           Thrsw;  ///< The instruction signals a thread switch, thrsw or lthrsw.
+		inst() { clear(); }
+		void           clear() { Access.clear(); UsedA = UsedB = ReadAB = 0; Read = WriteAdd = WriteMul = RC_NONE; Entry = Branch = CondBr = Link = Indirect = Thrsw = false; Target = 0; }
+	};
+	/// Register assigned to a virtual register.
+	struct reg
+	{	regClass       Class;  ///< RC_ACC, RC_A or RC_B.
+		uint8_t        Num;    ///< Register number, 0..3 for accumulators.
+	};
+	/// @brief Allocation failure.
+	/// @details Thrown by Run if no register is left for a virtual register.
+	struct error
+	{	unsigned       VReg;   ///< ID of the virtual register.
+		unsigned       PC;     ///< Instruction with the most live virtual registers in the life time of VReg
+		                       ///< or instruction that cannot be encoded with any of the remaining registers.
+		unsigned       Live;   ///< Number of live virtual registers at PC, 0 if PC cannot be encoded.
+	};
+ public: // Input
+	/// Register usage of the program, index = PC.
+	vector<inst>     Code;
+	/// Number of virtual registers.
+	unsigned         Count = 0;
+ public: // Result
+	/// Assigned register per virtual register.
+	vector<reg>      Regs;
+	/// Virtual registers that are read immediately after write but did not get an accumulator.
+	vector<unsigned> Delayed;
+
+ private: // types...
+	/// Set of virtual registers followed by the accumulators r0..r3, see index().
+	typedef vector<uint64_t> vset;
+ private: // working set
+	/// Number of 64 bit words per vset.
+	size_t           Words;
+	/// Virtual registers and accumulators live at the start of an instruction, index = PC.
+	vector<vset>     LiveIn;
+	/// Virtual registers and accumulators live at the end of an instruction, index = PC.
+	vector<vset>     LiveOut;
+	/// Virtual registers and accumulators that interfere with a virtual register or accumulator, index see index().
+	vector<vset>     Interfere;
+	/// PC of each read or write of a virtual register, index = VReg.
+	vector<vector<unsigned>> Uses;
+	/// Physical registers of register file A and B used anywhere in the program.
+	uint32_t         UsedA, UsedB;
+
+ private:
+	static bool      test(const vset& s, unsigned i) { return (s[i >> 6] >> (i & 63)) & 1; }
+	static void      set(vset& s, unsigned i)        { s[i >> 6] |= 1ULL << (i & 63); }
+	/// Number of elements below \a n in \a s.
+	static unsigned  count(const vset& s, unsigned n);
+	/// Bit index of an access::VReg in a vset.
+	unsigned         index(unsigned vreg) const { return vreg >= ACC ? Count + vreg - ACC : vreg; }
+	/// Get the successors of an instruction in the control flow.
+	/// @param pc Instruction.
+	/// @param entries Targets of indirect branches.
+	/// @param succ [out] Successors.
+	void             successors(unsigned pc, const vector<unsigned>& entries, vector<unsigned>& succ) const;
+	/// Compute LiveIn and LiveOut by iterative data flow analysis.
+	void             liveness();
+	/// Check the read ports and the write targets of an instruction with the current assignments.
+	/// @param pc Instruction.
+	/// @param vreg Virtual register to check.
+	/// @param cls Register class to check for \a vreg.
+	/// @return true: the instruction can be encoded.
+	bool             fits(unsigned pc, unsigned vreg, regClass cls) const;
+	/// Find a free register of a class for a virtual register.
+	/// @return Register number or -1 if none is available.
+	int              freeReg(unsigned vreg, regClass cls) const;
+ public:
+	/// @brief Assign registers to all virtual registers.
+	/// @pre Code and Count are initialized.
+	/// @post Regs contains the assignment.
+	/// @exception error No register left for a virtual register.
+	void             Run();
+};
+
+#endif // REGALLOC_H_
@@ -105,10 +105,43 @@ const Elf32_Sym WriteELF::Sym0 = {0};
 WriteELF::WriteELF()
 :	Target(NULL)
 ,	NoStandardSymbols(false)
+,	CodeSize(0)
 {	Symbols.emplace_back(Sym0);
 }
 
 void WriteELF::Write(const vector<uint64_t>& instructions, const DebugInfo& info, const char* filename)
+{
+	CodeSize = instructions.size() * sizeof (uint64_t);
+	AddSymbols(info, filename);
+	WriteHeaders();
+	// write code
+	fwrite(&instructions.front(), sizeof(uint64_t), instructions.size(), Target);
+	WriteSymbols();
+}
+
+void WriteELF::Begin()
+{
+	CodeSize = 0;
+	WriteHeaders();
+}
+
+void WriteELF::WriteCode(const uint64_t* code, size_t count)
+{
+	fwrite(code, sizeof(uint64_t), count, Target);
+	CodeSize += count * sizeof(uint64_t);
+}
+
+void WriteELF::End(const DebugInfo& info, const char* filename)
+{
+	AddSymbols(info, filename);
+	WriteSymbols();
+	// patch headers
+	fseek(Target, 0, SEEK_SET);
+	WriteHeaders();
+	fseek(Target, 0, SEEK_END);
+}
+
+void WriteELF::AddSymbols(const DebugInfo& info, const char* filename)
 {
 	// File name symbol
 	{	auto& sym = AddSymbol(filename);
@@ -116,8 +149,6 @@ void WriteELF::Write(const vector<uint64_t>& instructions, const DebugInfo& info
 		sym.st_shndx = SHN_ABS;
 	}
 
-	size_t code_size = instructions.size() * sizeof (uint64_t);
-
 	// Code fragment symbol, name = file name
 	if (!NoStandardSymbols)
 	{	auto cp = strrchr(filename, '/');
@@ -134,16 +165,16 @@ void WriteELF::Write(const vector<uint64_t>& instructions, const DebugInfo& info
 		{	if (!isalnum(c))
 				c = '_';
 		}
-		AddGlobalSymbol(name).st_size = code_size;
+		AddGlobalSymbol(name).st_size = CodeSize;
 		// End Symbol
 		name.append("_end");
-		AddGlobalSymbol(name).st_value = code_size;
+		AddGlobalSymbol(name).st_value = CodeSize;
 		// Size symbol
 		name.erase(name.size() - 4, 4);
 		name.append("_size");
 		auto& sym = AddGlobalSymbol(name);
 		sym.st_shndx = SHN_ABS;
-		sym.st_value = code_size;
+		sym.st_value = CodeSize;
 	}
 
 	// Export global symbol table
@@ -153,28 +184,33 @@ void WriteELF::Write(const vector<uint64_t>& instructions, const DebugInfo& info
 		if (sym.second.Type == V_INT)
 			value.st_shndx = SHN_ABS;
 	}
+}
 
+void WriteELF::WriteHeaders()
+{
 	// write header
 	WriteRaw(Hdr);
 	// write section table
 	WriteRaw(Sect0);
 	WriteRaw(SectSNST);
 	Elf32_Shdr sect = SectCode;
-	sect.sh_size = code_size;
+	sect.sh_size = CodeSize;
 	WriteRaw(sect);
 	sect = SectSym;
-	sect.sh_offset += code_size;
+	sect.sh_offset += CodeSize;
 	size_t sym_size = Symbols.size() * sizeof(Elf32_Sym);
 	sect.sh_size = sym_size;
 	WriteRaw(sect);
 	sect = SectSymST;
-	sect.sh_offset += code_size + sym_size;
+	sect.sh_offset += CodeSize + sym_size;
 	sect.sh_size = SymbolNames.size() + 1;
 	WriteRaw(sect);
 	// write section names
 	WriteRaw(SNST);
-	// write code
-	fwrite(&instructions.front(), sizeof(uint64_t), instructions.size(), Target);
+}
+
+void WriteELF::WriteSymbols()
+{
 	// write symbol table
 	fwrite(&Symbols.front(), sizeof(Elf32_Sym), Symbols.size(), Target);
 	// write symbol names
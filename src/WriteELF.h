@@ -24,6 +24,13 @@ class WriteELF
 	bool NoStandardSymbols;
 	WriteELF();
 	void Write(const vector<uint64_t>& instructions, const DebugInfo& info, const char* filename);
+	/// @brief Start incremental output.
+	/// @details Writes the ELF headers with preliminary sizes. Target must be seekable.
+	void Begin();
+	/// Append code after Begin().
+	void WriteCode(const uint64_t* code, size_t count);
+	/// Write the symbol tables after the code and update the ELF headers.
+	void End(const DebugInfo& info, const char* filename);
 
  private: // Templates for ELF creation
 	static const Elf32_Ehdr Hdr;      ///< ELF header
@@ -37,7 +44,11 @@ class WriteELF
  private:
 	vector<Elf32_Sym> Symbols;
 	string            SymbolNames;
+	size_t            CodeSize;
  private:
+	void AddSymbols(const DebugInfo& info, const char* filename);
+	void WriteHeaders();
+	void WriteSymbols();
 	Elf32_Sym& AddSymbol(const string& name);
 	Elf32_Sym& AddGlobalSymbol(const string& name);
 	template<typename T>
@@ -55,7 +55,8 @@ bool operator==(const exprValue& l, const exprValue& r)
 		return l.rValue.Type == r.rValue.Type
 			&& l.rValue.Rotate == r.rValue.Rotate
 			&& l.rValue.Num == r.rValue.Num
-			&& l.rValue.Pack.Mode == r.rValue.Pack.Mode;
+			&& l.rValue.Pack.Mode == r.rValue.Pack.Mode
+			&& l.rValue.Virt == r.rValue.Virt;
 	 default:
 		return l.iValue == r.iValue;
 	}
@@ -68,6 +68,7 @@ struct reg_t
 	regType     Type;  ///< register type
 	int8_t      Rotate;///< QPU element rotation [0..15], 16: >> r5, -16: << r5
 	rPUp        Pack;  ///< Pack/unpack request, see Inst::P_*, bit 6:
+	uint16_t    Virt;  ///< Virtual register ID + 1 if this is a placeholder of a \c .vreg, 0 otherwise.
 };
 /// Type of the expression value
 enum valueType : char
@@ -5,7 +5,9 @@
 #include "WriteELF.h"
 #endif
 #include <cstdio>
+#include <cstring>
 #include <sstream>
+#include <chrono>
 #include <getopt.h>
 
 using namespace std;
@@ -92,6 +94,145 @@ void print_hex(FILE *of, Parser &parser){
 	print_labels(of, tpl, parser, 2*parser.Instructions.size());
 }
 
+/// Write the code to the output files while pass 2 is running (option -S).
+class StreamWriter : public Parser::codeSink
+{public:
+	FILE*       BIN = NULL;
+	FILE*       CPP = NULL;
+	FILE*       CPP2 = NULL;
+#ifdef __linux__
+	WriteELF    ELF;
+	WriteELF    ELF2;
+#endif
+	/// Files opened by Open() that are incomplete so far.
+	vector<pair<FILE*,const char*>> Opened;
+ private:
+	const char* CPPtpl = CPPTemplate + 2; // no ,\n in the first line
+	const char* CPP2tpl = CPPTemplate + 2;
+	static void writeCPP(FILE* of, const char*& tpl, const uint64_t* code, size_t count)
+	{	for (const uint64_t* ep = code + count; code != ep; ++code)
+		{	fprintf(of, tpl, (uint64_t)(*code & 0xffffffffULL), (uint64_t)(*code >> 32) );
+			tpl = CPPTemplate;
+		}
+	}
+ public:
+	/// Open an output file.
+	/// @return File stream or NULL if \a name is NULL.
+	FILE* Open(const char* name, const char* mode)
+	{	FILE* of = NULL;
+		if (name)
+		{	if ((of = fopen(name, mode)) == NULL)
+			{	fprintf(stderr, "Failed to open %s for writing.", name);
+				exit(-1);
+			}
+			Opened.emplace_back(of, name);
+		}
+		return of;
+	}
+	/// Close and remove all incomplete output files in case of errors.
+	void Discard()
+	{	for (auto& file : Opened)
+		{	fclose(file.first);
+			remove(file.second);
+		}
+		Opened.clear();
+	}
+	virtual void Write(const uint64_t* code, size_t count)
+	{	if (BIN)
+			fwrite(code, sizeof(uint64_t), count, BIN);
+		if (CPP)
+			writeCPP(CPP, CPPtpl, code, count);
+		if (CPP2)
+			writeCPP(CPP2, CPP2tpl, code, count);
+#ifdef __linux__
+		if (ELF.Target)
+			ELF.WriteCode(code, count);
+		if (ELF2.Target)
+			ELF2.WriteCode(code, count);
+#endif
+	}
+};
+
+/// Wall clock time of the assembler phases for option -T.
+class PhaseTimer
+{	typedef chrono::steady_clock clock;
+	clock::time_point Start = clock::now();
+ public:
+	/// Phase names and their duration in seconds in order of execution.
+	vector<pair<const char*,double>> Phases;
+	/// Book the time since the last call to the phase \a name.
+	void Stop(const char* name)
+	{	auto now = clock::now();
+		Phases.emplace_back(name, chrono::duration<double>(now - Start).count());
+		Start = now;
+	}
+};
+
+/// Print the report of option -T.
+/// @param of Target stream.
+/// @param timer Phase timing.
+/// @param stats Counters of the parser.
+/// @param json Write JSON rather than human readable text.
+static void printStatistics(FILE* of, const PhaseTimer& timer, const Parser::statistics& stats, bool json)
+{	const pair<const char*,unsigned long> counters[] =
+	{	{ "lines",             stats.Lines }
+	,	{ "tokens",            stats.Tokens }
+	,	{ "lookups",           stats.Lookups }
+	,	{ "macro_calls",       stats.MacroCalls }
+	,	{ "function_calls",    stats.FunctionCalls }
+	,	{ "rep_cycles",        stats.RepCycles }
+	,	{ "combine_tries",     stats.CombineTries }
+	,	{ "combined",          stats.Combined }
+	,	{ "small_immediates",  stats.SmallImmediates }
+	,	{ "ldi_fallbacks",     stats.LoadImmediates }
+	,	{ "macro_cache_hits",  stats.MacroCacheHits }
+	,	{ "macro_cache_misses",stats.MacroCacheMisses }
+	,	{ "macro_not_cached",  stats.MacroCacheSkipped }
+	,	{ "fold_hits",         stats.FoldHits }
+	,	{ "fold_misses",       stats.FoldMisses }
+	,	{ "optimized",         stats.Optimized }
+	,	{ "words_saved",       stats.OptimizerSaved }
+	};
+	if (json)
+	{	const char* sep = "{\"time\":{";
+		for (auto& t : timer.Phases)
+		{	fprintf(of, "%s\"%s\":%.6f", sep, t.first, t.second);
+			sep = ",";
+		}
+		fprintf(of, "%s\"optimize\":%.6f", sep, stats.OptimizeTime);
+		sep = "},\"count\":{";
+		for (auto& c : counters)
+		{	fprintf(of, "%s\"%s\":%lu", sep, c.first, c.second);
+			sep = ",";
+		}
+		fputs("}}\n", of);
+	} else
+	{	fputs("Phase                 time [ms]\n", of);
+		for (auto& t : timer.Phases)
+		{	fprintf(of, "%-20s%12.3f\n", t.first, t.second * 1000.);
+			// optimization is part of pass 2
+			if (strcmp(t.first, "pass2") == 0)
+				fprintf(of, "  %-18s%12.3f\n", "optimize", stats.OptimizeTime * 1000.);
+		}
+		fputs("Counter                   value\n", of);
+		for (auto& c : counters)
+			fprintf(of, "%-20s%12lu\n", c.first, c.second);
+	}
+}
+
+/// Print the report of option -R.
+/// @param of Target stream.
+/// @param parser Parser after pass 2.
+static void printOptimizations(FILE* of, const Parser& parser)
+{	for (auto& note : parser.Optimizations)
+	{	fprintf(of, "Info: %s: %s\n", note.Pass, note.Text.c_str());
+		if (note.PC != UINT_MAX)
+			fprintf(of, "  instruction at 0x%x\n", note.PC * (unsigned)sizeof(uint64_t));
+		if (!!note.Loc)
+			fprintf(of, "  generated at %s (%u)\n", parser.SourceFiles[note.Loc.File].Name.c_str(), note.Loc.Line);
+	}
+}
+
 int main(int argc, char **argv)
 {
 	const char* writeBIN = NULL;
@@ -103,11 +244,14 @@ int main(int argc, char **argv)
 	const char* writeHEADER = NULL;
 	bool check = false;
 	bool decorated_hex = false;
+	int statistics = 0;
+	bool streaming = false;
+	bool report = false;
 
 	Parser parser;
 
 	int c;
-	while ((c = getopt(argc, argv, "o:c:e:v:C:H:E:I:Vi")) != -1)
+	while ((c = getopt(argc, argv, "o:c:e:v:C:H:E:I:ViT::SO:R")) != -1)
 	{	switch (c)
 		{case 'o':
 			writeBIN = optarg; break;
@@ -133,6 +277,20 @@ int main(int argc, char **argv)
 			writePRE = optarg; break;
 		 case 'v':
 			decorated_hex = true; break;
+		 case 'T':
+			statistics = optarg && strcmp(optarg, "json") == 0 ? 2 : 1; break;
+		 case 'S':
+			streaming = true; break;
+		 case 'O':
+			try
+			{	parser.Optimize = Optimizer::ParsePasses(optarg);
+			} catch (const string& msg)
+			{	fprintf(stderr, "%s\n", msg.c_str());
+				return 1;
+			}
+			break;
+		 case 'R':
+			report = true; break;
 		}
 	}
 
@@ -150,6 +308,12 @@ int main(int argc, char **argv)
 #endif
 			" -I<path> Add search path for .include <...>\n"
 			" -V       Run instruction verifier and print warnings about suspicious code.\n"
+			" -T[json] Print timing and statistics of the assembly process.\n"
+			" -S       Write the output files while assembling to save memory.\n"
+			" -O<list> Run optimizer passes after assembly, comma separated or 'all'.\n"
+			"          Passes: bank, const, dead, delay, flags, hoist, ifconv, jump,\n"
+			"          layout, pair, peephole, pipeline, schedule, sfu, tmu\n"
+			" -R       Report the changes of the optimizer.\n"
 			, stderr);
 		return 1;
 	}
@@ -162,12 +326,34 @@ int main(int argc, char **argv)
 		}
 	}
 
+	StreamWriter writer;
+	if (streaming && (check || decorated_hex || parser.Optimize))
+	{	fputs("Warning: Streaming mode is not available in conjunction with -V, -v or -O.\n", stderr);
+		streaming = false;
+	}
+	if (streaming)
+	{	writer.BIN = writer.Open(writeBIN, "wb");
+		writer.CPP = writer.Open(writeCPP, "wt");
+		writer.CPP2 = writer.Open(writeCPP2, "wt");
+#ifdef __linux__
+		if ((writer.ELF.Target = writer.Open(writeELF, "wb")) != NULL)
+			writer.ELF.Begin();
+		if ((writer.ELF2.Target = writer.Open(writeELF2, "wb")) != NULL)
+		{	writer.ELF2.NoStandardSymbols = true;
+			writer.ELF2.Begin();
+		}
+#endif
+		parser.Streaming = &writer;
+	}
+
+	PhaseTimer timer;
 	try
 	{	// Pass 1
 		while (optind < argc)
 		{	parser.ParseFile(argv[optind]);
 			++optind;
 		}
+		timer.Stop("pass1");
 		switch (parser.OperationMode)
 		{case Parser::PASS1ONLY:
 			return !parser.Success;
@@ -178,17 +364,47 @@ int main(int argc, char **argv)
 		}
 		// Pass 2
 		parser.EnsurePass2();
+		timer.Stop("pass2");
+		if (report)
+			printOptimizations(stderr, parser);
 		// Validate
 		if (check)
 		{	Validator v;
 			v.Instructions = &parser.Instructions;
 			v.Info = &parser;
 			v.Validate();
+			timer.Stop("validate");
 		}
 
 		if (!parser.Success && parser.OperationMode != Parser::IRGNOREERRORS)
 			throw string("Aborted because of earlier errors.");
 		// Write results
+		if (streaming)
+		{	// Complete the files written during pass 2.
+			if (writer.BIN)
+				fclose(writer.BIN);
+			if (writer.CPP)
+			{	fputs(",\n", writer.CPP);
+				fclose(writer.CPP);
+			}
+			if (writer.CPP2)
+			{	fputc('\n', writer.CPP2);
+				fclose(writer.CPP2);
+			}
+#ifdef __linux__
+			if (writer.ELF.Target)
+			{	writer.ELF.End(parser, writeELF);
+				fclose(writer.ELF.Target);
+			}
+			if (writer.ELF2.Target)
+			{	writer.ELF2.End(parser, writeELF2);
+				fclose(writer.ELF2.Target);
+			}
+#endif
+			writer.Opened.clear();
+			writeBIN = writeCPP = writeCPP2 = writeELF = writeELF2 = NULL;
+			timer.Stop("write_stream");
+		}
 
 		if (writeHEADER)
 		{	FILE* of = fopen(writeHEADER, "wt");
@@ -217,6 +433,7 @@ int main(int argc, char **argv)
 			}
 			fputs("\n#endif\n", of);
 			fclose(of);
+			timer.Stop("write_H");
 		}
 
 		if (writeCPP)
@@ -240,6 +457,7 @@ int main(int argc, char **argv)
 
 			fputs(",\n", of);
 			fclose(of);
+			timer.Stop("write_c");
 		}
 		if (writeCPP2)
 		{	FILE* of = fopen(writeCPP2, "wt");
@@ -261,6 +479,7 @@ int main(int argc, char **argv)
 
 			fputc('\n', of);
 			fclose(of);
+			timer.Stop("write_C");
 		}
 
 		if (writeBIN)
@@ -276,6 +495,7 @@ int main(int argc, char **argv)
 			}
 			fwrite(&*parser.Instructions.begin(), sizeof(uint64_t), parser.Instructions.size(), of);
 			fclose(of);
+			timer.Stop("write_o");
 		}
 
 #ifdef __linux__
@@ -288,6 +508,7 @@ int main(int argc, char **argv)
 			}
 			we.Write(parser.Instructions, parser, writeELF);
 			fclose(we.Target);
+			timer.Stop("write_e");
 		}
 		if (writeELF2)
 		{	WriteELF we;
@@ -297,12 +518,16 @@ int main(int argc, char **argv)
 				return -1;
 			}
 			we.NoStandardSymbols = true;
-			we.Write(parser.Instructions, parser, writeELF);
+			we.Write(parser.Instructions, parser, writeELF2);
 			fclose(we.Target);
+			timer.Stop("write_E");
 		}
 #endif
+		if (statistics)
+			printStatistics(stderr, timer, parser.Stats, statistics > 1);
 	} catch (const string& msg)
-	{	fputs(msg.c_str(), stderr);
+	{	writer.Discard();
+		fputs(msg.c_str(), stderr);
 	  fputc('\n', stderr);
 		return 1;
 	}
@@ -0,0 +1,390 @@
+#include "Parser.h"
+#include "Validator.h"
+#include "Disassembler.h"
+#include "Eval.h"
+
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <cmath>
+#include <chrono>
+#include <functional>
+#include <algorithm>
+#include <getopt.h>
+
+using namespace std;
+
+
+/// Number of repetitions of each benchmark.
+static unsigned Repeat = 5;
+/// Directory for generated source files.
+static string TempDir = "/tmp";
+/// Files that are passed in front of each assembler input, e.g. vc4.qinc.
+static vector<string> Prefix;
+
+/// Amount of work done by a single benchmark run.
+struct workload
+{	unsigned long  Units = 0;        ///< Work units, e.g. source lines or tokens.
+	unsigned long  Instructions = 0; ///< Processed GPU instructions.
+};
+
+/// Receiver for streaming mode that discards the code.
+struct nullSink : public Parser::codeSink
+{	virtual void Write(const uint64_t*, size_t) {}
+};
+
+/// @brief Run a benchmark \ref Repeat times and print the timing statistics.
+/// @details The median is used for the throughput because it is robust against outliers.
+/// @param name Name of the benchmark.
+/// @param unit Name of the work unit of \ref workload::Units.
+/// @param fn Benchmark function, returns the work of one run.
+static void measure(const string& name, const char* unit, const function<workload()>& fn)
+{	vector<double> times;
+	workload work;
+	for (unsigned i = 0; i < Repeat; ++i)
+	{	auto start = chrono::steady_clock::now();
+		work = fn();
+		times.push_back(chrono::duration<double>(chrono::steady_clock::now() - start).count());
+	}
+	double mean = 0;
+	for (double t : times)
+		mean += t;
+	mean /= times.size();
+	double var = 0;
+	for (double t : times)
+		var += (t - mean) * (t - mean);
+	double rsd = times.size() > 1 ? sqrt(var / (times.size() - 1)) / mean : 0;
+	sort(times.begin(), times.end());
+	double median = times[times.size() / 2];
+
+	printf("%-32s%11.3f%11.3f%6.1f%%%14.0f %-12s", name.c_str(), median * 1000., times.front() * 1000., rsd * 100., work.Units / median, unit);
+	if (work.Instructions)
+		printf("%14.0f", work.Instructions / median);
+	putchar('\n');
+	fflush(stdout);
+}
+
+/// Count the lines of a set of source files.
+static unsigned long countLines(const vector<string>& files)
+{	unsigned long lines = 0;
+	for (const string& file : files)
+	{	FILE* f = fopen(file.c_str(), "r");
+		if (!f)
+			throw "Failed to open " + file + '.';
+		char buf[65536];
+		size_t n;
+		while ((n = fread(buf, 1, sizeof buf, f)) != 0)
+			lines += count(buf, buf + n, '\n');
+		fclose(f);
+	}
+	return lines;
+}
+
+/// Read the lines of a source file into memory.
+static void readLines(const string& file, vector<string>& lines)
+{	FILE* f = fopen(file.c_str(), "r");
+	if (!f)
+		throw "Failed to open " + file + '.';
+	char buf[1024];
+	while (fgets(buf, sizeof buf, f))
+		lines.emplace_back(buf);
+	fclose(f);
+}
+
+/// @brief Assemble a set of files with a new parser instance.
+/// @param files Source files in order.
+/// @param streaming Use streaming mode, i.e. do not keep the result.
+/// @param result Receives the code unless streaming mode is used. May be NULL.
+/// @param stats Receives the parser statistics. May be NULL.
+/// @return Number of instructions.
+static unsigned long assemble(const vector<string>& files, bool streaming, vector<uint64_t>* result = NULL, Parser::statistics* stats = NULL)
+{	Parser parser;
+	nullSink sink;
+	if (streaming)
+		parser.Streaming = &sink;
+	for (const string& file : files)
+		parser.ParseFile(file);
+	if (!parser.Success)
+		throw "Failed to assemble " + files.back() + '.';
+	parser.EnsurePass2();
+	if (!parser.Success)
+		throw "Failed to assemble " + files.back() + '.';
+	if (stats)
+		*stats = parser.Stats;
+	unsigned long count = parser.Flushed + parser.Instructions.size();
+	if (result)
+		result->swap(parser.Instructions);
+	return count;
+}
+
+/// @brief Write a synthetic program.
+/// @details The program consists of blocks of 16 instructions with a mix of
+/// ALU instructions, small immediates, ldi, regfile access and conditional branches.
+/// The code passes the instruction verifier without warnings.
+/// @param name File name.
+/// @param count Number of instructions, rounded up to a multiple of 16.
+static void writeProgram(const string& name, unsigned long count)
+{	FILE* f = fopen(name.c_str(), "w");
+	if (!f)
+		throw "Failed to create " + name + '.';
+	for (unsigned long i = 0; i < count; i += 16)
+	{	unsigned r = i / 16 % 32;
+		fprintf(f,
+			":block_%lu\n"
+			"	ldi r0, 0x%lx\n"
+			"	mov r1, %lu\n"
+			"	add r2, r0, r1;      fmul r3, r0, r1\n"
+			"	mov ra%u, r2;        mov rb%u, r3\n"
+			"	sub r0, r2, r3;      v8min r1, r2, r3\n"
+			"	shl r2, r0, 3\n"
+			"	mov.setf -, r1\n"
+			"	brr.anyz -, r:block_%lu\n"
+			"	nop\n"
+			"	nop\n"
+			"	nop\n"
+			"	and r0, ra%u, rb%u\n"
+			"	fadd r1, r0, r2;     fmul r2, r1, r3\n"
+			"	itof r3, r2\n"
+			"	asr r0, r3, r1\n"
+			"	mov -, 0\n",
+			i, i * 0x9e3779b9UL & 0xffffffffUL, i / 16 % 16, r, r, i + 16, (r + 31) % 32, (r + 31) % 32);
+	}
+	fprintf(f, ":block_%lu\n"
+		"	thrend\n"
+		"	nop\n"
+		"	nop\n", (count + 15) & ~15UL);
+	fclose(f);
+}
+
+/// Write a program with \a count calls to the same macro.
+static void writeMacroProgram(const string& name, unsigned long count)
+{	FILE* f = fopen(name.c_str(), "w");
+	if (!f)
+		throw "Failed to create " + name + '.';
+	fputs(".macro bench_macro, a, b\n"
+		"	add r0, r1, a;       fmul r2, r3, r0\n"
+		"	mov ra0, b\n"
+		"	ldi rb0, a * b + 1\n"
+		".endm\n", f);
+	for (unsigned long i = 0; i < count; ++i)
+		fprintf(f, "	bench_macro %lu, %lu\n", i % 4, i % 3);
+	fclose(f);
+}
+
+/// Write a program with \a count lines of constant expressions.
+static void writeExpressionProgram(const string& name, unsigned long count)
+{	FILE* f = fopen(name.c_str(), "w");
+	if (!f)
+		throw "Failed to create " + name + '.';
+	for (unsigned long i = 0; i < count; ++i)
+		fprintf(f, ".set bench_%lu, (%lu + 2) * 3 - 0x40 / 2 + (5 << 2) ^ 0x1f | ~7 & 0xff00 %% 7\n", i % 64, i);
+	fclose(f);
+}
+
+/// Benchmarks of internal components.
+static void microBenchmarks()
+{	const unsigned long lines = 20000;
+	const string exprfile = TempDir + "/vc4bench_expr.qasm";
+	const string macrofile = TempDir + "/vc4bench_macro.qasm";
+	const string progfile = TempDir + "/vc4bench_code.qasm";
+	writeExpressionProgram(exprfile, lines);
+	writeMacroProgram(macrofile, lines);
+	writeProgram(progfile, 10000);
+
+	try
+	{	// Lexer only, the source lines are already in memory.
+		vector<string> source;
+		readLines(exprfile, source);
+		readLines(progfile, source);
+		measure("Parser::NextToken", "tokens/s", [&source]()
+		{	workload work;
+			Parser parser;
+			for (const string& line : source)
+				work.Units += parser.Tokenize(line.c_str());
+			return work;
+		});
+
+		// Assembler run including file I/O and both passes. .set lines only generate no code.
+		measure("assemble .set expressions", "tokens/s", []()
+		{	workload work;
+			Parser::statistics stats;
+			vector<string> files(Prefix);
+			files.push_back(TempDir + "/vc4bench_expr.qasm");
+			assemble(files, false, NULL, &stats);
+			work.Units = stats.Tokens;
+			return work;
+		});
+
+		// Expression evaluator without parser.
+		measure("Eval", "exprs/s", []()
+		{	workload work;
+			for (unsigned i = 0; i < 200000; ++i)
+			{	Eval eval;
+				eval.PushOperator(Eval::BRO);
+				eval.PushValue(exprValue((int64_t)i));
+				eval.PushOperator(Eval::ADD);
+				eval.PushValue(exprValue((int64_t)2));
+				eval.PushOperator(Eval::BRC);
+				eval.PushOperator(Eval::MUL);
+				eval.PushValue(exprValue((int64_t)3));
+				eval.PushOperator(Eval::SUB);
+				eval.PushValue(exprValue((int64_t)7));
+				eval.PushOperator(Eval::XOR);
+				eval.PushValue(exprValue((int64_t)0x1f));
+				eval.Evaluate();
+			}
+			work.Units = 200000;
+			return work;
+		});
+
+		// Macro expansion cache.
+		measure("macro replay", "lines/s", []()
+		{	workload work;
+			vector<string> files(Prefix);
+			files.push_back(TempDir + "/vc4bench_macro.qasm");
+			work.Units = countLines(files);
+			work.Instructions = assemble(files, false);
+			return work;
+		});
+
+		vector<string> files(Prefix);
+		files.push_back(progfile);
+		vector<uint64_t> code;
+		assemble(files, false, &code);
+
+		measure("Inst::decode/encode", "insts/s", [&code]()
+		{	workload work;
+			Inst inst;
+			uint64_t check = 0;
+			for (unsigned i = 0; i < 100; ++i)
+				for (uint64_t c : code)
+				{	inst.decode(c);
+					check += inst.encode();
+				}
+			if (check == 0x0123456789abcdefULL) // avoid dead code elimination
+				puts("");
+			work.Units = work.Instructions = 100 * code.size();
+			return work;
+		});
+
+		FILE* null = fopen("/dev/null", "w");
+		measure("Disassembler::Disassemble", "insts/s", [&code, null]()
+		{	workload work;
+			Disassembler dis;
+			dis.Out = null;
+			dis.Instructions = code;
+			dis.ScanLabels();
+			dis.Disassemble();
+			work.Units = work.Instructions = code.size();
+			return work;
+		});
+		fclose(null);
+
+		measure("Validator::Validate", "insts/s", [&code]()
+		{	workload work;
+			Validator v;
+			v.Instructions = &code;
+			v.Validate();
+			work.Units = work.Instructions = code.size();
+			return work;
+		});
+	} catch (...)
+	{	remove(exprfile.c_str());
+		remove(macrofile.c_str());
+		remove(progfile.c_str());
+		throw;
+	}
+	remove(exprfile.c_str());
+	remove(macrofile.c_str());
+	remove(progfile.c_str());
+}
+
+/// End to end run of the assembler over an existing source file.
+static void fileBenchmark(const string& name)
+{	vector<string> files(Prefix);
+	files.push_back(name);
+	unsigned long lines = countLines(files);
+	measure(name, "lines/s", [&files, lines]()
+	{	workload work;
+		work.Units = lines;
+		work.Instructions = assemble(files, false);
+		return work;
+	});
+}
+
+/// End to end run of the assembler over a synthetic program.
+static void syntheticBenchmark(unsigned long count)
+{	const string name = TempDir + "/vc4bench_" + to_string(count) + ".qasm";
+	writeProgram(name, count);
+	try
+	{	vector<string> files(Prefix);
+		files.push_back(name);
+		unsigned long lines = countLines(files);
+		// Use streaming mode to keep the memory footprint small for large programs.
+		measure("synthetic " + to_string(count), "lines/s", [&files, lines]()
+		{	workload work;
+			work.Units = lines;
+			work.Instructions = assemble(files, true);
+			return work;
+		});
+	} catch (...)
+	{	remove(name.c_str());
+		throw;
+	}
+	remove(name.c_str());
+}
+
+int main(int argc, char **argv)
+{
+	vector<unsigned long> sizes = { 10000, 100000, 1000000 };
+	bool micro = true;
+
+	int c;
+	while ((c = getopt(argc, argv, "r:s:t:p:m")) != -1)
+	{	switch (c)
+		{case 'r':
+			Repeat = max(atoi(optarg), 1); break;
+		 case 's':
+			sizes.clear();
+			for (char* cp = optarg; *cp; )
+			{	sizes.push_back(strtoul(cp, &cp, 10));
+				cp += strspn(cp, ", ");
+			}
+			break;
+		 case 't':
+			TempDir = optarg; break;
+		 case 'p':
+			Prefix.emplace_back(optarg); break;
+		 case 'm':
+			micro = false; break;
+		 default:
+			fputs("vc4bench V0.2.2\n"
+				"Usage: vc4bench [-r <repeat>] [-s <sizes>] [-t <dir>] [-p <file>] [-m] [<qasm-file(s)>]\n"
+				" -r<n>     Repeat each benchmark n times, default 5.\n"
+				" -s<sizes> Comma separated instruction counts of the synthetic programs.\n"
+				"           Default 10000,100000,1000000. 0 disables the synthetic programs.\n"
+				" -t<dir>   Directory for the generated programs, default /tmp.\n"
+				" -p<file>  Prepend this file to each assembler input, e.g. vc4.qinc.\n"
+				" -m        Skip the micro benchmarks.\n"
+				"Each qasm file is assembled separately.\n"
+				, stderr);
+			return 1;
+		}
+	}
+
+	printf("%-32s%11s%11s%7s%14s %-12s%14s\n", "benchmark", "median[ms]", "min[ms]", "rsd", "throughput", "", "insts/s");
+	try
+	{	if (micro)
+			microBenchmarks();
+		for (; optind < argc; ++optind)
+			fileBenchmark(argv[optind]);
+		for (auto size : sizes)
+			if (size)
+				syntheticBenchmark(size);
+	} catch (const string& msg)
+	{	fputs(msg.c_str(), stderr);
+		fputc('\n', stderr);
+		return 1;
+	}
+	return 0;
+}
@@ -0,0 +1,39 @@
+# Tests for the optimizer pass bank, assembled with -O bank,pair
+
+# registers written before use can move to the other register file
+    mov  ra1, unif
+    mov  ra2, unif
+    mov  ra3, unif
+    mov  rb4, unif
+    mov  rb5, unif
+    nop
+    fadd r0, ra1, r1
+    fmul r1, ra2, r2
+    add  r2, rb4, r3
+    mul24 r3, rb5, r0
+
+# live at the start of the program: ra6 keeps its register file
+    fadd r0, ra6, r1
+    fmul r1, ra3, r2
+
+# regfile A unpack: ra7 keeps its register file
+    mov  ra7, unif
+    mov  ra8, unif
+    nop
+    mov.unpack16a r0, ra7
+    fmul r1, ra8, r2
+
+# branch source: ra10 keeps its register file
+    mov  ra9, unif
+    mov  ra10, unif
+    nop
+    fadd r0, ra10, r1
+    fmul r1, ra9, r2
+    bra  -, ra10
+    nop
+    nop
+    nop
+
+    nop; thrend
+    nop
+    nop
@@ -0,0 +1,33 @@
+# Tests for the optimizer pass const, assembled with -O const
+
+# const: constants from small immediate operations in free ALU slots
+:const
+    mov  r3, unif
+    ldi  r0, 0x100
+    fadd r1, r3, r3
+    fmul r2, r3, r3
+    ldi  ra2, 0x01010101
+    fadd r1, r1, r2
+    ldi  r2, 0x10f
+    fmul r3, r1, r3
+    mov  rb3, ra2
+
+# const: accumulators do not survive the thread switch
+:const_thrsw
+    ldi  r0, 0x100
+    mov  ra1, unif
+    nop
+    thrsw
+    nop
+    nop
+    fadd r1, ra1, ra1
+    ldi  r2, 0x10f
+    fmul r3, r1, ra1
+    ldi  r0, 0x200
+    fadd r1, r1, ra1
+    ldi  r2, 0x20f
+    fmul r3, r1, ra1
+
+    nop; thrend
+    nop
+    nop
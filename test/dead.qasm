@@ -0,0 +1,53 @@
+# Tests for the optimizer pass dead, assembled with -O dead
+
+# overwritten in the next block
+    mov  r0, 1
+    mov  ra1, unif
+    brr  -, r:next
+    nop
+    nop
+    nop
+:next
+    mov  r0, 2
+    mov  r1, r0
+
+# never read in any path
+    mov.setf -, r1
+    brr.anyz -, r:skip
+    mov  rb2, 3
+    nop
+    nop
+    mov  r2, r1
+    mov  r3, r1; mov rb3, r1
+:skip
+    fadd r2, r1, r1; fmul ra4, r1, r1
+    mov  tmu0_s, r2
+
+# removed in the middle of a block
+    mov  r1, unif
+    mov  ra5, r1
+    mov  r3, 1
+    mov  tmu0_s, r1
+
+# read in a loop
+    mov  r3, 0
+:loop
+    sub.setf r3, r3, 1
+    brr.anynz -, r:loop
+    nop
+    nop
+    nop
+
+# flags are still live
+    mov.setf r0, r1
+    mov  r1, 4
+    mov.ifz r2, r0
+    mov  vpm, r2
+
+    nop; thrend
+    nop
+    nop
+
+# unreachable behind thrend
+    mov  r0, 5
+    mov  vpm, r0
@@ -0,0 +1,22 @@
+# Tests for the optimizer pass delay, assembled with -O delay
+
+# delay: fill branch delay slots
+:delay
+    mov  r0, ra24
+    fadd r1, r0, r0
+    mov  rb25, r0
+    sub.setf -, r1, ra26
+    brr.anynz -, r:delay
+    nop
+    nop
+    nop
+    mov  r2, rb27
+    mov  r3, ra28
+    brr  -, r:delay
+    nop
+    nop
+    nop
+
+    nop; thrend
+    nop
+    nop
@@ -0,0 +1,25 @@
+# Tests for data directives
+
+# multiple values
+.float   1.0, 2.0, -0.5
+.short   1, 2, 3, 4
+
+# .table, compiled
+.table   float, i, 4, cos(i * 3.14159265358979 / 2)
+.table   byte, i, 5, i * 3 + 1
+.align   8
+# .table with functions
+.set     twice(x) 2 * x
+.table   int, i, 3, twice(i) - 1
+
+# .incbin
+.incbin  "directives.bin"
+.align   4
+.incbin  "directives.bin", 2
+.align   8
+.incbin  "directives.bin", 1, 2
+.align   8
+
+:code
+    nop
+    mov  r0, 1
@@ -0,0 +1,34 @@
+# Tests for the optimizer pass flags, assembled with -O flags,pair
+
+# flags from the same operands
+    mov  r0, unif
+    mov  r1, unif
+    mov.setf -, r0
+    mov.ifz ra0, r1
+    mov.setf -, r0
+    mov.ifnz rb0, r1
+
+# the operands changed in between
+    sub.setf r0, r0, 1
+    mov.ifz ra1, r1
+    sub.setf r0, r0, 1
+    mov.ifz rb1, r1
+
+# flags that are never read
+    fadd.setf r2, r0, r1
+    fmul ra2, r0, r1
+    and.setf -, r0, r1
+    mov.setf r3, r1
+
+# flags read by a branch
+    and.setf -, r3, 1
+    brr.anyz -, r:end
+    nop
+    nop
+    nop
+    mov  vpm, r2
+:end
+    mov  vpm, r3
+    nop; thrend
+    nop
+    nop
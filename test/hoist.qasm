@@ -0,0 +1,40 @@
+# Tests for the optimizer pass hoist, assembled with -O hoist
+
+# hoist: move loop invariant constants in front of the loop
+:hoist_pre
+    mov  r2, unif
+:hoist
+    ldi  r3, 0x12345
+    ldi  rb11, 0x54321
+    add  r2, r2, r3
+    add  r1, r2, rb11
+    mov  rb11, r1
+    sub.setf -, r1, r2
+    brr.anynz -, r:hoist
+    nop
+    nop
+    nop
+
+# hoist: accumulators do not survive the thread switch, regfile registers do
+:hoist_thrsw_pre
+    mov  ra2, unif
+    nop
+    nop
+:hoist_thrsw
+    ldi  r1, 0x12345
+    ldi  rb12, 0x6789
+    add  r3, r1, 1
+    add  ra3, r3, ra2
+    nop
+    thrsw
+    nop
+    nop
+    sub.setf -, ra3, rb12
+    brr.anynz -, r:hoist_thrsw
+    nop
+    nop
+    nop
+
+    nop; thrend
+    nop
+    nop
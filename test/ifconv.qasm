@@ -0,0 +1,32 @@
+# Tests for the optimizer pass ifconv, assembled with -O ifconv
+
+# ifconv: short forward branches by conditional execution
+:ifconv
+    mov  ra4, unif
+    mov  r1, elem_num
+    sub.setf -, ra4, 5
+    brr.anyz -, r:ifconv_uni
+    nop
+    nop
+    nop
+    add  r0, r0, 1
+    mov  rb4, r0
+:ifconv_uni
+    sub.setf -, r1, 3
+    brr.allz -, r:ifconv_cond
+    nop
+    nop
+    nop
+    mov.ifnz r2, r1
+:ifconv_cond
+    sub.setf -, r1, 3
+    brr.anyz -, r:ifconv_elem
+    nop
+    nop
+    nop
+    mov  r3, r1
+:ifconv_elem
+
+    nop; thrend
+    nop
+    nop
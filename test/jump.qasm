@@ -0,0 +1,52 @@
+# Tests for the optimizer pass jump, assembled with -O jump
+
+# branches to unconditional branches or branches with the same condition
+    mov  r0, unif
+    mov.setf -, r0
+    brr.allz -, r:a
+    nop
+    nop
+    nop
+
+# branch to the next instruction
+    mov  r1, unif
+    brr  -, r:next
+    mov  ra1, r1
+    nop
+    nop
+:next
+    mov  r2, unif
+    brr.anyc -, r:c
+    nop
+    nop
+    nop
+    brr  -, r:end
+    nop
+    nop
+    nop
+
+# code that was unreachable before is kept
+    mov  r3, 1
+
+# no longer reachable after redirection
+:a
+    brr  -, r:b
+    nop
+    nop
+    nop
+:b
+    brr  -, r:end
+    nop
+    nop
+    nop
+:c
+    brr.anyc -, r:d
+    nop
+    nop
+    nop
+:d
+    mov  ra2, r2
+:end
+    nop; thrend
+    nop
+    nop
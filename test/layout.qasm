@@ -0,0 +1,17 @@
+# Tests for the optimizer pass layout, assembled with -O layout
+
+# layout: move the target of an unconditional branch behind it
+    mov  ra27, unif
+    mov  rb27, unif
+    mov  r0, unif
+    brr  -, r:layout
+    nop
+    nop
+    nop
+.int 0x12345678, 0x9abcdef0
+:layout
+    mov  r1, ra27
+
+    nop; thrend
+    nop
+    nop
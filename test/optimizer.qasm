@@ -0,0 +1,44 @@
+# Interaction of the optimizer passes, assembled with -O all
+# The results are written to vpm, so they are not removed as dead writes.
+
+# loop with a TMU load, a loop invariant constant, an SFU request and a short branch
+    mov  ra1, unif
+    mov  ra2, unif
+    mov  r3, 0
+    nop
+:loop
+    mov  t0s, ra2
+    nop; ldtmu0
+    fadd r0, r4, r4
+    mov  sfu_recip, r0
+    nop
+    nop
+    fadd r3, r3, r4
+    ldi  rb5, 0x12345
+    and.setf -, ra1, 1
+    brr.allz -, r:even
+    nop
+    nop
+    nop
+    add  r3, r3, rb5
+:even
+    sub.setf ra1, ra1, 1
+    add  ra2, ra2, 4
+    brr.anynz -, r:loop
+    nop
+    nop
+    nop
+    mov  vpm, r3
+
+# constants and redundant flags behind the loop
+    ldi  r1, 0x100
+    ldi  r2, 0x10f
+    sub.setf -, r1, r2
+    mov.ifz r0, r1
+    sub.setf -, r1, r2
+    mov.ifnz r0, r2
+    mov  vpm, r0
+
+    nop; thrend
+    nop
+    nop
@@ -0,0 +1,52 @@
+# Tests for the optimizer pass pair, assembled with -O pair
+
+# pair: independent instructions
+    mov  r0, unif
+    fadd r1, r0, r0
+    mov  ra1, 1
+    fmul r2, r1, r1
+    mov  rb2, 1
+    add  r3, r0, ra1
+
+# pair: read port conflicts and dependencies
+    add  ra3, ra4, r0
+    add  rb5, ra6, r1
+    sub  r2, r2, ra3
+    mov  r0, r2
+
+# pair: no register file read immediately after write
+    mov  ra5, r0
+    fadd r2, r3, r3
+    fmul r1, ra5, r3
+
+# pair: flags and conditions
+    sub.setf -, r0, r1
+    mov.ifz  r2, r3
+    mov  r3, ra7
+    mov.ifnz r1, 0
+
+# pair: SFU and TMU
+    mov  sfu_recip, r0
+    mov  r1, ra8
+    mov  r2, rb9
+    nop
+    fmul r3, r4, r1
+    add  t0s, r0, r2
+    mov  r0, ra10
+    nop; ldtmu0
+    mov  ra11, r4
+
+# pair: not across labels and branches
+:label
+    mov  r0, ra12
+    mov  r1, rb13
+    brr  -, r:label
+    mov  r2, ra14
+    mov  r3, rb15
+    nop
+    mov  r0, ra16
+    mov  r1, rb17
+
+    nop; thrend
+    nop
+    nop
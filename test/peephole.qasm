@@ -0,0 +1,23 @@
+# Tests for the optimizer pass peephole, assembled with -O peephole
+
+# peephole: rewrite instruction sequences
+:peephole
+    mov  r0, ra29
+    mov  r0, r0
+    mov  rb30, r1
+    mov  ra31, r2
+    mov  r3, unif
+    fadd r3, ra31, r3
+    add  r2, r3, rb30
+    mov  rb30, r1
+    ldi  r1, 0x12345
+    mov  rb31, r1
+    mov  r1, ra0
+    mov  t0s, r0
+    mov  t1s, r1
+    add  sfu_exp, r2, rb30
+    mov  vw_setup, rb31
+
+    nop; thrend
+    nop
+    nop
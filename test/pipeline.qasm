@@ -0,0 +1,21 @@
+# Tests for the optimizer pass pipeline, assembled with -O pipeline
+
+# pipeline: TMU requests of the next iteration
+    mov  ra5, unif
+    mov  r2, unif
+.pipeline
+:pipeline
+    add  r2, r2, 4
+    mov  t0s, r2
+    nop
+    nop; ldtmu0
+    fadd r3, r3, r4
+    sub.setf ra5, ra5, 1
+    brr.anynz -, r:pipeline
+    nop
+    nop
+    nop
+
+    nop; thrend
+    nop
+    nop
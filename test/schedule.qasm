@@ -0,0 +1,26 @@
+# Tests for the optimizer pass schedule, assembled with -O schedule
+
+# schedule: hide the TMU latency and the register file read after write
+    mov  t1s, ra18
+    nop; ldtmu1
+    fadd ra19, r4, r4
+    nop
+    fmul r0, ra19, r4
+    mov  r1, rb20
+    add  r2, r1, rb21
+    mov  r3, ra22
+
+# schedule: labels refer to the start of the block
+:sched
+    mov  r0, 1
+    mov  ra23, r1
+    nop
+    mov  r2, ra23
+    brr  -, r:sched
+    nop
+    nop
+    nop
+
+    nop; thrend
+    nop
+    nop
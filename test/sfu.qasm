@@ -0,0 +1,21 @@
+# Tests for the optimizer pass sfu, assembled with -O sfu
+
+# sfu: independent requests back to back, fill the latency
+    mov  r0, unif
+    mov  r1, unif
+    mov  recip, r0
+    nop
+    nop
+    mov  ra24, r4
+    fadd ra25, r1, r1
+    mov  recipsqrt, r1
+    nop
+    nop
+    mov  rb24, r4
+    mov  r2, unif
+    fmul ra26, r2, r2
+    mov  r3, 3
+
+    nop; thrend
+    nop
+    nop
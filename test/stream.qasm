@@ -0,0 +1,37 @@
+# Streaming mode (-S) must generate the same code as the normal mode.
+# The code is large enough to be written in several blocks.
+
+.macro body, i
+	mov r0, i
+	add r1, r0, 1 ; mov r2, r0
+	.back 1
+	mov r3, i
+	.endb
+:1	sub.setf r1, r1, 1
+	brr.anynz -, r:1
+	nop
+	nop
+	nop
+.endm
+
+	brr -, r:end
+	nop
+	nop
+	nop
+.rep i, 1500
+	body i & 15
+:2	fadd r0, r1, r2
+	.clone r:2, 1
+	.short i, -i
+	.table byte, j, 3, i + j & 0x7f
+	.align 8
+.endr
+.rep i, 5000
+	mov r0, r1
+.endr
+.incbin "directives.bin"
+.align 8
+:end
+	thrend
+	nop
+	nop
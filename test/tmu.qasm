@@ -0,0 +1,57 @@
+# Tests for the optimizer pass tmu, assembled with -O tmu
+
+# thrsw: the program runs multithreaded, i.e. 4 pending TMU requests per thread
+    nop; thrsw
+    nop
+    nop
+
+# TMU requests move in front of the ldtmu of previous requests
+    mov  r0, unif
+    mov  r1, unif
+    mov  t0s, r0
+    nop; ldtmu0
+    fadd ra1, r4, r4
+    mov  t0s, r1
+    nop; ldtmu0
+    fadd rb1, r4, r4
+
+# no more requests than the FIFO depth
+    mov  r0, unif
+    mov  r1, unif
+    mov  t1s, r0
+    mov  t1s, r1
+    mov  t1s, r0
+    mov  t1s, r1
+    nop; ldtmu1
+    mov  ra2, r4
+    mov  t1s, r0
+    nop; ldtmu1
+    mov  rb2, r4
+    nop; ldtmu1
+    mov  ra3, r4
+    nop; ldtmu1
+    mov  rb3, r4
+    nop; ldtmu1
+    mov  ra4, r4
+
+# thread switch in front of ldtmu shortly after the request
+    mov  r0, unif
+    mov  t0s, r0
+    fadd ra5, ra1, ra1
+    fmul rb6, rb1, rb1
+    mov  ra7, 1
+    nop; ldtmu0
+    mov  ra8, r4
+
+# no thread switch while accumulators are live
+    mov  r0, unif
+    mov  t0s, r0
+    mov  r1, 2
+    nop
+    nop
+    nop; ldtmu0
+    add  ra9, r4, r1
+
+    nop; thrend
+    nop
+    nop
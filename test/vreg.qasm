@@ -0,0 +1,55 @@
+# Tests for virtual registers declared by .vreg
+
+.vreg count, ptr, sum, tmp
+
+# reserved by the program
+    mov  ra0, unif
+    mov  rb0, unif
+
+    mov  count, unif
+    mov  ptr, unif
+    mov  sum, 0
+
+# loop with virtual registers live across the back edge
+:loop
+    mov  t0s, ptr
+    add  ptr, ptr, 4
+    nop; ldtmu0
+    fadd sum, sum, r4
+    sub.setf count, count, 1
+    brr.anynz -, r:loop
+    nop
+    nop
+    nop
+
+# read immediately after write prefers an accumulator
+    fmul tmp, sum, ra0
+    fadd tmp, tmp, rb0
+
+# virtual registers in macros
+.macro scale, dst, src
+    .lvreg t
+    fmul t, src, src
+    nop
+    fadd dst, t, src
+.endm
+    scale sum, tmp
+
+# two virtual registers read by one instruction
+    add  tmp, sum, ptr
+    mov  vpm, tmp
+
+# live across a thread switch, never an accumulator
+.vreg keep, copy
+    mov  keep, unif
+    mov  copy, keep
+    nop
+    thrsw
+    nop
+    nop
+    add  tmp, keep, copy
+    mov  vpm, tmp
+
+    nop; thrend
+    nop
+    nop